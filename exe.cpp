@@ -1,26 +1,345 @@
 #include <iostream>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <coroutine>
+#include <deque>
+#include <future>
+#include <utility>
+#include <span>
 #include <atomic>
 #include <thread>
 #include <vector>
 #include <random>
 #include <iomanip>
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <memory>
+#include <optional>
+#include <limits>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
 #include <sstream>
 #include <fstream>
+#include <stdexcept>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
 
 // Forward declarations
+class MaintenanceScheduler;
+class Clock;
+class Bucket;
 class TokenBucket;
-class RateLimiter;
+template <typename Limits> class BasicAtomicTokenBucket;
+class ShardedClientMap;
+class CompactBucketTable;
+class TokenLeaseBackend;
+template <typename BucketPolicy, typename MapPolicy, typename MetricsPolicy, typename ClockPolicy>
+class BasicRateLimiter;
 struct Statistics;
 struct ClientStatistics;
 struct RateLimiterConfig;
 
+// Background thread running periodic maintenance jobs (eviction ticks, clock
+// updates, ...). It sleeps on a condition variable until the earliest job is
+// due, so stop() and cancel() take effect immediately instead of after a full
+// interval. One scheduler can be shared by several limiters; jobs run one at a
+// time on its thread and should stay short.
+class MaintenanceScheduler {
+public:
+    using TaskId = uint64_t;
+    
+private:
+    struct Task {
+        TaskId id;
+        std::chrono::steady_clock::duration interval;
+        std::chrono::steady_clock::time_point nextRun;
+        std::function<void()> run;
+    };
+    
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;        // New job, cancel or stop
+    std::condition_variable taskDone_;      // Signalled after each job run
+    std::vector<Task> tasks_;
+    TaskId nextId_ = 1;
+    TaskId runningId_ = 0;
+    bool stopping_ = false;
+    std::thread worker_;
+    
+public:
+    MaintenanceScheduler() : worker_([this]() { runLoop(); }) {}
+    
+    ~MaintenanceScheduler() {
+        stop();
+    }
+    
+    MaintenanceScheduler(const MaintenanceScheduler&) = delete;
+    MaintenanceScheduler& operator=(const MaintenanceScheduler&) = delete;
+    
+    // Runs `task` every `interval`, first one interval from now. Returns 0 once
+    // the scheduler has been stopped.
+    TaskId schedule(std::chrono::steady_clock::duration interval, std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return 0;
+        }
+        
+        interval = std::max(interval, std::chrono::steady_clock::duration(1));
+        TaskId id = nextId_++;
+        tasks_.push_back({id, interval, std::chrono::steady_clock::now() + interval, std::move(task)});
+        wakeup_.notify_one();
+        return id;
+    }
+    
+    // Removes a job. When it returns the job is not running and never will
+    // again, so the caller may destroy whatever the job captured. Safe to call
+    // from inside a job (it then only prevents future runs).
+    void cancel(TaskId id) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        tasks_.erase(std::remove_if(tasks_.begin(), tasks_.end(),
+                                    [id](const Task& task) { return task.id == id; }),
+                     tasks_.end());
+        
+        if (std::this_thread::get_id() != worker_.get_id()) {
+            taskDone_.wait(lock, [this, id]() { return runningId_ != id; });
+        }
+    }
+    
+    // Wakes the worker, waits for a running job to finish and drops the rest.
+    // Idempotent.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            tasks_.clear();
+        }
+        wakeup_.notify_all();
+        
+        if (worker_.joinable() && std::this_thread::get_id() != worker_.get_id()) {
+            worker_.join();
+        }
+    }
+    
+    size_t taskCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tasks_.size();
+    }
+
+private:
+    void runLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            if (tasks_.empty()) {
+                wakeup_.wait(lock);
+                continue;
+            }
+            
+            auto due = std::min_element(tasks_.begin(), tasks_.end(),
+                                        [](const Task& a, const Task& b) { return a.nextRun < b.nextRun; });
+            auto now = std::chrono::steady_clock::now();
+            if (due->nextRun > now) {
+                wakeup_.wait_until(lock, due->nextRun);
+                continue;
+            }
+            
+            // Fixed-rate schedule, but skip missed runs rather than bursting
+            due->nextRun = std::max(due->nextRun + due->interval, now);
+            runningId_ = due->id;
+            std::function<void()> run = due->run;
+            
+            lock.unlock();
+            run();
+            lock.lock();
+            
+            runningId_ = 0;
+            taskDone_.notify_all();
+        }
+    }
+};
+
+// Time source for refills, eviction and latency measurement. Values are on the
+// steady_clock timeline so they compare with ClientStatistics::lastRefill.
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual std::chrono::steady_clock::time_point now() const = 0;
+    
+    // Shared precise clock used when no clock is configured
+    static const Clock& precise();
+};
+
+// Precise clock: steady_clock::now() on every call (the default)
+class SteadyClock : public Clock {
+public:
+    std::chrono::steady_clock::time_point now() const override {
+        return std::chrono::steady_clock::now();
+    }
+};
+
+inline const Clock& Clock::precise() {
+    static const SteadyClock clock;
+    return clock;
+}
+
+// Coarse clock: a background thread stores steady_clock::now() into an atomic
+// every `resolution`, so now() is a single relaxed load. The updates can run
+// on a shared MaintenanceScheduler instead of a dedicated thread.
+class CoarseClock : public Clock {
+private:
+    std::atomic<int64_t> nowNs_;
+    std::atomic<bool> stop_{false};
+    std::thread ticker_;
+    std::shared_ptr<MaintenanceScheduler> scheduler_;
+    MaintenanceScheduler::TaskId tickTask_ = 0;
+    
+public:
+    explicit CoarseClock(std::chrono::microseconds resolution = std::chrono::microseconds(100))
+        : nowNs_(currentNs()) {
+        ticker_ = std::thread([this, resolution]() {
+            while (!stop_.load(std::memory_order_relaxed)) {
+                std::this_thread::sleep_for(resolution);
+                tick();
+            }
+        });
+    }
+    
+    CoarseClock(std::shared_ptr<MaintenanceScheduler> scheduler,
+                std::chrono::microseconds resolution = std::chrono::microseconds(100))
+        : nowNs_(currentNs()), scheduler_(std::move(scheduler)) {
+        tickTask_ = scheduler_->schedule(resolution, [this]() { tick(); });
+    }
+    
+    ~CoarseClock() override {
+        if (scheduler_) {
+            scheduler_->cancel(tickTask_);
+        }
+        stop_ = true;
+        if (ticker_.joinable()) {
+            ticker_.join();
+        }
+    }
+    
+    std::chrono::steady_clock::time_point now() const override {
+        return std::chrono::steady_clock::time_point(
+            std::chrono::nanoseconds(nowNs_.load(std::memory_order_relaxed)));
+    }
+    
+    // Refresh the cached time immediately
+    void tick() {
+        nowNs_.store(currentNs(), std::memory_order_relaxed);
+    }
+
+private:
+    static int64_t currentNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+// TSC clock: reads the CPU timestamp counter and scales it with a rate
+// calibrated against steady_clock at construction. Assumes an invariant TSC
+// that is synchronized across cores; falls back to steady_clock elsewhere.
+class TscClock : public Clock {
+private:
+    std::chrono::steady_clock::time_point base_;
+    uint64_t baseTicks_ = 0;
+    double nsPerTick_ = 0.0;
+    
+public:
+    explicit TscClock(std::chrono::milliseconds calibration = std::chrono::milliseconds(10)) {
+#if defined(__x86_64__) || defined(__i386__)
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startTicks = __rdtsc();
+        while (std::chrono::steady_clock::now() - start < calibration) {
+        }
+        base_ = std::chrono::steady_clock::now();
+        baseTicks_ = __rdtsc();
+        
+        double elapsedNs = std::chrono::duration<double, std::nano>(base_ - start).count();
+        nsPerTick_ = elapsedNs / static_cast<double>(baseTicks_ - startTicks);
+#else
+        (void)calibration;
+#endif
+    }
+    
+    std::chrono::steady_clock::time_point now() const override {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t ticks = __rdtsc() - baseTicks_;
+        return base_ + std::chrono::nanoseconds(static_cast<int64_t>(ticks * nsPerTick_));
+#else
+        return std::chrono::steady_clock::now();
+#endif
+    }
+};
+
+// Manually driven clock for deterministic tests: time only moves on advance()
+class ManualClock : public Clock {
+private:
+    std::atomic<int64_t> nowNs_;
+    
+public:
+    explicit ManualClock(std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now())
+        : nowNs_(std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()) {}
+    
+    std::chrono::steady_clock::time_point now() const override {
+        return std::chrono::steady_clock::time_point(
+            std::chrono::nanoseconds(nowNs_.load(std::memory_order_acquire)));
+    }
+    
+    void advance(std::chrono::nanoseconds delta) {
+        nowNs_.fetch_add(delta.count(), std::memory_order_acq_rel);
+    }
+};
+
+// Bucket implementation used for newly created clients
+enum class BucketType {
+    Mutex,          // TokenBucket: double tokens guarded by a mutex
+    LockFree,       // AtomicTokenBucket: fixed-point tokens updated with CAS
+    Gcra,           // GcraBucket: one arrival time updated with CAS
+    SlidingWindow   // SlidingWindowBucket: two window counts guarded by a mutex
+};
+
+// How per-client bucket state is stored
+enum class StorageMode {
+    Map,        // One Bucket object per client in the sharded client map
+    Compact     // 16-byte slots in CompactBucketTable, keyed by hash only; bucket sizes up to 2^24 - 1
+};
+
+// Output encoding of the request log
+enum class LogFormat {
+    Text,       // "[HH:MM:SS.mmm] Client: id, Request: ALLOWED" lines
+    Binary      // Raw 64-byte LogRecord structs in native byte order
+};
+
 // Configuration structure
 struct RateLimiterConfig {
     size_t defaultBucketSize = 100;        // Maximum tokens per bucket
@@ -28,34 +347,77 @@ struct RateLimiterConfig {
     std::chrono::seconds cleanupInterval{300};  // Client cleanup interval (5 minutes)
     bool enableMetrics = true;              // Enable statistics collection
     bool enableLogging = false;             // Enable detailed logging
+    LogFormat logFormat = LogFormat::Text;  // Request log encoding
+    std::string logPath;                    // Request log file (empty = stdout)
+    size_t logSampleRate = 1;               // Log 1 in N requests per thread
+    bool logRejectedOnly = false;           // Skip allowed requests in the log
+    size_t logBufferSize = 4096;            // Records per log ring (rounded up to a power of two)
+    std::chrono::milliseconds logFlushInterval{100}; // Background log drain period
+    size_t topRejectedClients = 0;          // Most-rejected clients kept for metrics export (0 = off)
+    uint16_t metricsPort = 0;               // Prometheus GET /metrics listener (0 = none; Linux only)
+    std::string metricsAddress = "127.0.0.1"; // IPv4 address the listener binds
+    std::chrono::milliseconds acquireTimerResolution{1}; // Async acquire wake-up granularity
+    size_t acquireTimerSlots = 1024;        // Timer wheel slots for async acquire
+    std::shared_ptr<TokenLeaseBackend> leaseBackend; // Cluster mode token source (null = local buckets)
+    std::chrono::milliseconds leaseRefreshInterval{50}; // Background lease top-up period
+    size_t minLeaseSize = 1;                // Smallest chunk leased from the backend
+    std::string snapshotPath;               // Loaded at startup, saved periodically and at shutdown
+    std::chrono::seconds snapshotInterval{0}; // Background snapshot period (0 = only at shutdown)
     size_t maxClients = 10000;              // Maximum tracked clients
+    size_t sketchWidth = 0;                 // Sketch counters per row for clients past maxClients (0 = reject them)
+    size_t sketchDepth = 4;                 // Sketch rows; more rows, fewer overestimates
+    std::chrono::milliseconds sketchWindow{0}; // Sketch window (0 = time a default bucket takes to refill)
     std::chrono::milliseconds timeoutMs{1}; // Lock timeout
+    BucketType bucketType = BucketType::Mutex; // Bucket implementation
+    size_t numShards = 16;                  // Client map shards (rounded up to a power of two)
+    size_t maxRegisteredClients = 4096;     // Capacity of the ClientHandle slot array
+    size_t statisticsStripes = 16;          // Per-thread counter slots (1 = shared counters)
+    std::shared_ptr<Clock> clock;           // Time source (null = precise steady_clock)
+    StorageMode storageMode = StorageMode::Map; // Compact trades per-client counters for memory
+    std::string sharedMemoryName;           // Compact table in this POSIX shm segment, shared by processes
+    std::chrono::milliseconds evictionTickInterval{1000}; // Incremental eviction step period
+    size_t evictionBatchSize = 64;          // Map buckets swept per shard lock hold
+    std::shared_ptr<MaintenanceScheduler> scheduler; // Shared maintenance thread (null = own thread)
     
-    // Per-client custom limits: clientId -> {bucketSize, refillRate}
+    // Per-client custom limits: clientId -> {bucketSize, refillRate}. Read at
+    // construction; change them later with RateLimiter::updateClientLimits().
     std::unordered_map<std::string, std::pair<size_t, double>> clientLimits;
+    
+    // Per-client bucket implementation, overriding bucketType (e.g. GCRA for
+    // a cheap high-volume tier). Read at construction; map storage only.
+    std::unordered_map<std::string, BucketType> clientBucketTypes;
+    
+    // Hierarchical limits: clientId -> parent clientId (e.g. user -> tenant ->
+    // global). A request must fit every bucket up the chain. Map storage only.
+    std::unordered_map<std::string, std::string> clientParents;
 };
 
 // Statistics structures
+
+// Point-in-time copy of the limiter-wide counters
 struct Statistics {
-    std::atomic<uint64_t> totalRequests{0};
-    std::atomic<uint64_t> acceptedRequests{0};
-    std::atomic<uint64_t> rejectedRequests{0};
-    std::atomic<double> totalLatency{0.0};
-    std::atomic<size_t> activeClients{0};
+    uint64_t totalRequests = 0;
+    uint64_t acceptedRequests = 0;
+    uint64_t rejectedRequests = 0;
+    uint64_t requestedTokens = 0;   // One per request unless weighted
+    uint64_t grantedTokens = 0;     // Tokens actually consumed
+    double totalLatency = 0.0;      // Milliseconds
+    size_t activeClients = 0;
     
     double getAcceptanceRate() const {
-        uint64_t total = totalRequests.load();
-        return total > 0 ? (double(acceptedRequests.load()) / total) * 100.0 : 0.0;
+        return totalRequests > 0 ? (double(acceptedRequests) / totalRequests) * 100.0 : 0.0;
     }
     
     double getRejectionRate() const {
-        uint64_t total = totalRequests.load();
-        return total > 0 ? (double(rejectedRequests.load()) / total) * 100.0 : 0.0;
+        return totalRequests > 0 ? (double(rejectedRequests) / totalRequests) * 100.0 : 0.0;
+    }
+    
+    double getTokenGrantRate() const {
+        return requestedTokens > 0 ? (double(grantedTokens) / requestedTokens) * 100.0 : 0.0;
     }
     
     double getAverageLatency() const {
-        uint64_t total = totalRequests.load();
-        return total > 0 ? totalLatency.load() / total : 0.0;
+        return totalRequests > 0 ? totalLatency / totalRequests : 0.0;
     }
 };
 
@@ -72,357 +434,7648 @@ struct ClientStatistics {
     }
 };
 
-// Token Bucket implementation
-class TokenBucket {
+// Small dense id per thread, used to pick a counter stripe
+inline size_t threadStripeId() {
+    static std::atomic<size_t> nextId{0};
+    thread_local size_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+// Request counters split into padded per-thread stripes. Each thread bumps
+// its own slot with relaxed adds; snapshot() sums the slots. Latency is kept
+// as integer nanoseconds so recording needs no floating-point CAS loop. Token
+// counts are kept as the difference from one token per request, so unit
+// requests never touch them; the differences may be negative and wrap, which
+// the unsigned sum undoes.
+class StatisticsCounters {
 private:
-    mutable std::mutex mutex_;
-    double tokens_;
-    const size_t bucketSize_;
-    const double refillRate_; // tokens per second
-    std::chrono::steady_clock::time_point lastRefill_;
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> totalRequests{0};
+        std::atomic<uint64_t> acceptedRequests{0};
+        std::atomic<uint64_t> rejectedRequests{0};
+        std::atomic<uint64_t> totalLatencyNs{0};
+        std::atomic<uint64_t> extraRequestedTokens{0};  // Beyond one per request
+        std::atomic<uint64_t> extraGrantedTokens{0};    // Beyond one per accepted request
+    };
     
-    // Client-specific statistics
-    uint64_t totalRequests_;
-    uint64_t acceptedRequests_;
+    std::unique_ptr<Stripe[]> stripes_;
+    size_t stripeCount_;
     
 public:
-    TokenBucket(size_t bucketSize, double refillRate) 
-        : tokens_(bucketSize), bucketSize_(bucketSize), refillRate_(refillRate),
-          lastRefill_(std::chrono::steady_clock::now()),
-          totalRequests_(0), acceptedRequests_(0) {}
+    explicit StatisticsCounters(size_t stripes)
+        : stripes_(std::make_unique<Stripe[]>(std::max<size_t>(stripes, 1))),
+          stripeCount_(std::max<size_t>(stripes, 1)) {}
     
-    bool consume(size_t tokensNeeded = 1) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        
-        refillTokens();
-        totalRequests_++;
-        
-        if (tokens_ >= tokensNeeded) {
-            tokens_ -= tokensNeeded;
-            acceptedRequests_++;
-            return true;
+    void record(bool allowed, uint64_t latencyNs, uint64_t requestedTokens, uint64_t grantedTokens) {
+        Stripe& stripe = stripes_[threadStripeId() % stripeCount_];
+        stripe.totalRequests.fetch_add(1, std::memory_order_relaxed);
+        if (allowed) {
+            stripe.acceptedRequests.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            stripe.rejectedRequests.fetch_add(1, std::memory_order_relaxed);
         }
+        stripe.totalLatencyNs.fetch_add(latencyNs, std::memory_order_relaxed);
         
-        return false;
+        const uint64_t unitGranted = allowed ? 1 : 0;
+        if (requestedTokens != 1 || grantedTokens != unitGranted) {
+            stripe.extraRequestedTokens.fetch_add(requestedTokens - 1, std::memory_order_relaxed);
+            stripe.extraGrantedTokens.fetch_add(grantedTokens - unitGranted, std::memory_order_relaxed);
+        }
     }
     
-    ClientStatistics getStatistics() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        
-        // Update tokens for current statistics
-        const_cast<TokenBucket*>(this)->refillTokens();
-        
-        return {
-            static_cast<size_t>(tokens_),
-            bucketSize_,
-            refillRate_,
-            totalRequests_,
-            acceptedRequests_,
-            lastRefill_
-        };
+    void recordBatch(uint64_t requests, uint64_t accepted, uint64_t latencyNs) {
+        Stripe& stripe = stripes_[threadStripeId() % stripeCount_];
+        stripe.totalRequests.fetch_add(requests, std::memory_order_relaxed);
+        stripe.acceptedRequests.fetch_add(accepted, std::memory_order_relaxed);
+        stripe.rejectedRequests.fetch_add(requests - accepted, std::memory_order_relaxed);
+        stripe.totalLatencyNs.fetch_add(latencyNs, std::memory_order_relaxed);
     }
     
-    void reset() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        tokens_ = bucketSize_;
-        lastRefill_ = std::chrono::steady_clock::now();
-        totalRequests_ = 0;
-        acceptedRequests_ = 0;
+    Statistics snapshot() const {
+        Statistics stats;
+        uint64_t latencyNs = 0;
+        for (size_t i = 0; i < stripeCount_; ++i) {
+            stats.totalRequests += stripes_[i].totalRequests.load(std::memory_order_relaxed);
+            stats.acceptedRequests += stripes_[i].acceptedRequests.load(std::memory_order_relaxed);
+            stats.rejectedRequests += stripes_[i].rejectedRequests.load(std::memory_order_relaxed);
+            latencyNs += stripes_[i].totalLatencyNs.load(std::memory_order_relaxed);
+            stats.requestedTokens += stripes_[i].extraRequestedTokens.load(std::memory_order_relaxed);
+            stats.grantedTokens += stripes_[i].extraGrantedTokens.load(std::memory_order_relaxed);
+        }
+        stats.requestedTokens += stats.totalRequests;
+        stats.grantedTokens += stats.acceptedRequests;
+        stats.totalLatency = latencyNs / 1e6;
+        return stats;
     }
     
-    std::chrono::steady_clock::time_point getLastAccess() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return lastRefill_;
-    }
-
-private:
-    void refillTokens() {
-        auto now = std::chrono::steady_clock::now();
-        auto timePassed = std::chrono::duration<double>(now - lastRefill_).count();
-        
-        if (timePassed > 0) {
-            double tokensToAdd = timePassed * refillRate_;
-            tokens_ = std::min(tokens_ + tokensToAdd, static_cast<double>(bucketSize_));
-            lastRefill_ = now;
+    void reset() {
+        for (size_t i = 0; i < stripeCount_; ++i) {
+            stripes_[i].totalRequests.store(0, std::memory_order_relaxed);
+            stripes_[i].acceptedRequests.store(0, std::memory_order_relaxed);
+            stripes_[i].rejectedRequests.store(0, std::memory_order_relaxed);
+            stripes_[i].totalLatencyNs.store(0, std::memory_order_relaxed);
+            stripes_[i].extraRequestedTokens.store(0, std::memory_order_relaxed);
+            stripes_[i].extraGrantedTokens.store(0, std::memory_order_relaxed);
         }
     }
 };
 
-// Main Rate Limiter class
-class RateLimiter {
+// Log-bucketed latency histogram (HDR-style). Each power of two is split into
+// 2^kSubBucketBits linear sub-buckets, giving ~6% relative precision. Writers
+// bump relaxed atomics in a per-thread stripe; stripes are only merged when
+// percentiles are read, so recording never takes a lock.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+    static constexpr size_t kStripes = 16;
+    
 private:
-    mutable std::mutex clientsMutex_;
-    std::unordered_map<std::string, std::unique_ptr<TokenBucket>> clients_;
-    RateLimiterConfig config_;
-    Statistics stats_;
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, kBuckets> counts{};
+    };
     
-    // Cleanup thread
-    std::unique_ptr<std::thread> cleanupThread_;
-    std::atomic<bool> shutdownFlag_{false};
+    std::unique_ptr<Stripe[]> stripes_;
     
-    // Latency measurement
-    std::vector<double> latencyMeasurements_;
-    mutable std::mutex latencyMutex_;
-
 public:
-    explicit RateLimiter(const RateLimiterConfig& config = RateLimiterConfig()) 
-        : config_(config) {
-        startCleanupThread();
-    }
+    LatencyHistogram() : stripes_(std::make_unique<Stripe[]>(kStripes)) {}
     
-    RateLimiter(size_t bucketSize, double refillRate) {
-        config_.defaultBucketSize = bucketSize;
-        config_.defaultRefillRate = refillRate;
-        startCleanupThread();
+    void record(uint64_t valueNs, uint64_t count = 1) {
+        stripes_[stripeIndex()].counts[bucketIndex(valueNs)].fetch_add(count, std::memory_order_relaxed);
     }
     
-    ~RateLimiter() {
-        shutdown();
+    // Sums all stripes into one array of bucket counts
+    std::array<uint64_t, kBuckets> merge() const {
+        std::array<uint64_t, kBuckets> merged{};
+        for (size_t s = 0; s < kStripes; ++s) {
+            for (size_t i = 0; i < kBuckets; ++i) {
+                merged[i] += stripes_[s].counts[i].load(std::memory_order_relaxed);
+            }
+        }
+        return merged;
     }
     
-    bool allowRequest(const std::string& clientId) {
-        auto start = std::chrono::high_resolution_clock::now();
+    // Values (in nanoseconds) at the given percentiles, each reported as the
+    // midpoint of the bucket holding that rank
+    std::vector<double> percentiles(const std::vector<double>& ranks) const {
+        auto merged = merge();
+        uint64_t total = 0;
+        for (uint64_t count : merged) {
+            total += count;
+        }
         
-        bool allowed = allowRequestInternal(clientId);
+        std::vector<double> result(ranks.size(), 0.0);
+        if (total == 0) {
+            return result;
+        }
         
-        // Update statistics
-        if (config_.enableMetrics) {
-            stats_.totalRequests++;
-            if (allowed) {
-                stats_.acceptedRequests++;
-            } else {
-                stats_.rejectedRequests++;
-            }
-            
-            // Measure latency
-            auto end = std::chrono::high_resolution_clock::now();
-            double latency = std::chrono::duration<double, std::milli>(end - start).count();
+        for (size_t r = 0; r < ranks.size(); ++r) {
+            uint64_t target = static_cast<uint64_t>(std::ceil((ranks[r] / 100.0) * total));
+            target = std::max<uint64_t>(target, 1);
             
-            {
-                std::lock_guard<std::mutex> lock(latencyMutex_);
-                latencyMeasurements_.push_back(latency);
-                // Keep only recent measurements (last 1000)
-                if (latencyMeasurements_.size() > 1000) {
-                    latencyMeasurements_.erase(latencyMeasurements_.begin());
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += merged[i];
+                if (seen >= target) {
+                    result[r] = 0.5 * static_cast<double>(bucketLowerBound(i) + bucketLowerBound(i + 1));
+                    break;
                 }
             }
-            
-            stats_.totalLatency.fetch_add(latency);
-        }
-        
-        if (config_.enableLogging) {
-            std::cout << "[" << getCurrentTimestamp() << "] "
-                      << "Client: " << clientId 
-                      << ", Request: " << (allowed ? "ALLOWED" : "REJECTED") << std::endl;
         }
         
-        return allowed;
+        return result;
     }
     
-    bool allowRequests(const std::string& clientId, size_t count) {
-        TokenBucket* bucket = getOrCreateBucket(clientId);
-        return bucket ? bucket->consume(count) : false;
+    void reset() {
+        for (size_t s = 0; s < kStripes; ++s) {
+            for (auto& count : stripes_[s].counts) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
     }
     
-    void updateClientLimit(const std::string& clientId, size_t bucketSize, double refillRate) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        config_.clientLimits[clientId] = {bucketSize, refillRate};
-        
-        // Remove existing bucket to force recreation with new limits
-        clients_.erase(clientId);
+    static size_t bucketIndex(uint64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        int exponent = std::bit_width(value) - 1;
+        size_t sub = static_cast<size_t>(value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return static_cast<size_t>(exponent - kSubBucketBits + 1) * kSubBuckets + sub;
     }
     
-    void removeClient(const std::string& clientId) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (clients_.erase(clientId)) {
-            stats_.activeClients--;
+    static uint64_t bucketLowerBound(size_t index) {
+        if (index < kSubBuckets) {
+            return index;
         }
+        int exponent = static_cast<int>(index / kSubBuckets) + kSubBucketBits - 1;
+        uint64_t sub = index % kSubBuckets;
+        if (exponent >= 64) {
+            return UINT64_MAX;
+        }
+        return (kSubBuckets + sub) << (exponent - kSubBucketBits);
+    }
+
+private:
+    static size_t stripeIndex() {
+        return threadStripeId() % kStripes;
     }
+};
+
+// Stand-ins for StatisticsCounters and LatencyHistogram that store nothing,
+// for limiters whose metrics policy never records. Both are empty, so as
+// [[no_unique_address]] members they take no space at all.
+class NoStatisticsCounters {
+public:
+    explicit NoStatisticsCounters(size_t) {}
     
-    Statistics getStatistics() const {
-        return stats_;
+    void record(bool, uint64_t, uint64_t, uint64_t) {}
+    void recordBatch(uint64_t, uint64_t, uint64_t) {}
+    
+    Statistics snapshot() const {
+        return {};
     }
     
-    ClientStatistics getClientStatistics(const std::string& clientId) const {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        auto it = clients_.find(clientId);
-        if (it != clients_.end()) {
-            return it->second->getStatistics();
+    void reset() {}
+};
+
+class NoLatencyHistogram {
+public:
+    void record(uint64_t, uint64_t = 1) {}
+    
+    std::array<uint64_t, LatencyHistogram::kBuckets> merge() const {
+        return {};
+    }
+    
+    std::vector<double> percentiles(const std::vector<double>& ranks) const {
+        return std::vector<double>(ranks.size(), 0.0);
+    }
+    
+    void reset() {}
+};
+
+// Fixed-size request log entry; client ids longer than kMaxClientId are cut
+struct LogRecord {
+    static constexpr size_t kMaxClientId = 54;
+    
+    int64_t wallTimeNs;             // system_clock time since epoch
+    uint8_t allowed;
+    uint8_t clientIdLength;
+    char clientId[kMaxClientId];
+};
+static_assert(sizeof(LogRecord) == 64, "LogRecord must stay one cache line");
+
+// Asynchronous request log. Requests append fixed-size records to one of
+// kStripes bounded lock-free rings (picked per thread, so a ring normally has
+// a single producer); a background job drains the rings and does all
+// formatting and I/O. A full ring drops the record and counts it instead of
+// blocking the request path.
+class RequestLog {
+public:
+    static constexpr size_t kStripes = 16;
+    
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+    
+    // Bounded multi-producer queue; each cell's sequence says whether it is
+    // free for the producer at `pos` or holds data for the consumer
+    struct alignas(64) Stripe {
+        std::unique_ptr<Cell[]> cells;
+        alignas(64) std::atomic<size_t> enqueuePos{0};
+        alignas(64) size_t dequeuePos = 0;
+    };
+    
+    std::unique_ptr<Stripe[]> stripes_;
+    size_t mask_;
+    LogFormat format_;
+    size_t sampleRate_;
+    bool rejectedOnly_;
+    std::ofstream file_;
+    std::ostream* out_;
+    std::mutex drainMutex_;
+    std::atomic<uint64_t> dropped_{0};
+    
+public:
+    RequestLog(size_t capacity, LogFormat format, size_t sampleRate, bool rejectedOnly,
+               const std::string& path)
+        : stripes_(std::make_unique<Stripe[]>(kStripes)),
+          mask_(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1),
+          format_(format), sampleRate_(std::max<size_t>(sampleRate, 1)),
+          rejectedOnly_(rejectedOnly), out_(&std::cout) {
+        for (size_t s = 0; s < kStripes; ++s) {
+            stripes_[s].cells = std::make_unique<Cell[]>(mask_ + 1);
+            for (size_t i = 0; i <= mask_; ++i) {
+                stripes_[s].cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
         }
         
-        // Return default statistics for non-existent client
-        return {0, config_.defaultBucketSize, config_.defaultRefillRate, 0, 0, 
-                std::chrono::steady_clock::now()};
+        if (!path.empty()) {
+            auto mode = std::ios::out | std::ios::app;
+            if (format_ == LogFormat::Binary) {
+                mode |= std::ios::binary;
+            }
+            file_.open(path, mode);
+            if (file_) {
+                out_ = &file_;
+            }
+        }
     }
     
-    std::vector<std::string> getActiveClients() const {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        std::vector<std::string> clients;
-        clients.reserve(clients_.size());
-        
-        for (const auto& pair : clients_) {
-            clients.push_back(pair.first);
+    // Sampling decision: 1 in sampleRate per thread, optionally rejections only
+    bool shouldLog(bool allowed) const {
+        if (rejectedOnly_ && allowed) {
+            return false;
         }
-        
-        return clients;
+        if (sampleRate_ == 1) {
+            return true;
+        }
+        thread_local uint64_t counter = 0;
+        return ++counter % sampleRate_ == 0;
     }
     
-    std::vector<double> getLatencyPercentiles() const {
-        std::lock_guard<std::mutex> lock(latencyMutex_);
+    // Never blocks; returns false (and counts a drop) when the ring is full
+    bool append(std::string_view clientId, bool allowed) {
+        Stripe& stripe = stripes_[threadStripeId() % kStripes];
         
-        if (latencyMeasurements_.empty()) {
-            return {0.0, 0.0, 0.0, 0.0, 0.0}; // P50, P90, P95, P99, P99.9
+        size_t pos = stripe.enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &stripe.cells[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (stripe.enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = stripe.enqueuePos.load(std::memory_order_relaxed);
+            }
         }
         
-        auto measurements = latencyMeasurements_;
-        std::sort(measurements.begin(), measurements.end());
-        
-        auto getPercentile = [&](double percentile) {
-            size_t index = static_cast<size_t>((percentile / 100.0) * (measurements.size() - 1));
-            return measurements[index];
-        };
+        LogRecord& record = cell->record;
+        record.wallTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.allowed = allowed ? 1 : 0;
+        record.clientIdLength = static_cast<uint8_t>(std::min(clientId.size(), LogRecord::kMaxClientId));
+        std::memcpy(record.clientId, clientId.data(), record.clientIdLength);
         
-        return {
-            getPercentile(50.0),   // P50
-            getPercentile(90.0),   // P90
-            getPercentile(95.0),   // P95
-            getPercentile(99.0),   // P99
-            getPercentile(99.9)    // P99.9
-        };
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
     }
     
-    void cleanup() {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
+    // Writes out everything appended so far; returns the number of records
+    size_t drain() {
+        std::lock_guard<std::mutex> lock(drainMutex_);
+        std::string buffer;
+        size_t drained = 0;
         
-        auto now = std::chrono::steady_clock::now();
-        auto threshold = now - config_.cleanupInterval;
-        
-        for (auto it = clients_.begin(); it != clients_.end();) {
-            if (it->second->getLastAccess() < threshold) {
-                it = clients_.erase(it);
-                stats_.activeClients--;
-            } else {
-                ++it;
+        for (size_t s = 0; s < kStripes; ++s) {
+            Stripe& stripe = stripes_[s];
+            for (;;) {
+                Cell& cell = stripe.cells[stripe.dequeuePos & mask_];
+                if (cell.sequence.load(std::memory_order_acquire) != stripe.dequeuePos + 1) {
+                    break;
+                }
+                
+                format(cell.record, buffer);
+                cell.sequence.store(stripe.dequeuePos + mask_ + 1, std::memory_order_release);
+                ++stripe.dequeuePos;
+                ++drained;
             }
         }
+        
+        if (!buffer.empty()) {
+            out_->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            out_->flush();
+        }
+        return drained;
     }
     
-    void reset() {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        
-        for (auto& pair : clients_) {
-            pair.second->reset();
+    uint64_t droppedRecords() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void format(const LogRecord& record, std::string& buffer) const {
+        if (format_ == LogFormat::Binary) {
+            buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            return;
         }
         
-        // Reset statistics
-        stats_.totalRequests = 0;
-        stats_.acceptedRequests = 0;
-        stats_.rejectedRequests = 0;
-        stats_.totalLatency = 0.0;
+        auto wallTime = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(record.wallTimeNs)));
+        auto time_t = std::chrono::system_clock::to_time_t(wallTime);
+        auto ms = (record.wallTimeNs / 1000000) % 1000;
         
-        // Clear latency measurements
-        {
-            std::lock_guard<std::mutex> latencyLock(latencyMutex_);
-            latencyMeasurements_.clear();
+        std::tm local{};
+        localtime_r(&time_t, &local);
+        char line[128];
+        size_t length = std::strftime(line, sizeof(line), "[%H:%M:%S", &local);
+        length += std::snprintf(line + length, sizeof(line) - length, ".%03d] Client: ",
+                                static_cast<int>(ms));
+        buffer.append(line, length);
+        buffer.append(record.clientId, record.clientIdLength);
+        buffer.append(record.allowed ? ", Request: ALLOWED\n" : ", Request: REJECTED\n");
+    }
+};
+
+// Common interface for per-client bucket implementations
+class Bucket {
+protected:
+    const Clock* clock_;
+    std::atomic<int64_t> lastAccessNs_;     // Last consume or reset, for eviction
+    std::shared_ptr<Bucket> parent_;        // Next level up (tenant, global, ...); fixed once shared
+    std::atomic<uint64_t> limitsVersion_{0}; // Policy table version the limits come from
+    
+    explicit Bucket(const Clock* clock)
+        : clock_(clock ? clock : &Clock::precise()), lastAccessNs_(0) {
+        touch(clock_->now());
+    }
+    
+    // Record an access. Skips the store when the value is already within a
+    // millisecond, so hot buckets do not write the field on every request.
+    void touch(std::chrono::steady_clock::time_point now) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        if (ns - lastAccessNs_.load(std::memory_order_relaxed) > 1000000) {
+            lastAccessNs_.store(ns, std::memory_order_relaxed);
         }
     }
     
-    void printDetailedStats() const {
-        auto stats = getStatistics();
-        auto percentiles = getLatencyPercentiles();
-        
+public:
+    // Delay returned by reserve() when the request can never be satisfied
+    static constexpr std::chrono::nanoseconds kNever = std::chrono::nanoseconds::max();
+    
+    virtual ~Bucket() = default;
+    
+    bool consume(size_t tokensNeeded = 1) {
+        return consumeAt(tokensNeeded, clock_->now());
+    }
+    
+    // Takes the tokens and returns zero if they are available; otherwise takes
+    // nothing and returns how long until they will be (kNever if they cannot
+    // be, e.g. more than the bucket size)
+    std::chrono::nanoseconds reserve(size_t tokensNeeded = 1) {
+        return reserveAt(tokensNeeded, clock_->now());
+    }
+    
+    // Consume using a clock value the caller already read (e.g. once per batch)
+    virtual bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) = 0;
+    virtual std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) = 0;
+    virtual ClientStatistics getStatistics() const = 0;
+    virtual void reset() = 0;
+    
+    // Takes as many of `maxTokens` as are available and returns how many. One
+    // request, accepted if anything was granted.
+    virtual size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) = 0;
+    
+    // Returns tokens taken by a consume that is being rolled back, and drops
+    // it from the accepted count
+    virtual void refund(size_t tokens) = 0;
+    
+    // Returns tokens a partial grant did not keep; the request stays accepted
+    virtual void returnTokens(size_t tokens) = 0;
+    
+    // Full-precision bucket state for snapshots
+    struct State {
+        double tokens;
+        std::chrono::steady_clock::time_point lastRefill;
+        uint64_t totalRequests;
+        uint64_t acceptedRequests;
+    };
+    
+    virtual State saveState() const = 0;
+    
+    // Replaces the state (tokens capped at the bucket size) and counts as an
+    // access, so restored clients are not immediately evicted
+    virtual void restoreState(const State& state) = 0;
+    
+    // Switches to new limits in place. Tokens are scaled by the ratio of the
+    // new size to the old one, so a half-full bucket stays half full; tokens
+    // earned so far are credited at the old rate first. Concurrent calls with
+    // the same limits scale only once.
+    virtual void setLimits(size_t bucketSize, double refillRate) = 0;
+    
+    uint64_t limitsVersion() const {
+        return limitsVersion_.load(std::memory_order_acquire);
+    }
+    
+    void setLimitsVersion(uint64_t version) {
+        limitsVersion_.store(version, std::memory_order_release);
+    }
+    
+    // Links this bucket under `parent`. Only valid before the bucket is shared.
+    void setParent(std::shared_ptr<Bucket> parent) {
+        parent_ = std::move(parent);
+    }
+    
+    const std::shared_ptr<Bucket>& getParent() const {
+        return parent_;
+    }
+    
+    // Consumes from this bucket and every ancestor, leaf first, using one
+    // clock value. If any level rejects, the levels already charged are
+    // refunded, so in the end either all levels pay or none do. This is a
+    // compensating rollback, not one check across the chain: until the refund
+    // lands, a concurrent request can find those levels short and be
+    // rejected although the tokens come back. The window is the walk up to
+    // the rejecting level. Refunds stay capped at the bucket size; the tokens
+    // that cap drops would have been dropped by the refill anyway.
+    bool consumeChain(size_t tokensNeeded, std::chrono::steady_clock::time_point now) {
+        if (!parent_) {
+            return consumeAt(tokensNeeded, now);
+        }
+        
+        for (Bucket* level = this; level; level = level->parent_.get()) {
+            if (!level->consumeAt(tokensNeeded, now)) {
+                rollbackChain(level, tokensNeeded);
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // reserveAt() over the chain. On rejection the delay is that of the first
+    // level short of tokens; levels above it are not consulted, so a retry
+    // after the delay may still have to wait for them.
+    std::chrono::nanoseconds reserveChain(size_t tokensNeeded, std::chrono::steady_clock::time_point now) {
+        if (!parent_) {
+            return reserveAt(tokensNeeded, now);
+        }
+        
+        for (Bucket* level = this; level; level = level->parent_.get()) {
+            auto delay = level->reserveAt(tokensNeeded, now);
+            if (delay.count() != 0) {
+                rollbackChain(level, tokensNeeded);
+                return delay;
+            }
+        }
+        return std::chrono::nanoseconds(0);
+    }
+    
+    // consumeUpToAt() over the chain. Each level grants at most what the one
+    // below it did, and levels below a smaller grant give back the difference,
+    // so every level ends up charged the same amount (zero if any grants none).
+    size_t consumeUpToChain(size_t maxTokens, std::chrono::steady_clock::time_point now) {
+        if (!parent_) {
+            return consumeUpToAt(maxTokens, now);
+        }
+        
+        size_t granted = consumeUpToAt(maxTokens, now);
+        for (Bucket* level = parent_.get(); level && granted > 0; level = level->parent_.get()) {
+            size_t levelGranted = level->consumeUpToAt(granted, now);
+            if (levelGranted == 0) {
+                rollbackChain(level, granted);
+            } else if (levelGranted < granted) {
+                for (Bucket* below = this; below != level; below = below->parent_.get()) {
+                    below->returnTokens(granted - levelGranted);
+                }
+            }
+            granted = levelGranted;
+        }
+        return granted;
+    }
+    
+    std::chrono::steady_clock::time_point getLastAccess() const {
+        return std::chrono::steady_clock::time_point(
+            std::chrono::nanoseconds(lastAccessNs_.load(std::memory_order_relaxed)));
+    }
+
+private:
+    // Refunds every level below `failed`
+    void rollbackChain(Bucket* failed, size_t tokens) {
+        for (Bucket* level = this; level != failed; level = level->parent_.get()) {
+            level->refund(tokens);
+        }
+    }
+};
+
+// Buckets are shared between the client map and in-flight callers, so eviction
+// only drops the map's reference and the last holder frees the bucket
+using BucketPtr = std::shared_ptr<Bucket>;
+
+// Token Bucket implementation
+class TokenBucket : public Bucket {
+private:
+    mutable std::mutex mutex_;
+    double tokens_;
+    size_t bucketSize_;
+    double refillRate_; // tokens per second
+    std::chrono::steady_clock::time_point lastRefill_;
+    
+    // Client-specific statistics
+    uint64_t totalRequests_;
+    uint64_t acceptedRequests_;
+    
+public:
+    TokenBucket(size_t bucketSize, double refillRate, const Clock* clock = nullptr) 
+        : Bucket(clock), tokens_(bucketSize), bucketSize_(bucketSize), refillRate_(refillRate),
+          lastRefill_(clock_->now()),
+          totalRequests_(0), acceptedRequests_(0) {}
+    
+    bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        refillTokens(now);
+        totalRequests_++;
+        
+        if (tokens_ >= tokensNeeded) {
+            tokens_ -= tokensNeeded;
+            acceptedRequests_++;
+            return true;
+        }
+        
+        return false;
+    }
+    
+    std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        refillTokens(now);
+        totalRequests_++;
+        
+        if (tokens_ >= tokensNeeded) {
+            tokens_ -= tokensNeeded;
+            acceptedRequests_++;
+            return std::chrono::nanoseconds(0);
+        }
+        
+        if (tokensNeeded > bucketSize_ || refillRate_ <= 0.0) {
+            return kNever;
+        }
+        
+        double waitNs = std::ceil((tokensNeeded - tokens_) / refillRate_ * 1e9);
+        return std::chrono::nanoseconds(std::max<int64_t>(static_cast<int64_t>(waitNs), 1));
+    }
+    
+    size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        refillTokens(now);
+        totalRequests_++;
+        
+        size_t granted = std::min(maxTokens, static_cast<size_t>(tokens_));
+        if (granted > 0) {
+            tokens_ -= static_cast<double>(granted);
+            acceptedRequests_++;
+        }
+        return granted;
+    }
+    
+    ClientStatistics getStatistics() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        // Update tokens for current statistics
+        const_cast<TokenBucket*>(this)->refillTokens(clock_->now());
+        
+        return {
+            static_cast<size_t>(tokens_),
+            bucketSize_,
+            refillRate_,
+            totalRequests_,
+            acceptedRequests_,
+            lastRefill_
+        };
+    }
+    
+    void reset() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ = bucketSize_;
+        lastRefill_ = clock_->now();
+        totalRequests_ = 0;
+        acceptedRequests_ = 0;
+        touch(lastRefill_);
+    }
+    
+    void refund(size_t tokens) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ = std::min(tokens_ + static_cast<double>(tokens), static_cast<double>(bucketSize_));
+        if (acceptedRequests_ > 0) {
+            acceptedRequests_--;
+        }
+    }
+    
+    void returnTokens(size_t tokens) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ = std::min(tokens_ + static_cast<double>(tokens), static_cast<double>(bucketSize_));
+    }
+    
+    State saveState() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {tokens_, lastRefill_, totalRequests_, acceptedRequests_};
+    }
+    
+    void restoreState(const State& state) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ = std::clamp(state.tokens, 0.0, static_cast<double>(bucketSize_));
+        lastRefill_ = state.lastRefill;
+        totalRequests_ = state.totalRequests;
+        acceptedRequests_ = state.acceptedRequests;
+        touch(clock_->now());
+    }
+    
+    void setLimits(size_t bucketSize, double refillRate) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refillTokens(clock_->now());
+        if (bucketSize != bucketSize_) {
+            tokens_ = bucketSize_ > 0 ? tokens_ * static_cast<double>(bucketSize) / static_cast<double>(bucketSize_)
+                                      : static_cast<double>(bucketSize);
+            bucketSize_ = bucketSize;
+        }
+        refillRate_ = refillRate;
+    }
+
+private:
+    friend class MicroBenchmark;
+    
+    void refillTokens(std::chrono::steady_clock::time_point now) {
+        auto timePassed = std::chrono::duration<double>(now - lastRefill_).count();
+        
+        if (timePassed > 0) {
+            double tokensToAdd = timePassed * refillRate_;
+            tokens_ = std::min(tokens_ + tokensToAdd, static_cast<double>(bucketSize_));
+            lastRefill_ = now;
+        }
+    }
+};
+
+// Fixed-point format of the lock-free buckets' token counts
+struct AtomicTokenFormat {
+    static constexpr int kFractionBits = 20;
+    static constexpr int64_t kTokenScale = int64_t(1) << kFractionBits;
+};
+
+// Limits of a lock-free bucket that setLimits() can change in place. Only
+// exchange() writes them, so relaxed loads suffice.
+class DynamicBucketLimits {
+private:
+    std::atomic<size_t> bucketSize_;
+    std::atomic<double> refillRate_;     // tokens per second
+    std::atomic<int64_t> capacity_;      // bucketSize_ in fixed-point
+    std::atomic<double> scaledPerNs_;    // Fixed-point tokens gained per nanosecond
+    
+public:
+    static constexpr bool kFixed = false;
+    
+    DynamicBucketLimits(size_t bucketSize, double refillRate)
+        : bucketSize_(bucketSize), refillRate_(refillRate),
+          capacity_(static_cast<int64_t>(bucketSize) * AtomicTokenFormat::kTokenScale),
+          scaledPerNs_(refillRate * AtomicTokenFormat::kTokenScale / 1e9) {}
+    
+    size_t bucketSize() const {
+        return bucketSize_.load(std::memory_order_relaxed);
+    }
+    
+    double refillRate() const {
+        return refillRate_.load(std::memory_order_relaxed);
+    }
+    
+    int64_t capacity() const {
+        return capacity_.load(std::memory_order_relaxed);
+    }
+    
+    double scaledPerNs() const {
+        return scaledPerNs_.load(std::memory_order_relaxed);
+    }
+    
+    // Stores new limits and returns the previous capacity; callers that see
+    // it unchanged know another caller already applied these limits
+    int64_t exchange(size_t bucketSize, double refillRate) {
+        refillRate_.store(refillRate, std::memory_order_relaxed);
+        scaledPerNs_.store(refillRate * AtomicTokenFormat::kTokenScale / 1e9, std::memory_order_relaxed);
+        bucketSize_.store(bucketSize, std::memory_order_relaxed);
+        return capacity_.exchange(static_cast<int64_t>(bucketSize) * AtomicTokenFormat::kTokenScale,
+                                  std::memory_order_acq_rel);
+    }
+};
+
+// Limits fixed at compile time: no storage, and the refill arithmetic folds
+// to constants. setLimits() on such a bucket changes nothing.
+template <size_t BucketSize, double RefillRate>
+class FixedBucketLimits {
+public:
+    static_assert(BucketSize <= static_cast<size_t>(INT64_MAX / AtomicTokenFormat::kTokenScale),
+                  "bucket size overflows the fixed-point token count");
+    static_assert(RefillRate >= 0.0, "refill rate must not be negative");
+    
+    static constexpr bool kFixed = true;
+    
+    FixedBucketLimits(size_t bucketSize, double refillRate) {
+        assert(bucketSize == BucketSize && refillRate == RefillRate);
+        (void)bucketSize;
+        (void)refillRate;
+    }
+    
+    static constexpr size_t bucketSize() {
+        return BucketSize;
+    }
+    
+    static constexpr double refillRate() {
+        return RefillRate;
+    }
+    
+    static constexpr int64_t capacity() {
+        return static_cast<int64_t>(BucketSize) * AtomicTokenFormat::kTokenScale;
+    }
+    
+    static constexpr double scaledPerNs() {
+        return RefillRate * AtomicTokenFormat::kTokenScale / 1e9;
+    }
+};
+
+// Lock-free token bucket: the token count is kept in fixed-point and, together
+// with the last-refill timestamp, updated with CAS loops instead of a mutex.
+// Limits is DynamicBucketLimits or a FixedBucketLimits instantiation.
+template <typename Limits>
+class BasicAtomicTokenBucket : public Bucket {
+private:
+    static constexpr int kFractionBits = AtomicTokenFormat::kFractionBits;
+    static constexpr int64_t kTokenScale = AtomicTokenFormat::kTokenScale;
+    
+    std::atomic<int64_t> tokens_;        // Fixed-point, kFractionBits fractional bits
+    std::atomic<int64_t> lastRefillNs_;  // steady_clock time in nanoseconds
+    [[no_unique_address]] Limits limits_;
+    
+    // Client-specific statistics
+    std::atomic<uint64_t> totalRequests_;
+    std::atomic<uint64_t> acceptedRequests_;
+    
+public:
+    BasicAtomicTokenBucket(size_t bucketSize, double refillRate, const Clock* clock = nullptr)
+        : Bucket(clock), tokens_(static_cast<int64_t>(bucketSize) * kTokenScale),
+          lastRefillNs_(toNs(clock_->now())), limits_(bucketSize, refillRate),
+          totalRequests_(0), acceptedRequests_(0) {}
+    
+    bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        refillTokens(toNs(now));
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        if (tokensNeeded > limits_.bucketSize()) {
+            return false;
+        }
+        
+        const int64_t needed = static_cast<int64_t>(tokensNeeded) * kTokenScale;
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        while (current >= needed) {
+            if (tokens_.compare_exchange_weak(current, current - needed,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        const int64_t ns = toNs(now);
+        refillTokens(ns);
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        if (tokensNeeded > limits_.bucketSize()) {
+            return kNever;
+        }
+        
+        const int64_t needed = static_cast<int64_t>(tokensNeeded) * kTokenScale;
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        while (current >= needed) {
+            if (tokens_.compare_exchange_weak(current, current - needed,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                return std::chrono::nanoseconds(0);
+            }
+        }
+        
+        const double scaledPerNs = limits_.scaledPerNs();
+        if (scaledPerNs <= 0.0) {
+            return kNever;
+        }
+        
+        // Time since the last refill is already earning tokens that have not
+        // been credited yet, so it counts towards the wait
+        int64_t pending = std::max<int64_t>(ns - lastRefillNs_.load(std::memory_order_acquire), 0);
+        int64_t waitNs = static_cast<int64_t>(std::ceil(static_cast<double>(needed - current) / scaledPerNs)) - pending;
+        return std::chrono::nanoseconds(std::max<int64_t>(waitNs, 1));
+    }
+    
+    size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        refillTokens(toNs(now));
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        for (;;) {
+            const size_t granted = std::min(maxTokens, static_cast<size_t>(std::max<int64_t>(current, 0) >> kFractionBits));
+            if (granted == 0) {
+                return 0;
+            }
+            if (tokens_.compare_exchange_weak(current, current - static_cast<int64_t>(granted) * kTokenScale,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                return granted;
+            }
+        }
+    }
+    
+    ClientStatistics getStatistics() const override {
+        // Update tokens for current statistics
+        const_cast<BasicAtomicTokenBucket*>(this)->refillTokens(nowNs());
+        
+        return {
+            static_cast<size_t>(tokens_.load(std::memory_order_acquire) >> kFractionBits),
+            limits_.bucketSize(),
+            limits_.refillRate(),
+            totalRequests_.load(std::memory_order_relaxed),
+            acceptedRequests_.load(std::memory_order_relaxed),
+            std::chrono::steady_clock::time_point(
+                std::chrono::nanoseconds(lastRefillNs_.load(std::memory_order_acquire)))
+        };
+    }
+    
+    void reset() override {
+        auto now = clock_->now();
+        tokens_.store(limits_.capacity(), std::memory_order_release);
+        lastRefillNs_.store(toNs(now), std::memory_order_release);
+        totalRequests_.store(0, std::memory_order_relaxed);
+        acceptedRequests_.store(0, std::memory_order_relaxed);
+        touch(now);
+    }
+    
+    void refund(size_t tokens) override {
+        returnTokens(tokens);
+        acceptedRequests_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    void returnTokens(size_t tokens) override {
+        const int64_t capacity = limits_.capacity();
+        const int64_t amount = static_cast<int64_t>(std::min(tokens, limits_.bucketSize())) * kTokenScale;
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        while (!tokens_.compare_exchange_weak(current, std::min(current + amount, capacity),
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+        }
+    }
+    
+    State saveState() const override {
+        return {
+            static_cast<double>(tokens_.load(std::memory_order_acquire)) / kTokenScale,
+            std::chrono::steady_clock::time_point(
+                std::chrono::nanoseconds(lastRefillNs_.load(std::memory_order_acquire))),
+            totalRequests_.load(std::memory_order_relaxed),
+            acceptedRequests_.load(std::memory_order_relaxed)
+        };
+    }
+    
+    void restoreState(const State& state) override {
+        double scaled = std::clamp(state.tokens, 0.0,
+                                   static_cast<double>(limits_.bucketSize())) * kTokenScale;
+        tokens_.store(static_cast<int64_t>(scaled), std::memory_order_release);
+        lastRefillNs_.store(toNs(state.lastRefill), std::memory_order_release);
+        totalRequests_.store(state.totalRequests, std::memory_order_relaxed);
+        acceptedRequests_.store(state.acceptedRequests, std::memory_order_relaxed);
+        touch(clock_->now());
+    }
+    
+    // Fixed limits stay as they are. Otherwise the capacity exchange picks the
+    // one caller that rescales for a given change; consumers racing with it
+    // see either the old or the new limits.
+    void setLimits(size_t bucketSize, double refillRate) override {
+        if constexpr (Limits::kFixed) {
+            (void)bucketSize;
+            (void)refillRate;
+        } else {
+            refillTokens(nowNs());
+            
+            const int64_t capacity = static_cast<int64_t>(bucketSize) * kTokenScale;
+            const int64_t previous = limits_.exchange(bucketSize, refillRate);
+            if (previous == capacity) {
+                return;
+            }
+            
+            const double ratio = previous > 0 ? static_cast<double>(capacity) / static_cast<double>(previous) : 0.0;
+            int64_t current = tokens_.load(std::memory_order_relaxed);
+            int64_t next;
+            do {
+                next = previous > 0 ? std::min(static_cast<int64_t>(static_cast<double>(current) * ratio), capacity)
+                                    : capacity;
+            } while (!tokens_.compare_exchange_weak(current, next,
+                                                    std::memory_order_acq_rel,
+                                                    std::memory_order_relaxed));
+        }
+    }
+
+private:
+    static int64_t toNs(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+    
+    int64_t nowNs() const {
+        return toNs(clock_->now());
+    }
+    
+    void refillTokens(int64_t now) {
+        int64_t last = lastRefillNs_.load(std::memory_order_acquire);
+        const int64_t capacity = limits_.capacity();
+        const double scaledPerNs = limits_.scaledPerNs();
+        
+        while (now > last) {
+            // Only the thread that advances the timestamp credits the tokens for
+            // that interval, so concurrent refills never add the same time twice.
+            double tokensToAdd = static_cast<double>(now - last) * scaledPerNs;
+            int64_t credit;
+            int64_t advanceTo;
+            
+            if (tokensToAdd >= static_cast<double>(capacity)) {
+                credit = capacity;
+                advanceTo = now;
+            } else {
+                credit = static_cast<int64_t>(tokensToAdd);
+                if (credit == 0) {
+                    return; // Less than one fixed-point unit; keep accumulating time
+                }
+                // Advance only by the time actually credited so fractions carry over;
+                // rounding up keeps repeated refills from over-crediting
+                advanceTo = std::min(now, last + static_cast<int64_t>(
+                    std::ceil(static_cast<double>(credit) / scaledPerNs)));
+            }
+            
+            if (lastRefillNs_.compare_exchange_weak(last, advanceTo,
+                                                    std::memory_order_acq_rel,
+                                                    std::memory_order_acquire)) {
+                int64_t current = tokens_.load(std::memory_order_relaxed);
+                int64_t next;
+                do {
+                    next = std::min(current + credit, capacity);
+                } while (!tokens_.compare_exchange_weak(current, next,
+                                                        std::memory_order_acq_rel,
+                                                        std::memory_order_relaxed));
+                return;
+            }
+        }
+    }
+};
+
+using AtomicTokenBucket = BasicAtomicTokenBucket<DynamicBucketLimits>;
+
+// Generic cell rate algorithm: the whole state is the theoretical arrival time
+// (TAT), the time at which the bucket will be full again, updated with one
+// CAS. Taking n tokens moves it n emission intervals (1 / refillRate) past
+// max(TAT, now), and is allowed while that stays within bucketSize intervals
+// of now. Behaves like a token bucket; rates are resolved to whole
+// nanoseconds per token, so at most 1e9 tokens per second.
+class GcraBucket : public Bucket {
+private:
+    // Cap on bucketSize intervals, so offsets from now cannot overflow; a zero
+    // refill rate uses the longest interval under it, and never visibly refills
+    static constexpr int64_t kMaxSpanNs = INT64_MAX / 4;
+    
+    std::atomic<int64_t> tatNs_;            // steady_clock time in nanoseconds
+    std::atomic<size_t> bucketSize_;
+    std::atomic<double> refillRate_;
+    std::atomic<int64_t> intervalNs_;       // Per token
+    
+    // Client-specific statistics
+    std::atomic<uint64_t> totalRequests_;
+    std::atomic<uint64_t> acceptedRequests_;
+    
+public:
+    GcraBucket(size_t bucketSize, double refillRate, const Clock* clock = nullptr)
+        : Bucket(clock), tatNs_(toNs(clock_->now())), bucketSize_(bucketSize), refillRate_(refillRate),
+          intervalNs_(intervalFor(bucketSize, refillRate)), totalRequests_(0), acceptedRequests_(0) {}
+    
+    bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        return reserveAt(tokensNeeded, now).count() == 0;
+    }
+    
+    std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        const size_t bucketSize = bucketSize_.load(std::memory_order_relaxed);
+        if (tokensNeeded > bucketSize) {
+            return kNever;
+        }
+        
+        const int64_t ns = toNs(now);
+        const int64_t interval = intervalNs_.load(std::memory_order_relaxed);
+        const int64_t tolerance = span(bucketSize, interval);
+        const int64_t cost = span(tokensNeeded, interval);
+        int64_t tat = tatNs_.load(std::memory_order_relaxed);
+        for (;;) {
+            const int64_t next = std::max(tat, ns) + cost;
+            if (next - ns > tolerance) {
+                if (refillRate_.load(std::memory_order_relaxed) <= 0.0) {
+                    return kNever;
+                }
+                return std::chrono::nanoseconds(next - ns - tolerance);
+            }
+            if (tatNs_.compare_exchange_weak(tat, next, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                return std::chrono::nanoseconds(0);
+            }
+        }
+    }
+    
+    size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        const int64_t ns = toNs(now);
+        const int64_t interval = intervalNs_.load(std::memory_order_relaxed);
+        const int64_t tolerance = span(bucketSize_.load(std::memory_order_relaxed), interval);
+        int64_t tat = tatNs_.load(std::memory_order_relaxed);
+        for (;;) {
+            const int64_t start = std::max(tat, ns);
+            const size_t available = static_cast<size_t>(std::max<int64_t>(tolerance - (start - ns), 0) / interval);
+            const size_t granted = std::min(maxTokens, available);
+            if (granted == 0) {
+                return 0;
+            }
+            if (tatNs_.compare_exchange_weak(tat, start + span(granted, interval), std::memory_order_acq_rel,
+                                             std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                return granted;
+            }
+        }
+    }
+    
+    ClientStatistics getStatistics() const override {
+        auto now = clock_->now();
+        return {
+            static_cast<size_t>(tokensAt(toNs(now))),
+            bucketSize_.load(std::memory_order_relaxed),
+            refillRate_.load(std::memory_order_relaxed),
+            totalRequests_.load(std::memory_order_relaxed),
+            acceptedRequests_.load(std::memory_order_relaxed),
+            now
+        };
+    }
+    
+    void reset() override {
+        auto now = clock_->now();
+        tatNs_.store(toNs(now), std::memory_order_release);
+        totalRequests_.store(0, std::memory_order_relaxed);
+        acceptedRequests_.store(0, std::memory_order_relaxed);
+        touch(now);
+    }
+    
+    void refund(size_t tokens) override {
+        returnTokens(tokens);
+        acceptedRequests_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    void returnTokens(size_t tokens) override {
+        tatNs_.fetch_sub(span(tokens, intervalNs_.load(std::memory_order_relaxed)), std::memory_order_acq_rel);
+    }
+    
+    // The state is always current, so it is saved as of now
+    State saveState() const override {
+        auto now = clock_->now();
+        return {
+            tokensAt(toNs(now)),
+            now,
+            totalRequests_.load(std::memory_order_relaxed),
+            acceptedRequests_.load(std::memory_order_relaxed)
+        };
+    }
+    
+    void restoreState(const State& state) override {
+        const double bucketSize = static_cast<double>(bucketSize_.load(std::memory_order_relaxed));
+        const double missing = bucketSize - std::clamp(state.tokens, 0.0, bucketSize);
+        tatNs_.store(toNs(state.lastRefill) +
+                     static_cast<int64_t>(missing * static_cast<double>(intervalNs_.load(std::memory_order_relaxed))),
+                     std::memory_order_release);
+        totalRequests_.store(state.totalRequests, std::memory_order_relaxed);
+        acceptedRequests_.store(state.acceptedRequests, std::memory_order_relaxed);
+        touch(clock_->now());
+    }
+    
+    // The missing tokens are scaled with the bucket size and re-spaced at the
+    // new interval. The limit exchanges pick the one caller that rescales.
+    void setLimits(size_t bucketSize, double refillRate) override {
+        const int64_t ns = toNs(clock_->now());
+        const int64_t interval = intervalFor(bucketSize, refillRate);
+        refillRate_.store(refillRate, std::memory_order_relaxed);
+        const size_t previousSize = bucketSize_.exchange(bucketSize, std::memory_order_acq_rel);
+        const int64_t previousInterval = intervalNs_.exchange(interval, std::memory_order_acq_rel);
+        if (previousSize == bucketSize && previousInterval == interval) {
+            return;
+        }
+        
+        const double ratio = previousSize > 0 ? static_cast<double>(bucketSize) / static_cast<double>(previousSize)
+                                              : 0.0;
+        const double tolerance = static_cast<double>(span(bucketSize, interval));
+        int64_t tat = tatNs_.load(std::memory_order_relaxed);
+        int64_t next;
+        do {
+            double missing = static_cast<double>(std::max<int64_t>(tat - ns, 0)) /
+                             static_cast<double>(previousInterval) * ratio;
+            next = ns + static_cast<int64_t>(std::min(missing * static_cast<double>(interval), tolerance));
+        } while (!tatNs_.compare_exchange_weak(tat, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+    }
+
+private:
+    static int64_t toNs(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+    
+    static int64_t intervalFor(size_t bucketSize, double refillRate) {
+        const int64_t longest = std::max<int64_t>(kMaxSpanNs / static_cast<int64_t>(std::max<size_t>(bucketSize, 1)), 1);
+        if (refillRate <= 0.0) {
+            return longest;
+        }
+        return std::clamp<int64_t>(static_cast<int64_t>(std::llround(std::min(1e9 / refillRate, 1e18))), 1, longest);
+    }
+    
+    // `tokens` intervals, saturating at kMaxSpanNs
+    static int64_t span(size_t tokens, int64_t interval) {
+        return tokens > static_cast<size_t>(kMaxSpanNs / interval) ? kMaxSpanNs
+                                                                    : static_cast<int64_t>(tokens) * interval;
+    }
+    
+    double tokensAt(int64_t ns) const {
+        const int64_t interval = intervalNs_.load(std::memory_order_relaxed);
+        const int64_t used = std::max<int64_t>(tatNs_.load(std::memory_order_acquire) - ns, 0);
+        const int64_t tolerance = span(bucketSize_.load(std::memory_order_relaxed), interval);
+        return static_cast<double>(std::max<int64_t>(tolerance - used, 0)) / static_cast<double>(interval);
+    }
+};
+
+// Sliding-window counter: tokens are counted per fixed window of bucketSize /
+// refillRate seconds, and a request must fit bucketSize after adding the
+// current count to the previous one, weighted by how much of the previous
+// window the sliding window still covers. Allows no more than bucketSize in
+// any window and spreads the refill evenly, with no full-bucket burst right
+// after a quiet spell ends. With a zero rate the window never ends, so
+// bucketSize is a lifetime quota.
+class SlidingWindowBucket : public Bucket {
+private:
+    mutable std::mutex mutex_;
+    size_t bucketSize_;
+    double refillRate_;
+    int64_t windowNs_;              // 0 = never rolls over
+    int64_t windowStartNs_;
+    uint64_t previous_ = 0;         // Tokens taken in the window before the current one
+    uint64_t current_ = 0;
+    
+    // Client-specific statistics
+    uint64_t totalRequests_ = 0;
+    uint64_t acceptedRequests_ = 0;
+    
+public:
+    SlidingWindowBucket(size_t bucketSize, double refillRate, const Clock* clock = nullptr)
+        : Bucket(clock), bucketSize_(bucketSize), refillRate_(refillRate),
+          windowNs_(windowFor(bucketSize, refillRate)), windowStartNs_(toNs(clock_->now())) {}
+    
+    bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        return reserveAt(tokensNeeded, now).count() == 0;
+    }
+    
+    std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        const int64_t ns = toNs(now);
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        roll(ns);
+        totalRequests_++;
+        
+        if (tokensNeeded > bucketSize_) {
+            return kNever;
+        }
+        const double room = static_cast<double>(bucketSize_ - tokensNeeded);
+        if (usedAt(ns) <= room) {
+            current_ += tokensNeeded;
+            acceptedRequests_++;
+            return std::chrono::nanoseconds(0);
+        }
+        if (windowNs_ == 0) {
+            return kNever;
+        }
+        
+        // The previous count fades out over the rest of this window, then the
+        // current one over the next
+        const double window = static_cast<double>(windowNs_);
+        const double elapsed = static_cast<double>(ns - windowStartNs_);
+        const double roomNow = room - static_cast<double>(current_);
+        if (roomNow >= 0.0 && previous_ > 0) {
+            double wait = window * (1.0 - roomNow / static_cast<double>(previous_)) - elapsed;
+            if (elapsed + wait < window) {
+                return std::chrono::nanoseconds(std::max<int64_t>(static_cast<int64_t>(std::ceil(wait)), 1));
+            }
+        }
+        double wait = window - elapsed;
+        if (current_ > 0) {
+            wait += std::max(0.0, window * (1.0 - room / static_cast<double>(current_)));
+        }
+        return std::chrono::nanoseconds(std::max<int64_t>(static_cast<int64_t>(std::ceil(wait)), 1));
+    }
+    
+    size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        const int64_t ns = toNs(now);
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        roll(ns);
+        totalRequests_++;
+        
+        const double room = std::floor(static_cast<double>(bucketSize_) - usedAt(ns));
+        const size_t granted = room > 0.0 ? std::min(maxTokens, static_cast<size_t>(room)) : 0;
+        if (granted > 0) {
+            current_ += granted;
+            acceptedRequests_++;
+        }
+        return granted;
+    }
+    
+    ClientStatistics getStatistics() const override {
+        const int64_t ns = toNs(clock_->now());
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        // Roll over for current statistics
+        const_cast<SlidingWindowBucket*>(this)->roll(ns);
+        
+        return {
+            static_cast<size_t>(std::max(0.0, static_cast<double>(bucketSize_) - usedAt(ns))),
+            bucketSize_,
+            refillRate_,
+            totalRequests_,
+            acceptedRequests_,
+            std::chrono::steady_clock::time_point(std::chrono::nanoseconds(windowStartNs_))
+        };
+    }
+    
+    void reset() override {
+        auto now = clock_->now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        windowStartNs_ = toNs(now);
+        previous_ = 0;
+        current_ = 0;
+        totalRequests_ = 0;
+        acceptedRequests_ = 0;
+        touch(now);
+    }
+    
+    void refund(size_t tokens) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current_ -= std::min<uint64_t>(tokens, current_);
+        if (acceptedRequests_ > 0) {
+            acceptedRequests_--;
+        }
+    }
+    
+    void returnTokens(size_t tokens) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current_ -= std::min<uint64_t>(tokens, current_);
+    }
+    
+    // Saved as the tokens left now; a restore counts them all as taken at
+    // the saved time, so it never allows more than the saved state would
+    State saveState() const override {
+        const int64_t ns = toNs(clock_->now());
+        std::lock_guard<std::mutex> lock(mutex_);
+        const_cast<SlidingWindowBucket*>(this)->roll(ns);
+        return {
+            std::max(0.0, static_cast<double>(bucketSize_) - usedAt(ns)),
+            std::chrono::steady_clock::time_point(std::chrono::nanoseconds(ns)),
+            totalRequests_,
+            acceptedRequests_
+        };
+    }
+    
+    void restoreState(const State& state) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double bucketSize = static_cast<double>(bucketSize_);
+        windowStartNs_ = toNs(state.lastRefill);
+        previous_ = 0;
+        current_ = static_cast<uint64_t>(std::ceil(bucketSize - std::clamp(state.tokens, 0.0, bucketSize)));
+        totalRequests_ = state.totalRequests;
+        acceptedRequests_ = state.acceptedRequests;
+        touch(clock_->now());
+    }
+    
+    void setLimits(size_t bucketSize, double refillRate) override {
+        const int64_t ns = toNs(clock_->now());
+        std::lock_guard<std::mutex> lock(mutex_);
+        roll(ns);
+        if (bucketSize != bucketSize_) {
+            const double ratio = bucketSize_ > 0 ? static_cast<double>(bucketSize) / static_cast<double>(bucketSize_)
+                                                 : 0.0;
+            previous_ = static_cast<uint64_t>(static_cast<double>(previous_) * ratio);
+            current_ = static_cast<uint64_t>(static_cast<double>(current_) * ratio);
+            bucketSize_ = bucketSize;
+        }
+        refillRate_ = refillRate;
+        windowNs_ = windowFor(bucketSize, refillRate);
+    }
+
+private:
+    static int64_t toNs(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+    
+    static int64_t windowFor(size_t bucketSize, double refillRate) {
+        if (refillRate <= 0.0) {
+            return 0;
+        }
+        const double ns = std::ceil(static_cast<double>(bucketSize) / refillRate * 1e9);
+        return static_cast<int64_t>(std::clamp(ns, 1.0, 1e18));
+    }
+    
+    void roll(int64_t ns) {
+        if (windowNs_ == 0 || ns - windowStartNs_ < windowNs_) {
+            return;
+        }
+        const int64_t windows = (ns - windowStartNs_) / windowNs_;
+        previous_ = windows == 1 ? current_ : 0;
+        current_ = 0;
+        windowStartNs_ += windows * windowNs_;
+    }
+    
+    // Tokens counted against the bucket at `ns`, after roll(ns)
+    double usedAt(int64_t ns) const {
+        if (windowNs_ == 0) {
+            return static_cast<double>(current_);
+        }
+        const double remaining = 1.0 - static_cast<double>(ns - windowStartNs_) / static_cast<double>(windowNs_);
+        return static_cast<double>(current_) + static_cast<double>(previous_) * std::max(remaining, 0.0);
+    }
+};
+
+// Shared token source for cluster mode. Every node's limiter leases chunks of
+// a client's tokens from it, so the cluster as a whole stays within the
+// client's limits. Implementations wrap Redis, a gRPC peer, etc.; calls come
+// from the maintenance thread, except a client's first lease on each node.
+class TokenLeaseBackend {
+public:
+    virtual ~TokenLeaseBackend() = default;
+    
+    // Takes up to `requested` tokens from the client's shared bucket (created
+    // with the given limits if new) and returns how many were granted
+    virtual size_t acquireTokens(std::string_view clientId, size_t requested,
+                                 size_t bucketSize, double refillRate) = 0;
+};
+
+// In-process backend: one shared token bucket per client behind a mutex. Lets
+// several limiters in one process share limits, and serves as a reference
+// for networked backends.
+class LocalLeaseBackend : public TokenLeaseBackend {
+private:
+    struct Entry {
+        double tokens;
+        std::chrono::steady_clock::time_point lastRefill;
+    };
+    
+    const Clock* clock_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> buckets_;
+    
+public:
+    explicit LocalLeaseBackend(const Clock* clock = nullptr)
+        : clock_(clock ? clock : &Clock::precise()) {}
+    
+    size_t acquireTokens(std::string_view clientId, size_t requested,
+                         size_t bucketSize, double refillRate) override {
+        auto now = clock_->now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        auto [it, created] = buckets_.try_emplace(std::string(clientId),
+                                                  Entry{static_cast<double>(bucketSize), now});
+        Entry& entry = it->second;
+        if (!created) {
+            double elapsed = std::chrono::duration<double>(now - entry.lastRefill).count();
+            if (elapsed > 0) {
+                entry.tokens = std::min(entry.tokens + elapsed * refillRate, static_cast<double>(bucketSize));
+                entry.lastRefill = now;
+            }
+        }
+        
+        size_t granted = std::min(requested, static_cast<size_t>(entry.tokens));
+        entry.tokens -= static_cast<double>(granted);
+        return granted;
+    }
+};
+
+class LeasedBucket;
+
+// Collects leased buckets running low and tops them up from the backend on
+// the maintenance thread, off the request path
+class TokenLeaseManager {
+private:
+    std::shared_ptr<TokenLeaseBackend> backend_;
+    std::chrono::nanoseconds horizon_;      // Time a lease should last at the observed rate
+    size_t minLeaseSize_;
+    std::mutex mutex_;
+    std::vector<std::weak_ptr<LeasedBucket>> pending_;
+    
+public:
+    TokenLeaseManager(std::shared_ptr<TokenLeaseBackend> backend, std::chrono::nanoseconds horizon,
+                      size_t minLeaseSize)
+        : backend_(std::move(backend)), horizon_(horizon), minLeaseSize_(std::max<size_t>(minLeaseSize, 1)) {}
+    
+    TokenLeaseBackend& backend() const {
+        return *backend_;
+    }
+    
+    std::chrono::nanoseconds horizon() const {
+        return horizon_;
+    }
+    
+    size_t minLeaseSize() const {
+        return minLeaseSize_;
+    }
+    
+    void enqueue(std::weak_ptr<LeasedBucket> bucket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(std::move(bucket));
+    }
+    
+    // Refreshes every queued bucket; returns the number refreshed
+    size_t refreshPending(std::chrono::steady_clock::time_point now);
+};
+
+// Bucket for cluster mode. Requests consume a locally held lease with one CAS,
+// as fast as AtomicTokenBucket; when the lease drops below half of its target
+// size the bucket queues itself for a background top-up. The target size
+// follows the client's observed rate (EWMA) so busy clients need few backend
+// calls and idle ones do not hoard tokens. Only a client's very first request
+// on a node waits for the backend. Unused lease tokens are not returned when
+// the bucket is evicted, which can only make the cluster stricter.
+class LeasedBucket : public Bucket, public std::enable_shared_from_this<LeasedBucket> {
+private:
+    const std::string clientId_;
+    std::atomic<size_t> bucketSize_;        // Limits passed on to the backend
+    std::atomic<double> refillRate_;
+    std::shared_ptr<TokenLeaseManager> manager_;
+    
+    std::atomic<int64_t> tokens_{0};        // Whole tokens left in the local lease
+    std::atomic<size_t> targetLease_;
+    std::atomic<size_t> largestRequest_{1}; // A lease must fit the biggest request seen
+    std::atomic<bool> leased_{false};
+    std::atomic<bool> refreshQueued_{false};
+    
+    std::atomic<uint64_t> consumed_{0};     // Tokens taken since the last refresh
+    
+    // Guarded by leaseMutex_, which also serializes backend calls per bucket
+    mutable std::mutex leaseMutex_;
+    std::chrono::steady_clock::time_point lastLease_;
+    double rateEstimate_ = 0.0;             // Tokens per second
+    
+    // Client-specific statistics
+    std::atomic<uint64_t> totalRequests_{0};
+    std::atomic<uint64_t> acceptedRequests_{0};
+    
+public:
+    LeasedBucket(std::string clientId, size_t bucketSize, double refillRate, const Clock* clock,
+                 std::shared_ptr<TokenLeaseManager> manager)
+        : Bucket(clock), clientId_(std::move(clientId)), bucketSize_(bucketSize), refillRate_(refillRate),
+          manager_(std::move(manager)),
+          targetLease_(std::clamp<size_t>(static_cast<size_t>(std::ceil(refillRate *
+              std::chrono::duration<double>(manager_->horizon()).count())), manager_->minLeaseSize(),
+              std::max<size_t>(bucketSize, 1))),
+          lastLease_(clock_->now()) {}
+    
+    bool consumeAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        if (!leased_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(leaseMutex_);
+            if (!leased_.load(std::memory_order_relaxed)) {
+                refreshLocked(now);
+            }
+        }
+        
+        const int64_t needed = static_cast<int64_t>(tokensNeeded);
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        while (current >= needed) {
+            if (tokens_.compare_exchange_weak(current, current - needed,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+                consumed_.fetch_add(tokensNeeded, std::memory_order_relaxed);
+                if (current - needed < static_cast<int64_t>(targetLease_.load(std::memory_order_relaxed) / 2)) {
+                    queueRefresh();
+                }
+                return true;
+            }
+        }
+        
+        if (tokensNeeded > largestRequest_.load(std::memory_order_relaxed)) {
+            largestRequest_.store(std::min(tokensNeeded, bucketSize_.load(std::memory_order_relaxed)),
+                                  std::memory_order_relaxed);
+        }
+        queueRefresh();
+        return false;
+    }
+    
+    // The backend's refill timing is unknown here, so a short lease gives the
+    // next top-up as the estimate
+    std::chrono::nanoseconds reserveAt(size_t tokensNeeded, std::chrono::steady_clock::time_point now) override {
+        if (tokensNeeded > bucketSize_.load(std::memory_order_relaxed)) {
+            totalRequests_.fetch_add(1, std::memory_order_relaxed);
+            return kNever;
+        }
+        if (consumeAt(tokensNeeded, now)) {
+            return std::chrono::nanoseconds(0);
+        }
+        return std::max(manager_->horizon() / 2, std::chrono::nanoseconds(1));
+    }
+    
+    size_t consumeUpToAt(size_t maxTokens, std::chrono::steady_clock::time_point now) override {
+        touch(now);
+        totalRequests_.fetch_add(1, std::memory_order_relaxed);
+        
+        if (!leased_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(leaseMutex_);
+            if (!leased_.load(std::memory_order_relaxed)) {
+                refreshLocked(now);
+            }
+        }
+        
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        size_t granted = 0;
+        for (;;) {
+            granted = std::min(maxTokens, static_cast<size_t>(std::max<int64_t>(current, 0)));
+            if (granted == 0 ||
+                tokens_.compare_exchange_weak(current, current - static_cast<int64_t>(granted),
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        
+        if (granted > 0) {
+            acceptedRequests_.fetch_add(1, std::memory_order_relaxed);
+            consumed_.fetch_add(granted, std::memory_order_relaxed);
+        }
+        // A short grant means the client wants more than the lease holds
+        if (granted < maxTokens) {
+            if (maxTokens > largestRequest_.load(std::memory_order_relaxed)) {
+                largestRequest_.store(std::min(maxTokens, bucketSize_.load(std::memory_order_relaxed)),
+                                      std::memory_order_relaxed);
+            }
+            queueRefresh();
+        } else if (current - static_cast<int64_t>(granted) <
+                   static_cast<int64_t>(targetLease_.load(std::memory_order_relaxed) / 2)) {
+            queueRefresh();
+        }
+        return granted;
+    }
+    
+    ClientStatistics getStatistics() const override {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        return {
+            static_cast<size_t>(std::max<int64_t>(tokens_.load(std::memory_order_acquire), 0)),
+            bucketSize_.load(std::memory_order_relaxed),
+            refillRate_.load(std::memory_order_relaxed),
+            totalRequests_.load(std::memory_order_relaxed),
+            acceptedRequests_.load(std::memory_order_relaxed),
+            lastLease_
+        };
+    }
+    
+    // Clears the counters; leased tokens belong to the cluster and are kept
+    void reset() override {
+        totalRequests_.store(0, std::memory_order_relaxed);
+        acceptedRequests_.store(0, std::memory_order_relaxed);
+        touch(clock_->now());
+    }
+    
+    void refund(size_t tokens) override {
+        returnTokens(tokens);
+        acceptedRequests_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    void returnTokens(size_t tokens) override {
+        tokens_.fetch_add(static_cast<int64_t>(tokens), std::memory_order_acq_rel);
+        consumed_.fetch_sub(tokens, std::memory_order_relaxed);
+    }
+    
+    // Leased tokens belong to the cluster and are not carried across restarts
+    State saveState() const override {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        return {0.0, lastLease_, totalRequests_.load(std::memory_order_relaxed),
+                acceptedRequests_.load(std::memory_order_relaxed)};
+    }
+    
+    void restoreState(const State& state) override {
+        totalRequests_.store(state.totalRequests, std::memory_order_relaxed);
+        acceptedRequests_.store(state.acceptedRequests, std::memory_order_relaxed);
+        touch(clock_->now());
+    }
+    
+    // The backend owns the client's tokens and sees the new limits on the next
+    // top-up; the local lease is kept, only trimmed to a smaller bucket size
+    void setLimits(size_t bucketSize, double refillRate) override {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        bucketSize_.store(bucketSize, std::memory_order_relaxed);
+        refillRate_.store(refillRate, std::memory_order_relaxed);
+        
+        const size_t cap = std::max<size_t>(bucketSize, 1);
+        targetLease_.store(std::clamp(targetLease_.load(std::memory_order_relaxed), manager_->minLeaseSize(), cap),
+                           std::memory_order_relaxed);
+        largestRequest_.store(std::min(largestRequest_.load(std::memory_order_relaxed), cap),
+                              std::memory_order_relaxed);
+        
+        int64_t current = tokens_.load(std::memory_order_relaxed);
+        while (current > static_cast<int64_t>(bucketSize) &&
+               !tokens_.compare_exchange_weak(current, static_cast<int64_t>(bucketSize),
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+        }
+    }
+    
+    size_t targetLeaseSize() const {
+        return targetLease_.load(std::memory_order_relaxed);
+    }
+    
+    // Re-estimates the client's rate and tops the lease up to the new target
+    void refreshLease(std::chrono::steady_clock::time_point now) {
+        refreshQueued_.store(false, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        refreshLocked(now);
+    }
+
+private:
+    void refreshLocked(std::chrono::steady_clock::time_point now) {
+        // Very short windows give noisy rate samples; keep the old estimate
+        double elapsed = std::chrono::duration<double>(now - lastLease_).count();
+        if (leased_.load(std::memory_order_relaxed) && elapsed >= 1e-3) {
+            uint64_t consumed = consumed_.exchange(0, std::memory_order_relaxed);
+            double sample = static_cast<double>(consumed) / elapsed;
+            rateEstimate_ = rateEstimate_ == 0.0 ? sample : 0.5 * rateEstimate_ + 0.5 * sample;
+            
+            double horizon = std::chrono::duration<double>(manager_->horizon()).count();
+            size_t target = std::max(static_cast<size_t>(std::ceil(rateEstimate_ * horizon)),
+                                     largestRequest_.load(std::memory_order_relaxed));
+            targetLease_.store(std::clamp<size_t>(target, manager_->minLeaseSize(),
+                                                  std::max<size_t>(bucketSize_.load(std::memory_order_relaxed), 1)),
+                               std::memory_order_relaxed);
+        }
+        
+        int64_t held = tokens_.load(std::memory_order_acquire);
+        int64_t want = static_cast<int64_t>(targetLease_.load(std::memory_order_relaxed)) - held;
+        if (want > 0) {
+            size_t granted = manager_->backend().acquireTokens(clientId_, static_cast<size_t>(want),
+                                                               bucketSize_.load(std::memory_order_relaxed),
+                                                               refillRate_.load(std::memory_order_relaxed));
+            tokens_.fetch_add(static_cast<int64_t>(granted), std::memory_order_acq_rel);
+        }
+        
+        if (elapsed >= 1e-3 || !leased_.load(std::memory_order_relaxed)) {
+            lastLease_ = now;
+        }
+        leased_.store(true, std::memory_order_release);
+    }
+    
+    void queueRefresh() {
+        if (!refreshQueued_.exchange(true, std::memory_order_acq_rel)) {
+            manager_->enqueue(weak_from_this());
+        }
+    }
+};
+
+inline size_t TokenLeaseManager::refreshPending(std::chrono::steady_clock::time_point now) {
+    std::vector<std::weak_ptr<LeasedBucket>> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch.swap(pending_);
+    }
+    
+    size_t refreshed = 0;
+    for (auto& weak : batch) {
+        if (auto bucket = weak.lock()) {
+            bucket->refreshLease(now);
+            ++refreshed;
+        }
+    }
+    return refreshed;
+}
+
+// Hash used for both shard selection and the per-shard maps, exposed so callers
+// can compute it once at the edge and pass it along in a ClientKey
+inline uint64_t hashClientId(std::string_view clientId) {
+    return std::hash<std::string_view>{}(clientId);
+}
+
+// Client identifier with its precomputed hash. The id is a non-owning view and
+// must stay valid for the duration of the call it is passed to.
+struct ClientKey {
+    std::string_view id;
+    uint64_t hash;
+    
+    explicit ClientKey(std::string_view clientId)
+        : id(clientId), hash(hashClientId(clientId)) {}
+    
+    // precomputedHash must be hashClientId(clientId): lookups probe with it
+    // while the map itself hashes the stored id
+    ClientKey(std::string_view clientId, uint64_t precomputedHash)
+        : id(clientId), hash(precomputedHash) {
+        assert(hash == hashClientId(clientId));
+    }
+};
+
+// Transparent hash/equality so the client map can be probed with a string_view
+// or a ClientKey without building a std::string
+struct ClientKeyHash {
+    using is_transparent = void;
+    
+    size_t operator()(std::string_view clientId) const {
+        return static_cast<size_t>(hashClientId(clientId));
+    }
+    
+    size_t operator()(const ClientKey& key) const {
+        return static_cast<size_t>(key.hash);
+    }
+};
+
+struct ClientKeyEqual {
+    using is_transparent = void;
+    
+    bool operator()(std::string_view lhs, std::string_view rhs) const {
+        return lhs == rhs;
+    }
+    
+    bool operator()(const ClientKey& lhs, std::string_view rhs) const {
+        return lhs.id == rhs;
+    }
+    
+    bool operator()(std::string_view lhs, const ClientKey& rhs) const {
+        return lhs == rhs.id;
+    }
+};
+
+// Recycles fixed-size blocks for buckets and client map nodes. Requests are
+// rounded up to one of a few 64-byte size classes; each class hands out freed
+// blocks first and otherwise carves new ones from 64 KiB slabs, so creating
+// and evicting clients at a steady rate never reaches malloc. Slabs are only
+// released with the pool. Blocks may be freed from any thread (the last
+// holder of a bucket), so each class has its own lock.
+class SlabPool {
+public:
+    static constexpr size_t kBlockAlign = 64;   // Also keeps neighbouring buckets off each other's lines
+    static constexpr size_t kSizeClasses = 8;
+    static constexpr size_t kMaxBlockSize = kBlockAlign * kSizeClasses;
+    static constexpr size_t kSlabSize = size_t(64) << 10;
+    
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    
+    struct alignas(64) SizeClass {
+        std::mutex mutex;
+        FreeBlock* free = nullptr;
+        char* cursor = nullptr;             // Unused tail of the newest slab
+        char* end = nullptr;
+    };
+    
+    std::array<SizeClass, kSizeClasses> classes_;
+    std::mutex slabsMutex_;
+    std::vector<void*> slabs_;
+    
+public:
+    SlabPool() = default;
+    
+    ~SlabPool() {
+        for (void* slab : slabs_) {
+            ::operator delete(slab, std::align_val_t(kBlockAlign));
+        }
+    }
+    
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    
+    static bool fits(size_t bytes, size_t alignment) {
+        return bytes > 0 && bytes <= kMaxBlockSize && alignment <= kBlockAlign;
+    }
+    
+    // `bytes` must satisfy fits()
+    void* allocate(size_t bytes) {
+        const size_t index = (bytes - 1) / kBlockAlign;
+        const size_t blockSize = (index + 1) * kBlockAlign;
+        SizeClass& sizeClass = classes_[index];
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        
+        if (FreeBlock* block = sizeClass.free) {
+            sizeClass.free = block->next;
+            return block;
+        }
+        
+        if (sizeClass.cursor == sizeClass.end) {
+            auto* slab = static_cast<char*>(::operator new(kSlabSize, std::align_val_t(kBlockAlign)));
+            {
+                std::lock_guard<std::mutex> slabsLock(slabsMutex_);
+                slabs_.push_back(slab);
+            }
+            sizeClass.cursor = slab;
+            sizeClass.end = slab + kSlabSize / blockSize * blockSize;
+        }
+        
+        void* block = sizeClass.cursor;
+        sizeClass.cursor += blockSize;
+        return block;
+    }
+    
+    void deallocate(void* pointer, size_t bytes) {
+        SizeClass& sizeClass = classes_[(bytes - 1) / kBlockAlign];
+        auto* block = static_cast<FreeBlock*>(pointer);
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        block->next = sizeClass.free;
+        sizeClass.free = block;
+    }
+    
+    size_t slabCount() {
+        std::lock_guard<std::mutex> lock(slabsMutex_);
+        return slabs_.size();
+    }
+};
+
+// Standard allocator over a SlabPool, for std::allocate_shared and node-based
+// containers. Single objects that fit a size class come from the pool; arrays
+// (e.g. a hash table's bucket array) and oversized types use the heap. Each
+// copy holds a reference to the pool, so a bucket that outlives its limiter
+// can still be freed into it.
+template <typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+    
+private:
+    std::shared_ptr<SlabPool> pool_;
+    
+    template <typename U>
+    friend class PoolAllocator;
+    
+public:
+    explicit PoolAllocator(std::shared_ptr<SlabPool> pool) : pool_(std::move(pool)) {}
+    
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) : pool_(other.pool_) {}
+    
+    T* allocate(size_t n) {
+        if (n == 1 && SlabPool::fits(sizeof(T), alignof(T))) {
+            return static_cast<T*>(pool_->allocate(sizeof(T)));
+        }
+        return std::allocator<T>().allocate(n);
+    }
+    
+    void deallocate(T* pointer, size_t n) {
+        if (n == 1 && SlabPool::fits(sizeof(T), alignof(T))) {
+            pool_->deallocate(pointer, sizeof(T));
+        } else {
+            std::allocator<T>().deallocate(pointer, n);
+        }
+    }
+    
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const {
+        return pool_ == other.pool_;
+    }
+};
+
+// Client id as stored in the map. Ids up to kInlineSize bytes (IPv6 addresses
+// included) live inside the map node; only longer ones allocate.
+class InlineKey {
+public:
+    static constexpr size_t kInlineSize = 48;
+    
+private:
+    size_t size_;
+    union {
+        char inline_[kInlineSize];
+        char* heap_;
+    };
+    
+public:
+    explicit InlineKey(std::string_view id) : size_(id.size()) {
+        char* data = inline_;
+        if (size_ > kInlineSize) {
+            data = heap_ = new char[size_];
+        }
+        std::memcpy(data, id.data(), size_);
+    }
+    
+    InlineKey(const InlineKey& other) : InlineKey(other.view()) {}
+    
+    InlineKey(InlineKey&& other) noexcept : size_(other.size_) {
+        if (size_ > kInlineSize) {
+            heap_ = std::exchange(other.heap_, nullptr);
+            other.size_ = 0;
+        } else {
+            std::memcpy(inline_, other.inline_, size_);
+        }
+    }
+    
+    InlineKey& operator=(const InlineKey&) = delete;
+    InlineKey& operator=(InlineKey&&) = delete;
+    
+    ~InlineKey() {
+        if (size_ > kInlineSize) {
+            delete[] heap_;
+        }
+    }
+    
+    std::string_view view() const {
+        return {size_ > kInlineSize ? heap_ : inline_, size_};
+    }
+    
+    operator std::string_view() const {
+        return view();
+    }
+    
+    size_t size() const {
+        return size_;
+    }
+};
+
+// Client table split into power-of-two shards, each with its own reader/writer
+// lock, so lookups of different clients do not serialize behind one mutex
+class ShardedClientMap {
+public:
+    using ClientMap = std::unordered_map<InlineKey, BucketPtr, ClientKeyHash, ClientKeyEqual,
+                                         PoolAllocator<std::pair<const InlineKey, BucketPtr>>>;
+    
+    // The pool also backs the shard's buckets, so churn in one shard does not
+    // contend with another's allocations
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+        ClientMap clients{0, ClientKeyHash(), ClientKeyEqual(), ClientMap::allocator_type(pool)};
+    };
+    
+private:
+    std::unique_ptr<Shard[]> shards_;
+    size_t shardMask_;
+    
+public:
+    explicit ShardedClientMap(size_t numShards) {
+        size_t count = 1;
+        while (count < numShards) {
+            count <<= 1;
+        }
+        shards_ = std::make_unique<Shard[]>(count);
+        shardMask_ = count - 1;
+    }
+    
+    size_t shardCount() const {
+        return shardMask_ + 1;
+    }
+    
+    Shard& shard(size_t index) {
+        return shards_[index];
+    }
+    
+    const Shard& shard(size_t index) const {
+        return shards_[index];
+    }
+    
+    Shard& shardFor(const ClientKey& key) {
+        return shards_[shardIndex(key.hash)];
+    }
+    
+    const Shard& shardFor(const ClientKey& key) const {
+        return shards_[shardIndex(key.hash)];
+    }
+    
+    size_t shardIndex(uint64_t h) const {
+        // Mix the hash so shard selection does not reuse the bits the
+        // per-shard unordered_map buckets on
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h) & shardMask_;
+    }
+};
+
+// Streaming heavy hitters (Space-Saving): the clients with the most events,
+// e.g. rejections, in fixed memory. Each thread records into its own stripe
+// of counters under the stripe's lock, taken with try_lock so that a reader
+// copying the stripe makes the writer drop the event instead of waiting. A
+// client without a counter takes over the stripe's smallest one and inherits
+// its count as error, so a count overstates by at most its error, and a
+// client with more than 1/slots of a stripe's events always has a counter.
+class HeavyHitters {
+public:
+    static constexpr size_t kStripes = 16;
+    static constexpr size_t kMaxClientId = 48;  // Longer ids are cut
+    
+    struct Entry {
+        std::string clientId;
+        uint64_t count;
+        uint64_t error;                     // Upper bound on the overcount
+    };
+    
+private:
+    struct Counter {
+        uint64_t hash = 0;
+        uint64_t count = 0;
+        uint64_t error = 0;
+        uint8_t clientIdLength = 0;
+        char clientId[kMaxClientId];
+    };
+    
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unique_ptr<Counter[]> counters;
+    };
+    
+    std::unique_ptr<Stripe[]> stripes_;
+    size_t countersPerStripe_;
+    std::atomic<uint64_t> dropped_{0};
+    
+public:
+    explicit HeavyHitters(size_t countersPerStripe)
+        : stripes_(std::make_unique<Stripe[]>(kStripes)),
+          countersPerStripe_(std::max<size_t>(countersPerStripe, 1)) {
+        for (size_t s = 0; s < kStripes; ++s) {
+            stripes_[s].counters = std::make_unique<Counter[]>(countersPerStripe_);
+        }
+    }
+    
+    // Never blocks; drops (and counts) the event while a reader holds the stripe
+    void record(std::string_view clientId) {
+        Stripe& stripe = stripes_[threadStripeId() % kStripes];
+        std::unique_lock<std::mutex> lock(stripe.mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        
+        clientId = clientId.substr(0, kMaxClientId);
+        const uint64_t hash = hashClientId(clientId);
+        Counter* smallest = &stripe.counters[0];
+        for (size_t i = 0; i < countersPerStripe_; ++i) {
+            Counter& counter = stripe.counters[i];
+            if (counter.count > 0 && counter.hash == hash &&
+                std::string_view(counter.clientId, counter.clientIdLength) == clientId) {
+                counter.count++;
+                return;
+            }
+            if (counter.count < smallest->count) {
+                smallest = &counter;
+            }
+        }
+        
+        smallest->hash = hash;
+        smallest->error = smallest->count;
+        smallest->count++;
+        smallest->clientIdLength = static_cast<uint8_t>(clientId.size());
+        std::memcpy(smallest->clientId, clientId.data(), clientId.size());
+    }
+    
+    // The `limit` largest counts over all stripes, largest first; a client
+    // counted in several stripes has its counts and errors summed
+    std::vector<Entry> top(size_t limit) const {
+        std::unordered_map<std::string, Entry> merged;
+        for (size_t s = 0; s < kStripes; ++s) {
+            std::lock_guard<std::mutex> lock(stripes_[s].mutex);
+            for (size_t i = 0; i < countersPerStripe_; ++i) {
+                const Counter& counter = stripes_[s].counters[i];
+                if (counter.count == 0) {
+                    continue;
+                }
+                std::string clientId(counter.clientId, counter.clientIdLength);
+                auto [it, created] = merged.try_emplace(clientId, Entry{clientId, 0, 0});
+                it->second.count += counter.count;
+                it->second.error += counter.error;
+            }
+        }
+        
+        std::vector<Entry> entries;
+        entries.reserve(merged.size());
+        for (auto& [clientId, entry] : merged) {
+            entries.push_back(std::move(entry));
+        }
+        const size_t kept = std::min(limit, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + kept, entries.end(),
+                          [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        entries.resize(kept);
+        return entries;
+    }
+    
+    uint64_t droppedEvents() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+    
+    void reset() {
+        for (size_t s = 0; s < kStripes; ++s) {
+            std::lock_guard<std::mutex> lock(stripes_[s].mutex);
+            std::fill(stripes_[s].counters.get(), stripes_[s].counters.get() + countersPerStripe_, Counter());
+        }
+        dropped_.store(0, std::memory_order_relaxed);
+    }
+};
+
+#if defined(__linux__)
+// Minimal HTTP endpoint for scrapers: GET /metrics answers with render()'s
+// text, anything else with 404. One thread accepts and answers connections in
+// turn, so render() only ever runs there and a slow scraper delays other
+// scrapes, never requests.
+class MetricsServer {
+private:
+    static constexpr int kPollMs = 100;     // Stop flag check period
+    
+    int listenFd_ = -1;
+    uint16_t port_ = 0;
+    std::function<std::string()> render_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+    
+public:
+    // Port 0 picks a free one; see port()
+    MetricsServer(const std::string& address, uint16_t port, std::function<std::string()> render)
+        : render_(std::move(render)) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("MetricsServer: invalid address " + address);
+        }
+        
+        listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if (listenFd_ < 0 || setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listenFd_, 16) != 0) {
+            if (listenFd_ >= 0) {
+                close(listenFd_);
+            }
+            throw std::runtime_error("MetricsServer: cannot listen on " + address + ":" + std::to_string(port));
+        }
+        
+        socklen_t length = sizeof(addr);
+        getsockname(listenFd_, reinterpret_cast<sockaddr*>(&addr), &length);
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this]() { serve(); });
+    }
+    
+    ~MetricsServer() {
+        stop();
+    }
+    
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+    
+    uint16_t port() const {
+        return port_;
+    }
+    
+    // Waits for a scrape in progress to finish
+    void stop() {
+        stopping_.store(true, std::memory_order_relaxed);
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (listenFd_ >= 0) {
+            close(listenFd_);
+            listenFd_ = -1;
+        }
+    }
+
+private:
+    void serve() {
+        while (!stopping_.load(std::memory_order_relaxed)) {
+            pollfd pending{listenFd_, POLLIN, 0};
+            if (poll(&pending, 1, kPollMs) <= 0) {
+                continue;
+            }
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            respond(fd);
+            close(fd);
+        }
+    }
+    
+    // Reads the request head (bounded in size and time) and answers it
+    void respond(int fd) {
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+            if (bytes <= 0) {
+                break;
+            }
+            request.append(buffer, static_cast<size_t>(bytes));
+        }
+        
+        const bool found = request.starts_with("GET /metrics ") || request.starts_with("GET /metrics?");
+        const std::string body = found ? render_() : "not found\n";
+        std::string response = std::string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+                               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t bytes = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (bytes <= 0) {
+                break;
+            }
+            sent += static_cast<size_t>(bytes);
+        }
+    }
+};
+#endif
+
+// Mutex that also works between processes when it lives in shared memory.
+// It is robust: if the owner dies while holding it, the next lock() takes it
+// over instead of hanging. Guarded data must tolerate a half-done update.
+class ProcessMutex {
+private:
+#if defined(__linux__)
+    pthread_mutex_t mutex_;
+#else
+    std::mutex mutex_;
+#endif
+    
+public:
+    ProcessMutex() {
+#if defined(__linux__)
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&mutex_, &attr);
+        pthread_mutexattr_destroy(&attr);
+#endif
+    }
+    
+#if defined(__linux__)
+    ~ProcessMutex() {
+        pthread_mutex_destroy(&mutex_);
+    }
+#endif
+    
+    ProcessMutex(const ProcessMutex&) = delete;
+    ProcessMutex& operator=(const ProcessMutex&) = delete;
+    
+    void lock() {
+#if defined(__linux__)
+        if (pthread_mutex_lock(&mutex_) == EOWNERDEAD) {
+            pthread_mutex_consistent(&mutex_);
+        }
+#else
+        mutex_.lock();
+#endif
+    }
+    
+    void unlock() {
+#if defined(__linux__)
+        pthread_mutex_unlock(&mutex_);
+#else
+        mutex_.unlock();
+#endif
+    }
+};
+
+// Refill-and-check arithmetic for compact slots, over structure-of-arrays
+// lanes so many slots go through one vector instruction. Every variant does
+// the same IEEE operations in the same order as refillLane() (no FMA, exact
+// integer/double conversions), so the vector results are bit-identical to
+// the scalar path. The best variant is picked once at startup from the CPU's
+// features: AVX-512F (16 integer / 8 double lanes), AVX2 (8 / 4), NEON on
+// AArch64 (4 / 2), else scalar.
+struct RefillLanes {
+    static constexpr size_t kMaxLanes = 64;
+    
+    // Inputs
+    alignas(64) uint32_t tokens[kMaxLanes];
+    alignas(64) uint32_t last[kMaxLanes];       // Last refill tick
+    alignas(64) uint32_t capacity[kMaxLanes];
+    alignas(64) uint32_t needed[kMaxLanes];     // Fixed-point tokens to take (0 = refill only)
+    alignas(64) double unitsPerTick[kMaxLanes];
+    
+    // Outputs
+    alignas(64) uint32_t newTokens[kMaxLanes];
+    alignas(64) uint32_t newLast[kMaxLanes];
+    alignas(64) uint8_t allowed[kMaxLanes];
+};
+
+class RefillKernels {
+public:
+    using Kernel = void (*)(RefillLanes& lanes, size_t count, uint32_t nowTick);
+    using IdleKernel = void (*)(const uint32_t* ticks, size_t count, uint32_t nowTick, uint32_t maxAge,
+                                uint8_t* idle);
+    
+    // The scalar reference. Credits whole fixed-point units and advances the
+    // tick only by the time they account for, so fractions carry over.
+    static void refillLane(uint32_t tokens, uint32_t last, uint32_t capacity, double unitsPerTick,
+                           uint32_t nowTick, uint32_t& newTokens, uint32_t& newLast) {
+        uint32_t elapsed = nowTick - last;
+        if (elapsed > (1u << 31)) {
+            elapsed = 0; // Another thread stored a slightly later tick
+        }
+        
+        newTokens = tokens;
+        newLast = last;
+        double credit = elapsed * unitsPerTick;
+        if (tokens >= capacity || credit >= static_cast<double>(capacity - tokens)) {
+            newTokens = capacity;
+            newLast = nowTick;
+        } else if (credit >= 1.0) {
+            uint32_t units = static_cast<uint32_t>(credit);
+            newTokens = tokens + units;
+            newLast = last + static_cast<uint32_t>(std::ceil(units / unitsPerTick));
+        }
+    }
+    
+    // Age in ticks, measured backwards from now; wrapped ages count as fresh
+    static bool idleLane(uint32_t tick, uint32_t nowTick, uint32_t maxAge) {
+        uint32_t age = nowTick - tick;
+        return age <= (1u << 31) && age > maxAge;
+    }
+    
+    static void scalar(RefillLanes& lanes, size_t count, uint32_t nowTick) {
+        scalarRange(lanes, 0, count, nowTick);
+    }
+    
+    static void scalarIdle(const uint32_t* ticks, size_t count, uint32_t nowTick, uint32_t maxAge, uint8_t* idle) {
+        for (size_t i = 0; i < count; ++i) {
+            idle[i] = idleLane(ticks[i], nowTick, maxAge) ? 1 : 0;
+        }
+    }
+    
+    static Kernel best() {
+        static const Kernel kernel = select().first;
+        return kernel;
+    }
+    
+    static IdleKernel bestIdle() {
+        static const IdleKernel kernel = select().second;
+        return kernel;
+    }
+    
+    static const char* bestName() {
+#if defined(__GNUC__) && defined(__x86_64__)
+        if (best() == &avx512) {
+            return "avx512";
+        }
+        if (best() == &avx2) {
+            return "avx2";
+        }
+#elif defined(__aarch64__)
+        return "neon";
+#endif
+        return "scalar";
+    }
+    
+    // Every variant this CPU can run, scalar first; for cross-checking
+    static std::vector<std::pair<const char*, Kernel>> available() {
+        std::vector<std::pair<const char*, Kernel>> kernels{{"scalar", &scalar}};
+#if defined(__GNUC__) && defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.emplace_back("avx2", &avx2);
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels.emplace_back("avx512", &avx512);
+        }
+#elif defined(__aarch64__)
+        kernels.emplace_back("neon", &neon);
+#endif
+        return kernels;
+    }
+
+private:
+    static void scalarRange(RefillLanes& lanes, size_t begin, size_t end, uint32_t nowTick) {
+        for (size_t i = begin; i < end; ++i) {
+            refillLane(lanes.tokens[i], lanes.last[i], lanes.capacity[i], lanes.unitsPerTick[i], nowTick,
+                       lanes.newTokens[i], lanes.newLast[i]);
+            bool allowed = lanes.needed[i] > 0 && lanes.newTokens[i] >= lanes.needed[i];
+            if (allowed) {
+                lanes.newTokens[i] -= lanes.needed[i];
+            }
+            lanes.allowed[i] = allowed ? 1 : 0;
+        }
+    }
+    
+    static std::pair<Kernel, IdleKernel> select() {
+#if defined(__GNUC__) && defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return {&avx512, &avx512Idle};
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return {&avx2, &avx2Idle};
+        }
+#elif defined(__aarch64__)
+        return {&neon, &neonIdle};
+#endif
+        return {&scalar, &scalarIdle};
+    }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    // AVX2 has only signed conversions and compares; these bias by 2^31
+    __attribute__((target("avx2")))
+    static __m256d u32ToDouble(__m128i values) {
+        const __m128i bias = _mm_set1_epi32(INT32_MIN);
+        return _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(values, bias)), _mm256_set1_pd(2147483648.0));
+    }
+    
+    // Truncates non-negative doubles below 2^32
+    __attribute__((target("avx2")))
+    static __m128i doubleToU32(__m256d values) {
+        const __m256d two31 = _mm256_set1_pd(2147483648.0);
+        __m256d high = _mm256_cmp_pd(values, two31, _CMP_GE_OQ);
+        __m128i converted = _mm256_cvttpd_epi32(_mm256_sub_pd(values, _mm256_and_pd(high, two31)));
+        return _mm_xor_si128(converted, _mm_and_si128(packMask(high), _mm_set1_epi32(INT32_MIN)));
+    }
+    
+    // 64-bit lane mask to 32-bit lanes
+    __attribute__((target("avx2")))
+    static __m128i packMask(__m256d mask) {
+        __m256i shuffled = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(mask), _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+        return _mm256_castsi256_si128(shuffled);
+    }
+    
+    __attribute__((target("avx2")))
+    static __m256i geU32(__m256i a, __m256i b) {
+        return _mm256_cmpeq_epi32(_mm256_max_epu32(a, b), a);
+    }
+    
+    __attribute__((target("avx2")))
+    static void avx2(RefillLanes& lanes, size_t count, uint32_t nowTick) {
+        const __m256i now = _mm256_set1_epi32(static_cast<int32_t>(nowTick));
+        const __m256i half = _mm256_set1_epi32(INT32_MIN);      // 2^31
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256d one = _mm256_set1_pd(1.0);
+        
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i tokens = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.tokens + i));
+            __m256i last = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.last + i));
+            __m256i capacity = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.capacity + i));
+            __m256i needed = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.needed + i));
+            __m256d rateLo = _mm256_load_pd(lanes.unitsPerTick + i);
+            __m256d rateHi = _mm256_load_pd(lanes.unitsPerTick + i + 4);
+            
+            __m256i elapsed = _mm256_sub_epi32(now, last);
+            elapsed = _mm256_and_si256(geU32(half, elapsed), elapsed);
+            
+            __m256d creditLo = _mm256_mul_pd(u32ToDouble(_mm256_castsi256_si128(elapsed)), rateLo);
+            __m256d creditHi = _mm256_mul_pd(u32ToDouble(_mm256_extracti128_si256(elapsed, 1)), rateHi);
+            __m256i room = _mm256_sub_epi32(capacity, tokens);
+            __m256d roomLo = u32ToDouble(_mm256_castsi256_si128(room));
+            __m256d roomHi = u32ToDouble(_mm256_extracti128_si256(room, 1));
+            
+            __m256i full = _mm256_or_si256(geU32(tokens, capacity), _mm256_set_m128i(
+                packMask(_mm256_cmp_pd(creditHi, roomHi, _CMP_GE_OQ)),
+                packMask(_mm256_cmp_pd(creditLo, roomLo, _CMP_GE_OQ))));
+            __m256i partial = _mm256_andnot_si256(full, _mm256_set_m128i(
+                packMask(_mm256_cmp_pd(creditHi, one, _CMP_GE_OQ)),
+                packMask(_mm256_cmp_pd(creditLo, one, _CMP_GE_OQ))));
+            
+            // units = trunc(credit); advance = ceil(units / rate)
+            __m256d unitsLo = _mm256_round_pd(creditLo, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m256d unitsHi = _mm256_round_pd(creditHi, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m256i units = _mm256_set_m128i(doubleToU32(unitsHi), doubleToU32(unitsLo));
+            __m256i advance = _mm256_set_m128i(
+                doubleToU32(_mm256_round_pd(_mm256_div_pd(unitsHi, rateHi), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)),
+                doubleToU32(_mm256_round_pd(_mm256_div_pd(unitsLo, rateLo), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)));
+            
+            __m256i newTokens = _mm256_blendv_epi8(tokens, _mm256_add_epi32(tokens, units), partial);
+            newTokens = _mm256_blendv_epi8(newTokens, capacity, full);
+            __m256i newLast = _mm256_blendv_epi8(last, _mm256_add_epi32(last, advance), partial);
+            newLast = _mm256_blendv_epi8(newLast, now, full);
+            
+            __m256i allowed = _mm256_andnot_si256(_mm256_cmpeq_epi32(needed, zero), geU32(newTokens, needed));
+            newTokens = _mm256_sub_epi32(newTokens, _mm256_and_si256(allowed, needed));
+            
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.newTokens + i), newTokens);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.newLast + i), newLast);
+            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(allowed));
+            for (int b = 0; b < 8; ++b) {
+                lanes.allowed[i + b] = static_cast<uint8_t>((bits >> b) & 1);
+            }
+        }
+        scalarRange(lanes, i, count, nowTick);
+    }
+    
+    __attribute__((target("avx2")))
+    static void avx2Idle(const uint32_t* ticks, size_t count, uint32_t nowTick, uint32_t maxAge, uint8_t* idle) {
+        const __m256i now = _mm256_set1_epi32(static_cast<int32_t>(nowTick));
+        const __m256i half = _mm256_set1_epi32(INT32_MIN);
+        const __m256i limit = _mm256_set1_epi32(static_cast<int32_t>(maxAge));
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i age = _mm256_sub_epi32(now, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ticks + i)));
+            // age <= 2^31 && !(maxAge >= age)
+            __m256i mask = _mm256_andnot_si256(geU32(limit, age), geU32(half, age));
+            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+            for (int b = 0; b < 8; ++b) {
+                idle[i + b] = static_cast<uint8_t>((bits >> b) & 1);
+            }
+        }
+        scalarIdle(ticks + i, count - i, nowTick, maxAge, idle + i);
+    }
+    
+    // Zero-masked forms throughout: the unmasked intrinsics start from an
+    // undefined vector, which GCC 12 reports as maybe-uninitialized
+    __attribute__((target("avx512f")))
+    static __m512d halfToDouble(__m512i values, int half) {
+        __m256i part = half ? _mm512_maskz_extracti64x4_epi64(0xF, values, 1)
+                            : _mm512_maskz_extracti64x4_epi64(0xF, values, 0);
+        return _mm512_maskz_cvtepu32_pd(0xFF, part);
+    }
+    
+    // Truncates two vectors of non-negative doubles below 2^32 into one
+    __attribute__((target("avx512f")))
+    static __m512i doublesToU32(__m512d lo, __m512d hi) {
+        return _mm512_maskz_shuffle_i64x2(0xFF, _mm512_maskz_broadcast_i64x4(0xFF, _mm512_maskz_cvttpd_epu32(0xFF, lo)),
+                                          _mm512_maskz_broadcast_i64x4(0xFF, _mm512_maskz_cvttpd_epu32(0xFF, hi)), 0x44);
+    }
+    
+    __attribute__((target("avx512f")))
+    static void avx512(RefillLanes& lanes, size_t count, uint32_t nowTick) {
+        const __m512i now = _mm512_set1_epi32(static_cast<int32_t>(nowTick));
+        const __m512i half = _mm512_set1_epi32(INT32_MIN);
+        const __m512d one = _mm512_set1_pd(1.0);
+        
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m512i tokens = _mm512_load_si512(lanes.tokens + i);
+            __m512i last = _mm512_load_si512(lanes.last + i);
+            __m512i capacity = _mm512_load_si512(lanes.capacity + i);
+            __m512i needed = _mm512_load_si512(lanes.needed + i);
+            __m512d rateLo = _mm512_load_pd(lanes.unitsPerTick + i);
+            __m512d rateHi = _mm512_load_pd(lanes.unitsPerTick + i + 8);
+            
+            __m512i elapsed = _mm512_sub_epi32(now, last);
+            elapsed = _mm512_maskz_mov_epi32(_mm512_cmple_epu32_mask(elapsed, half), elapsed);
+            
+            __m512d creditLo = _mm512_mul_pd(halfToDouble(elapsed, 0), rateLo);
+            __m512d creditHi = _mm512_mul_pd(halfToDouble(elapsed, 1), rateHi);
+            __m512i room = _mm512_sub_epi32(capacity, tokens);
+            __m512d roomLo = halfToDouble(room, 0);
+            __m512d roomHi = halfToDouble(room, 1);
+            
+            __mmask16 full = _mm512_cmpge_epu32_mask(tokens, capacity) |
+                static_cast<__mmask16>(_mm512_cmp_pd_mask(creditLo, roomLo, _CMP_GE_OQ) |
+                                       (_mm512_cmp_pd_mask(creditHi, roomHi, _CMP_GE_OQ) << 8));
+            __mmask16 partial = static_cast<__mmask16>(~full &
+                (_mm512_cmp_pd_mask(creditLo, one, _CMP_GE_OQ) | (_mm512_cmp_pd_mask(creditHi, one, _CMP_GE_OQ) << 8)));
+            
+            __m512d unitsLo = _mm512_maskz_roundscale_pd(0xFF, creditLo, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m512d unitsHi = _mm512_maskz_roundscale_pd(0xFF, creditHi, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m512i units = doublesToU32(unitsLo, unitsHi);
+            __m512d advanceLo = _mm512_maskz_roundscale_pd(0xFF, _mm512_div_pd(unitsLo, rateLo), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+            __m512d advanceHi = _mm512_maskz_roundscale_pd(0xFF, _mm512_div_pd(unitsHi, rateHi), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+            __m512i advance = doublesToU32(advanceLo, advanceHi);
+            
+            __m512i newTokens = _mm512_mask_add_epi32(tokens, partial, tokens, units);
+            newTokens = _mm512_mask_mov_epi32(newTokens, full, capacity);
+            __m512i newLast = _mm512_mask_add_epi32(last, partial, last, advance);
+            newLast = _mm512_mask_mov_epi32(newLast, full, now);
+            
+            __mmask16 allowed = _mm512_test_epi32_mask(needed, needed) & _mm512_cmpge_epu32_mask(newTokens, needed);
+            newTokens = _mm512_mask_sub_epi32(newTokens, allowed, newTokens, needed);
+            
+            _mm512_store_si512(lanes.newTokens + i, newTokens);
+            _mm512_store_si512(lanes.newLast + i, newLast);
+            for (int b = 0; b < 16; ++b) {
+                lanes.allowed[i + b] = static_cast<uint8_t>((allowed >> b) & 1);
+            }
+        }
+        scalarRange(lanes, i, count, nowTick);
+    }
+    
+    __attribute__((target("avx512f")))
+    static void avx512Idle(const uint32_t* ticks, size_t count, uint32_t nowTick, uint32_t maxAge, uint8_t* idle) {
+        const __m512i now = _mm512_set1_epi32(static_cast<int32_t>(nowTick));
+        const __m512i half = _mm512_set1_epi32(INT32_MIN);
+        const __m512i limit = _mm512_set1_epi32(static_cast<int32_t>(maxAge));
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m512i age = _mm512_sub_epi32(now, _mm512_loadu_si512(ticks + i));
+            __mmask16 mask = _mm512_cmple_epu32_mask(age, half) & _mm512_cmpgt_epu32_mask(age, limit);
+            for (int b = 0; b < 16; ++b) {
+                idle[i + b] = static_cast<uint8_t>((mask >> b) & 1);
+            }
+        }
+        scalarIdle(ticks + i, count - i, nowTick, maxAge, idle + i);
+    }
+#elif defined(__aarch64__)
+    static float64x2_t u32ToDouble(uint32x2_t values) {
+        return vcvtq_f64_u64(vmovl_u32(values));
+    }
+    
+    static uint32x2_t doubleToU32(float64x2_t values) {
+        return vmovn_u64(vcvtq_u64_f64(values));
+    }
+    
+    static void neon(RefillLanes& lanes, size_t count, uint32_t nowTick) {
+        const uint32x4_t now = vdupq_n_u32(nowTick);
+        const uint32x4_t half = vdupq_n_u32(1u << 31);
+        const float64x2_t one = vdupq_n_f64(1.0);
+        
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            uint32x4_t tokens = vld1q_u32(lanes.tokens + i);
+            uint32x4_t last = vld1q_u32(lanes.last + i);
+            uint32x4_t capacity = vld1q_u32(lanes.capacity + i);
+            uint32x4_t needed = vld1q_u32(lanes.needed + i);
+            float64x2_t rateLo = vld1q_f64(lanes.unitsPerTick + i);
+            float64x2_t rateHi = vld1q_f64(lanes.unitsPerTick + i + 2);
+            
+            uint32x4_t elapsed = vsubq_u32(now, last);
+            elapsed = vandq_u32(elapsed, vcleq_u32(elapsed, half));
+            
+            float64x2_t creditLo = vmulq_f64(u32ToDouble(vget_low_u32(elapsed)), rateLo);
+            float64x2_t creditHi = vmulq_f64(u32ToDouble(vget_high_u32(elapsed)), rateHi);
+            uint32x4_t room = vsubq_u32(capacity, tokens);
+            
+            uint32x4_t full = vorrq_u32(vcgeq_u32(tokens, capacity), vcombine_u32(
+                vmovn_u64(vcgeq_f64(creditLo, u32ToDouble(vget_low_u32(room)))),
+                vmovn_u64(vcgeq_f64(creditHi, u32ToDouble(vget_high_u32(room))))));
+            uint32x4_t partial = vbicq_u32(vcombine_u32(vmovn_u64(vcgeq_f64(creditLo, one)),
+                                                        vmovn_u64(vcgeq_f64(creditHi, one))), full);
+            
+            float64x2_t unitsLo = vrndq_f64(creditLo);
+            float64x2_t unitsHi = vrndq_f64(creditHi);
+            uint32x4_t units = vcombine_u32(doubleToU32(unitsLo), doubleToU32(unitsHi));
+            uint32x4_t advance = vcombine_u32(doubleToU32(vrndpq_f64(vdivq_f64(unitsLo, rateLo))),
+                                              doubleToU32(vrndpq_f64(vdivq_f64(unitsHi, rateHi))));
+            
+            uint32x4_t newTokens = vbslq_u32(partial, vaddq_u32(tokens, units), tokens);
+            newTokens = vbslq_u32(full, capacity, newTokens);
+            uint32x4_t newLast = vbslq_u32(partial, vaddq_u32(last, advance), last);
+            newLast = vbslq_u32(full, now, newLast);
+            
+            uint32x4_t allowed = vandq_u32(vtstq_u32(needed, needed), vcgeq_u32(newTokens, needed));
+            newTokens = vsubq_u32(newTokens, vandq_u32(allowed, needed));
+            
+            vst1q_u32(lanes.newTokens + i, newTokens);
+            vst1q_u32(lanes.newLast + i, newLast);
+            uint32_t mask[4];
+            vst1q_u32(mask, allowed);
+            for (int b = 0; b < 4; ++b) {
+                lanes.allowed[i + b] = mask[b] ? 1 : 0;
+            }
+        }
+        scalarRange(lanes, i, count, nowTick);
+    }
+    
+    static void neonIdle(const uint32_t* ticks, size_t count, uint32_t nowTick, uint32_t maxAge, uint8_t* idle) {
+        const uint32x4_t now = vdupq_n_u32(nowTick);
+        const uint32x4_t half = vdupq_n_u32(1u << 31);
+        const uint32x4_t limit = vdupq_n_u32(maxAge);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            uint32x4_t age = vsubq_u32(now, vld1q_u32(ticks + i));
+            uint32_t mask[4];
+            vst1q_u32(mask, vandq_u32(vcleq_u32(age, half), vcgtq_u32(age, limit)));
+            for (int b = 0; b < 4; ++b) {
+                idle[i + b] = mask[b] ? 1 : 0;
+            }
+        }
+        scalarIdle(ticks + i, count - i, nowTick, maxAge, idle + i);
+    }
+#endif
+};
+
+// Compact bucket storage for very large client counts. Each client is one
+// 16-byte slot in an open-addressing table: a key word holding the top 48
+// bits of the key hash (used as the client's identity; the string is not
+// stored) above a 16-bit policy index, and a state word packing 24.8
+// fixed-point tokens with a 32-bit relative timestamp. A hit reads nothing
+// but its slot and the shared policy array. Hits are
+// a lock-free probe plus one CAS; inserts and deletions take the owning
+// shard's mutex. Deletion shifts the rest of the probe run back into the gap
+// rather than leaving a tombstone, so runs only ever reflect the live load.
+// An entry being shifted has its state frozen first, which sends consumers
+// already holding it back to look it up again. (A consumer whose CAS was
+// already in flight can still land on a slot that took in another entry
+// with the bit-identical state; that entry pays for one request.)
+//
+// All state lives in one region: a private anonymous mapping, or a named POSIX
+// shared-memory segment so that every process on the host attached to it
+// enforces the same limits. The first process to open a segment lays it out
+// while holding an flock on it and marks it ready last; a creator that dies
+// part-way leaves it unmarked (and the flock is dropped by the kernel), so the
+// next opener simply starts over. Later processes attach to the existing
+// geometry whatever their own maxClients. Slots are valid when zero-filled,
+// so pages are only touched once used.
+class CompactBucketTable {
+public:
+    enum class Result { Allowed, Rejected, Missing };
+    enum class InsertResult { Inserted, Exists, Full };
+    
+    static constexpr int kTokenFractionBits = 8;
+    static constexpr uint32_t kTokenScale = 1u << kTokenFractionBits;
+    static constexpr size_t kMaxBucketSize = (size_t(1) << (32 - kTokenFractionBits)) - 1;
+    static constexpr int kTickShift = 14; // 1/16384 s (~61us) ticks; wraps after ~3 days
+    static constexpr uint32_t kMaxIdleTicks = 1u << 30; // ~18 h; evictIdle() keeps ages below the wrap
+    static constexpr size_t kMaxPolicies = 4096;
+    static constexpr uint64_t kRegionMagic = 0x3154424c43524cULL;   // "LRCLBT1"
+    static constexpr uint32_t kRegionVersion = 3;
+    
+private:
+    static constexpr uint64_t kPolicyMask = 0xffff; // Key word bits holding the policy index
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kBusy = 1;            // Slot being refilled by a shift
+    // Never a real state (tokens stay at or below a capacity, so under
+    // 2^32 - 1): marks a slot whose entry is being moved or removed
+    static constexpr uint64_t kMoved = ~uint64_t(0);
+    
+    struct alignas(16) Slot {
+        std::atomic<uint64_t> keyHash{kEmpty};  // identity << 16 | policy index
+        std::atomic<uint64_t> state{0};     // tokens << 32 | lastRefillTick
+    };
+    
+    struct Policy {
+        uint32_t capacity = 0;              // Fixed-point bucket size
+        double unitsPerTick = 0.0;          // Fixed-point tokens per tick
+        size_t bucketSize = 0;
+        double refillRate = 0.0;
+    };
+    
+    struct alignas(64) Shard {
+        ProcessMutex mutex;                 // Serializes inserts and evictions
+        size_t used = 0;                    // Occupied slots
+    };
+    
+    // Start of the region; geometry is fixed by whoever laid it out
+    struct alignas(64) Header {
+        uint64_t magic;
+        uint32_t version;
+        std::atomic<uint32_t> ready;        // Set last during initialization
+        uint64_t shardBits;
+        uint64_t slotsPerShard;
+        int64_t epochNs;                    // steady_clock origin of the ticks
+        std::atomic<size_t> policyCount;
+        std::atomic<size_t> liveCount;      // Clients in the table, across processes
+        ProcessMutex policyMutex;
+    };
+    
+    // Byte offsets of each array in a region of the given geometry
+    struct Layout {
+        size_t shards;
+        size_t policies;
+        size_t slots;
+        size_t size;
+        
+        Layout(size_t shardBits, size_t slotsPerShard) {
+            auto align = [](size_t value) { return (value + 63) & ~size_t(63); };
+            const size_t total = slotsPerShard << shardBits;
+            shards = align(sizeof(Header));
+            policies = align(shards + (size_t(1) << shardBits) * sizeof(Shard));
+            slots = align(policies + kMaxPolicies * sizeof(Policy));
+            size = (slots + total * sizeof(Slot) + 4095) & ~size_t(4095);
+        }
+    };
+    
+    const Clock* clock_;
+    std::chrono::steady_clock::time_point epoch_;
+    
+    void* region_ = nullptr;
+    size_t regionSize_ = 0;
+    bool shared_ = false;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    Shard* shards_ = nullptr;
+    Policy* policies_ = nullptr;
+    size_t shardBits_ = 0;
+    size_t slotsPerShard_ = 0;
+    uint16_t defaultPolicy_ = 0;
+    
+public:
+    // An empty sharedName keeps the table private to this process
+    CompactBucketTable(size_t maxClients, size_t numShards, size_t defaultBucketSize,
+                       double defaultRefillRate, const Clock* clock, const std::string& sharedName = {})
+        : clock_(clock) {
+        size_t shardBits = 0;
+        while ((size_t(1) << shardBits) < numShards) {
+            ++shardBits;
+        }
+        
+        // Keep each shard at most half full on average so probes stay short
+        const size_t shards = size_t(1) << shardBits;
+        size_t perShard = 8;
+        while (perShard < (maxClients * 2 + shards - 1) / shards) {
+            perShard <<= 1;
+        }
+        
+        if (sharedName.empty()) {
+            createPrivate(shardBits, perShard);
+        } else {
+            openShared(sharedName, shardBits, perShard);
+        }
+        
+        defaultPolicy_ = policyFor(defaultBucketSize, defaultRefillRate);
+    }
+    
+    ~CompactBucketTable() {
+        if (!shared_) {
+            for (size_t s = 0; s < (size_t(1) << shardBits_); ++s) {
+                shards_[s].~Shard();
+            }
+            header_->~Header();
+        }
+        releaseRegion(region_, regionSize_);
+    }
+    
+    CompactBucketTable(const CompactBucketTable&) = delete;
+    CompactBucketTable& operator=(const CompactBucketTable&) = delete;
+    
+    // Removes a shared segment's name; processes still attached keep using it
+    static bool unlinkShared(const std::string& sharedName) {
+#if defined(__linux__)
+        return shm_unlink(segmentName(sharedName).c_str()) == 0;
+#else
+        (void)sharedName;
+        return false;
+#endif
+    }
+    
+    // Number of clients in the table, shared by every attached process
+    std::atomic<size_t>& liveCount() {
+        return header_->liveCount;
+    }
+    
+    // Policy index of this process's default limits
+    uint16_t defaultPolicy() const {
+        return defaultPolicy_;
+    }
+    
+    // Consume from an existing entry; Missing means the caller must insert()
+    Result consume(uint64_t hash, size_t tokensNeeded, std::chrono::steady_clock::time_point now) {
+        const uint64_t stored = normalize(hash);
+        const uint32_t nowTick = toTick(now);
+        return withSlot(stored, [&](Slot& slot) {
+            return consumeSlot(slot, stored, tokensNeeded, nowTick);
+        });
+    }
+    
+    // Takes as many of `maxTokens` whole tokens as the slot holds, in one CAS;
+    // Allowed if any were granted
+    Result consumeUpTo(uint64_t hash, size_t maxTokens, std::chrono::steady_clock::time_point now, size_t& granted) {
+        granted = 0;
+        const uint64_t stored = normalize(hash);
+        const uint32_t nowTick = toTick(now);
+        return withSlot(stored, [&](Slot& slot) {
+            const uint64_t key = slot.keyHash.load(std::memory_order_acquire);
+            const Policy& p = policies_[key & kPolicyMask];
+            uint64_t state = slot.state.load(std::memory_order_acquire);
+            for (;;) {
+                if ((key & ~kPolicyMask) != stored || !holds(slot, key, state)) {
+                    granted = 0;
+                    return Result::Missing;
+                }
+                uint32_t newTokens;
+                uint32_t newLast;
+                RefillKernels::refillLane(static_cast<uint32_t>(state >> 32), static_cast<uint32_t>(state),
+                                          p.capacity, p.unitsPerTick, nowTick, newTokens, newLast);
+                
+                granted = std::min<size_t>(maxTokens, newTokens >> kTokenFractionBits);
+                newTokens -= static_cast<uint32_t>(granted) << kTokenFractionBits;
+                
+                uint64_t next = pack(newTokens, newLast);
+                if (next == state ||
+                    slot.state.compare_exchange_weak(state, next, std::memory_order_acq_rel,
+                                                     std::memory_order_acquire)) {
+                    return granted > 0 ? Result::Allowed : Result::Rejected;
+                }
+            }
+        });
+    }
+    
+    // consume() for many keys at once. Slots are gathered into lanes and
+    // refilled by the vector kernel, then each is committed with its own CAS;
+    // a slot that changed since it was read (including a key repeated in the
+    // batch) or was caught mid-shift is redone on the scalar path.
+    void consumeBatch(std::span<const uint64_t> hashes, size_t tokensNeeded,
+                      std::chrono::steady_clock::time_point now, std::span<Result> out) {
+        const uint64_t needed = static_cast<uint64_t>(tokensNeeded) * kTokenScale;
+        if (needed > UINT32_MAX) {
+            for (size_t i = 0; i < hashes.size(); ++i) {
+                out[i] = consume(hashes[i], tokensNeeded, now);
+            }
+            return;
+        }
+        
+        constexpr size_t kLanes = RefillLanes::kMaxLanes;
+        thread_local RefillLanes lanes;
+        Slot* slots[kLanes];
+        uint64_t states[kLanes];
+        size_t indices[kLanes];
+        const uint32_t nowTick = toTick(now);
+        const auto kernel = RefillKernels::best();
+        
+        for (size_t begin = 0; begin < hashes.size(); begin += kLanes) {
+            const size_t end = std::min(hashes.size(), begin + kLanes);
+            uint64_t stored[kLanes];
+            for (size_t i = begin; i < end; ++i) {
+                // Start every home slot's cache miss before probing the first
+                stored[i - begin] = normalize(hashes[i]);
+                __builtin_prefetch(&slots_[shardOf(stored[i - begin]) * slotsPerShard_ + homeOf(stored[i - begin])]);
+            }
+            
+            size_t n = 0;
+            for (size_t i = begin; i < end; ++i) {
+                Slot* slot = find(stored[i - begin]);
+                if (!slot) {
+                    out[i] = Result::Missing;
+                    continue;
+                }
+                const uint64_t key = slot->keyHash.load(std::memory_order_acquire);
+                const Policy& p = policies_[key & kPolicyMask];
+                uint64_t state = slot->state.load(std::memory_order_acquire);
+                if (!holds(*slot, key, state) || (key & ~kPolicyMask) != stored[i - begin]) {
+                    out[i] = consume(hashes[i], tokensNeeded, now);
+                    continue;
+                }
+                slots[n] = slot;
+                states[n] = state;
+                indices[n] = i;
+                lanes.tokens[n] = static_cast<uint32_t>(state >> 32);
+                lanes.last[n] = static_cast<uint32_t>(state);
+                lanes.capacity[n] = p.capacity;
+                lanes.needed[n] = static_cast<uint32_t>(needed);
+                lanes.unitsPerTick[n] = p.unitsPerTick;
+                ++n;
+            }
+            
+            kernel(lanes, n, nowTick);
+            
+            for (size_t j = 0; j < n; ++j) {
+                uint64_t expected = states[j];
+                uint64_t next = pack(lanes.newTokens[j], lanes.newLast[j]);
+                if (next == expected ||
+                    slots[j]->state.compare_exchange_strong(expected, next, std::memory_order_acq_rel,
+                                                            std::memory_order_acquire)) {
+                    out[indices[j]] = lanes.allowed[j] != 0 ? Result::Allowed : Result::Rejected;
+                } else {
+                    out[indices[j]] = consume(hashes[indices[j]], tokensNeeded, now);
+                }
+            }
+        }
+    }
+    
+    // Like consume(), but on Rejected sets delay to the time until the tokens
+    // will be available (Bucket::kNever if above the bucket size)
+    Result reserve(uint64_t hash, size_t tokensNeeded, std::chrono::steady_clock::time_point now,
+                   std::chrono::nanoseconds& delay) {
+        const uint64_t stored = normalize(hash);
+        const uint32_t nowTick = toTick(now);
+        double waitTicks = 0.0;
+        Result result = withSlot(stored, [&](Slot& slot) {
+            return consumeSlot(slot, stored, tokensNeeded, nowTick, &waitTicks);
+        });
+        if (result != Result::Rejected) {
+            if (result == Result::Allowed) {
+                delay = std::chrono::nanoseconds(0);
+            }
+            return result;
+        }
+        
+        if (waitTicks < 0.0) {
+            delay = Bucket::kNever;
+            return Result::Rejected;
+        }
+        
+        // Refills only see whole ticks, so wait until the start of the first
+        // tick that credits enough
+        constexpr double kNsPerTick = 1e9 / static_cast<double>(1 << kTickShift);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - epoch_).count();
+        int64_t targetTick = static_cast<int64_t>(std::floor(ns / kNsPerTick)) +
+                             static_cast<int64_t>(std::ceil(waitTicks));
+        int64_t targetNs = static_cast<int64_t>(std::ceil(targetTick * kNsPerTick));
+        delay = std::chrono::nanoseconds(std::max<int64_t>(targetNs - ns, 1));
+        return Result::Rejected;
+    }
+    
+    // Live slot contents as stored; storedHash is the table's internal form
+    struct SlotState {
+        uint64_t storedHash;
+        double tokens;
+        std::chrono::steady_clock::time_point lastRefill;
+        size_t bucketSize;
+        double refillRate;
+    };
+    
+    // Inserts a full bucket for the key with the given policy
+    InsertResult insert(uint64_t hash, uint16_t policy, std::chrono::steady_clock::time_point now) {
+        return insertStored(normalize(hash), policy, pack(policies_[policy].capacity, toTick(now)));
+    }
+    
+    // Copies every live slot without blocking lookups or inserts
+    void exportSlots(std::vector<SlotState>& out) const {
+        auto now = clock_->now();
+        for (size_t i = 0; i < slotCount(); ++i) {
+            uint64_t key = slots_[i].keyHash.load(std::memory_order_acquire);
+            if (key == kEmpty || key == kBusy) {
+                continue;
+            }
+            uint64_t state = slots_[i].state.load(std::memory_order_acquire);
+            if (!holds(slots_[i], key, state)) {
+                continue; // Mid-shift; the entry's other copy is exported instead
+            }
+            const Policy& p = policies_[key & kPolicyMask];
+            out.push_back({key & ~kPolicyMask, static_cast<double>(state >> 32) / kTokenScale,
+                           toTimePoint(static_cast<uint32_t>(state), now), p.bucketSize, p.refillRate});
+        }
+    }
+    
+    // Re-inserts an exported slot, overwriting the entry if it already exists
+    InsertResult restoreSlot(const SlotState& saved, uint16_t policy) {
+        const Policy& p = policies_[policy];
+        double tokens = std::clamp(saved.tokens * kTokenScale, 0.0, static_cast<double>(p.capacity));
+        uint64_t state = pack(static_cast<uint32_t>(tokens), toTick(saved.lastRefill));
+        
+        // Older snapshots kept all 64 bits; the identity is the top 48 either way
+        const uint64_t hash = toIdentity(saved.storedHash);
+        auto result = insertStored(hash, policy, state);
+        if (result == InsertResult::Exists) {
+            // Locked so that no shift moves the entry while it is overwritten
+            std::lock_guard<ProcessMutex> lock(shards_[shardOf(hash)].mutex);
+            if (Slot* slot = find(hash)) {
+                slot->state.store(state, std::memory_order_release);
+                slot->keyHash.store(hash | policy, std::memory_order_release);
+            }
+        }
+        return result;
+    }
+
+private:
+    InsertResult insertStored(uint64_t hash, uint16_t policy, uint64_t initialState) {
+        const size_t shardIndex = shardOf(hash);
+        Shard& shard = shards_[shardIndex];
+        std::lock_guard<ProcessMutex> lock(shard.mutex);
+        
+        Slot* target = nullptr;
+        const size_t base = shardIndex * slotsPerShard_;
+        for (size_t probe = 0, pos = homeOf(hash); probe < slotsPerShard_; ++probe, pos = (pos + 1) & (slotsPerShard_ - 1)) {
+            Slot& slot = slots_[base + pos];
+            uint64_t current = slot.keyHash.load(std::memory_order_acquire);
+            if ((current & ~kPolicyMask) == hash) {
+                return InsertResult::Exists; // Raced with another inserter
+            }
+            if (current == kEmpty) {
+                target = &slot;
+                break;
+            }
+        }
+        
+        if (!target || shard.used + 1 > slotsPerShard_ - 1) {
+            return InsertResult::Full;
+        }
+        ++shard.used;
+        
+        // The state is released too: a consumer still holding a reference
+        // from the slot's previous entry must see it is gone once it reads this
+        target->state.store(initialState, std::memory_order_release);
+        target->keyHash.store(hash | policy, std::memory_order_release);
+        return InsertResult::Inserted;
+    }
+
+public:
+    bool erase(uint64_t hash) {
+        hash = normalize(hash);
+        const size_t shardIndex = shardOf(hash);
+        std::lock_guard<ProcessMutex> lock(shards_[shardIndex].mutex);
+        
+        Slot* slot = find(hash);
+        if (!slot) {
+            return false;
+        }
+        removeAt(shardIndex, static_cast<size_t>(slot - slots_) - shardIndex * slotsPerShard_);
+        return true;
+    }
+    
+    // Returns the policy index for the given limits, adding it if needed
+    uint16_t policyFor(size_t bucketSize, double refillRate) {
+        std::lock_guard<ProcessMutex> lock(header_->policyMutex);
+        
+        bucketSize = std::min(bucketSize, kMaxBucketSize);
+        size_t count = header_->policyCount.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            if (policies_[i].bucketSize == bucketSize && policies_[i].refillRate == refillRate) {
+                return static_cast<uint16_t>(i);
+            }
+        }
+        if (count == kMaxPolicies) {
+            return 0; // Table full: fall back to the default limits
+        }
+        
+        Policy& p = policies_[count];
+        p.capacity = static_cast<uint32_t>(bucketSize * kTokenScale);
+        p.unitsPerTick = refillRate * kTokenScale / static_cast<double>(1 << kTickShift);
+        p.bucketSize = bucketSize;
+        p.refillRate = refillRate;
+        header_->policyCount.store(count + 1, std::memory_order_release);
+        return static_cast<uint16_t>(count);
+    }
+    
+    // Switches the slot to another policy, scaling its tokens by the ratio of
+    // the capacities so the fill level carries over
+    bool setPolicy(uint64_t hash, uint16_t policy) {
+        hash = normalize(hash);
+        // Locked so that no shift moves the entry between the two updates
+        std::lock_guard<ProcessMutex> lock(shards_[shardOf(hash)].mutex);
+        Slot* slot = find(hash);
+        if (!slot) {
+            return false;
+        }
+        
+        // Credit tokens earned under the old policy first
+        consumeSlot(*slot, hash, 0, toTick(clock_->now()));
+        uint64_t previous = slot->keyHash.exchange(hash | policy, std::memory_order_acq_rel) & kPolicyMask;
+        const uint32_t from = policies_[previous].capacity;
+        const uint32_t to = policies_[policy].capacity;
+        if (from == to) {
+            return true;
+        }
+        
+        uint64_t state = slot->state.load(std::memory_order_acquire);
+        uint64_t next;
+        do {
+            if (state == kMoved) {
+                return true; // Left by a dead shift; restarts full on next use
+            }
+            uint32_t tokens = static_cast<uint32_t>(state >> 32);
+            uint32_t scaled = from > 0 ? static_cast<uint32_t>(std::min<double>(
+                static_cast<double>(tokens) * to / from, to)) : to;
+            next = pack(scaled, static_cast<uint32_t>(state));
+        } while (!slot->state.compare_exchange_weak(state, next, std::memory_order_acq_rel,
+                                                    std::memory_order_acquire));
+        return true;
+    }
+    
+    bool getStatistics(uint64_t hash, ClientStatistics& out) const {
+        const uint64_t stored = normalize(hash);
+        auto now = clock_->now();
+        auto* self = const_cast<CompactBucketTable*>(this);
+        return self->withSlot(stored, [&](Slot& slot) {
+            // Brings the stored tokens up to date first
+            if (self->consumeSlot(slot, stored, 0, toTick(now)) == Result::Missing) {
+                return Result::Missing;
+            }
+            const uint64_t key = slot.keyHash.load(std::memory_order_acquire);
+            uint64_t state = slot.state.load(std::memory_order_acquire);
+            if ((key & ~kPolicyMask) != stored || !holds(slot, key, state)) {
+                return Result::Missing;
+            }
+            const Policy& p = policies_[key & kPolicyMask];
+            out = {
+                static_cast<size_t>((state >> 32) >> kTokenFractionBits),
+                p.bucketSize,
+                p.refillRate,
+                0, 0, // Per-client counters are not kept in compact mode
+                toTimePoint(static_cast<uint32_t>(state), now)
+            };
+            return Result::Allowed;
+        }) != Result::Missing;
+    }
+    
+    size_t slotCount() const {
+        return slotsPerShard_ << shardBits_;
+    }
+    
+    // Longest run of occupied slots in any shard, which bounds how many slots
+    // a lookup reads; for diagnostics
+    size_t longestRun() const {
+        const size_t mask = slotsPerShard_ - 1;
+        size_t longest = 0;
+        for (size_t base = 0; base < slotCount(); base += slotsPerShard_) {
+            // Start from an empty slot so a run wrapping past the end counts once
+            size_t start = 0;
+            while (start < slotsPerShard_ && slots_[base + start].keyHash.load(std::memory_order_relaxed) != kEmpty) {
+                ++start;
+            }
+            if (start == slotsPerShard_) {
+                return slotsPerShard_;
+            }
+            size_t run = 0;
+            for (size_t k = 1; k <= slotsPerShard_; ++k) {
+                if (slots_[base + ((start + k) & mask)].keyHash.load(std::memory_order_relaxed) == kEmpty) {
+                    run = 0;
+                } else {
+                    longest = std::max(longest, ++run);
+                }
+            }
+        }
+        return longest;
+    }
+    
+    // Removes entries in slots [begin, end) whose last refill is older than
+    // threshold; returns the number removed. The refill tick stands in for the
+    // access time since every consume refills. Only inserts into the shard
+    // being swept wait, and lookups that meet an entry mid-shift. The threshold is turned into a tick
+    // age once, so the per-slot test is an integer compare that runs through
+    // the vector idle kernel. Entries idle longer than kMaxIdleTicks go
+    // whatever the threshold.
+    size_t evictIdle(std::chrono::steady_clock::time_point threshold, size_t begin, size_t end) {
+        auto now = clock_->now();
+        end = std::min(end, slotCount());
+        
+        // toTimePoint(tick, now) < threshold exactly when the tick's age in
+        // nanoseconds, (age * 1e9) >> kTickShift, exceeds window
+        const int64_t window = std::chrono::duration_cast<std::chrono::nanoseconds>(now - threshold).count();
+        const bool all = window < 0;
+        // Capped so a slot is evicted long before its 32-bit age wraps past
+        // 2^31 ticks, where refills and this check would take it for fresh
+        uint32_t maxAge = kMaxIdleTicks;
+        if (window >= 0 && window < (int64_t(1) << 47)) {
+            maxAge = std::min(kMaxIdleTicks,
+                              static_cast<uint32_t>(((window + 1) * (int64_t(1) << kTickShift) - 1) / 1000000000));
+        }
+        
+        constexpr size_t kLanes = RefillLanes::kMaxLanes;
+        uint32_t ticks[kLanes];
+        size_t indices[kLanes];
+        uint64_t keys[kLanes];
+        uint8_t idle[kLanes];
+        const uint32_t nowTick = toTick(now);
+        const auto kernel = RefillKernels::bestIdle();
+        size_t removed = 0;
+        
+        while (begin < end) {
+            const size_t s = begin / slotsPerShard_;
+            const size_t shardEnd = std::min(end, (s + 1) * slotsPerShard_);
+            std::lock_guard<ProcessMutex> lock(shards_[s].mutex);
+            for (size_t chunk = begin; chunk < shardEnd; chunk += kLanes) {
+                // A removal can shift a later entry back into the chunk, so
+                // it is gone over again until a pass removes nothing
+                for (bool again = true; again;) {
+                    again = false;
+                    size_t n = 0;
+                    for (size_t i = chunk; i < std::min(shardEnd, chunk + kLanes); ++i) {
+                        uint64_t hash = slots_[i].keyHash.load(std::memory_order_acquire);
+                        uint64_t state = slots_[i].state.load(std::memory_order_relaxed);
+                        if (hash == kEmpty || hash == kBusy || state == kMoved) {
+                            continue;
+                        }
+                        ticks[n] = static_cast<uint32_t>(state);
+                        keys[n] = hash;
+                        indices[n++] = i;
+                    }
+                    
+                    if (!all) {
+                        kernel(ticks, n, nowTick, maxAge, idle);
+                    }
+                    // Last first, since a shift only rewrites slots from the
+                    // gap onwards; the key check covers runs wrapping the shard
+                    for (size_t j = n; j-- > 0;) {
+                        if ((all || idle[j]) &&
+                            slots_[indices[j]].keyHash.load(std::memory_order_relaxed) == keys[j]) {
+                            removeAt(s, indices[j] - s * slotsPerShard_);
+                            ++removed;
+                            again = true;
+                        }
+                    }
+                }
+            }
+            begin = shardEnd;
+        }
+        return removed;
+    }
+    
+    void resetAll() {
+        const uint32_t tick = toTick(clock_->now());
+        const size_t total = slotsPerShard_ << shardBits_;
+        for (size_t i = 0; i < total; ++i) {
+            uint64_t key = slots_[i].keyHash.load(std::memory_order_acquire);
+            if (key == kEmpty || key == kBusy) {
+                continue;
+            }
+            // A CAS rather than a store so that a slot frozen by a shift stays frozen
+            const Policy& p = policies_[key & kPolicyMask];
+            uint64_t state = slots_[i].state.load(std::memory_order_acquire);
+            while (holds(slots_[i], key, state)) {
+                if (slots_[i].state.compare_exchange_weak(state, pack(p.capacity, tick), std::memory_order_acq_rel,
+                                                          std::memory_order_acquire)) {
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    static std::string segmentName(const std::string& sharedName) {
+        return sharedName.front() == '/' ? sharedName : "/" + sharedName;
+    }
+    
+    static void* mapAnonymous(size_t size) {
+#if defined(__linux__)
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("CompactBucketTable: cannot map table memory");
+        }
+        return memory;
+#else
+        void* memory = ::operator new(size, std::align_val_t(4096));
+        std::memset(memory, 0, size);
+        return memory;
+#endif
+    }
+    
+    static void releaseRegion(void* region, size_t size) {
+        if (!region) {
+            return;
+        }
+#if defined(__linux__)
+        munmap(region, size);
+#else
+        (void)size;
+        ::operator delete(region, std::align_val_t(4096));
+#endif
+    }
+    
+    // Points the member arrays into the region
+    void attach(void* region, size_t size) {
+        region_ = region;
+        regionSize_ = size;
+        header_ = static_cast<Header*>(region);
+        shardBits_ = header_->shardBits;
+        slotsPerShard_ = header_->slotsPerShard;
+        epoch_ = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(header_->epochNs));
+        
+        Layout layout(shardBits_, slotsPerShard_);
+        auto* base = static_cast<char*>(region);
+        shards_ = reinterpret_cast<Shard*>(base + layout.shards);
+        policies_ = reinterpret_cast<Policy*>(base + layout.policies);
+        slots_ = reinterpret_cast<Slot*>(base + layout.slots);
+    }
+    
+    // Lays out a zero-filled region; the ready flag is set after everything else
+    void initialize(void* region, size_t shardBits, size_t slotsPerShard) {
+        auto* header = new (region) Header{};
+        header->magic = kRegionMagic;
+        header->version = kRegionVersion;
+        header->shardBits = shardBits;
+        header->slotsPerShard = slotsPerShard;
+        header->epochNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock_->now().time_since_epoch()).count();
+        
+        Layout layout(shardBits, slotsPerShard);
+        auto* base = static_cast<char*>(region);
+        for (size_t s = 0; s < (size_t(1) << shardBits); ++s) {
+            new (base + layout.shards + s * sizeof(Shard)) Shard();
+        }
+        for (size_t i = 0; i < kMaxPolicies; ++i) {
+            new (base + layout.policies + i * sizeof(Policy)) Policy();
+        }
+        header->ready.store(1, std::memory_order_release);
+    }
+    
+    void createPrivate(size_t shardBits, size_t slotsPerShard) {
+        Layout layout(shardBits, slotsPerShard);
+        void* region = mapAnonymous(layout.size);
+        initialize(region, shardBits, slotsPerShard);
+        attach(region, layout.size);
+    }
+    
+    void openShared(const std::string& sharedName, size_t shardBits, size_t slotsPerShard) {
+#if defined(__linux__)
+        const std::string name = segmentName(sharedName);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("CompactBucketTable: shm_open failed for " + name);
+        }
+        
+        // The flock serializes initialization; the kernel drops it if we die
+        flock(fd, LOCK_EX);
+        
+        void* region = nullptr;
+        size_t size = 0;
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+            size = static_cast<size_t>(st.st_size);
+            region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            auto* header = region == MAP_FAILED ? nullptr : static_cast<Header*>(region);
+            if (!header || header->magic != kRegionMagic || header->version != kRegionVersion ||
+                header->ready.load(std::memory_order_acquire) != 1 ||
+                Layout(header->shardBits, header->slotsPerShard).size != size) {
+                if (header) {
+                    munmap(region, size);
+                }
+                region = nullptr;
+            }
+        }
+        
+        if (!region) {
+            // Fresh or abandoned part-way: truncate to zero so every byte starts clean
+            Layout layout(shardBits, slotsPerShard);
+            size = layout.size;
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                flock(fd, LOCK_UN);
+                close(fd);
+                throw std::runtime_error("CompactBucketTable: cannot size shared segment " + name);
+            }
+            region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (region == MAP_FAILED) {
+                flock(fd, LOCK_UN);
+                close(fd);
+                throw std::runtime_error("CompactBucketTable: cannot map shared segment " + name);
+            }
+            initialize(region, shardBits, slotsPerShard);
+        }
+        
+        flock(fd, LOCK_UN);
+        close(fd);
+        shared_ = true;
+        attach(region, size);
+#else
+        (void)shardBits;
+        (void)slotsPerShard;
+        throw std::runtime_error("CompactBucketTable: shared memory is not supported on this platform: " + sharedName);
+#endif
+    }
+    
+    // The stored identity of a key hash: its mixed top 48 bits, with the
+    // policy bits clear
+    static uint64_t normalize(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return toIdentity(hash);
+    }
+    
+    // Identity 0 is left to the empty and busy markers
+    static uint64_t toIdentity(uint64_t hash) {
+        hash &= ~kPolicyMask;
+        return hash ? hash : kPolicyMask + 1;
+    }
+    
+    size_t shardOf(uint64_t hash) const {
+        return shardBits_ ? static_cast<size_t>(hash >> (64 - shardBits_)) : 0;
+    }
+    
+    size_t homeOf(uint64_t hash) const {
+        return static_cast<size_t>(hash >> 16) & (slotsPerShard_ - 1);
+    }
+    
+    static uint64_t pack(uint32_t tokens, uint32_t tick) {
+        return (static_cast<uint64_t>(tokens) << 32) | tick;
+    }
+    
+    uint32_t toTick(std::chrono::steady_clock::time_point time) const {
+        constexpr double kTicksPerNs = static_cast<double>(1 << kTickShift) / 1e9;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch_).count();
+        return static_cast<uint32_t>(static_cast<int64_t>(std::floor(ns * kTicksPerNs)));
+    }
+    
+    std::chrono::steady_clock::time_point toTimePoint(uint32_t tick, std::chrono::steady_clock::time_point now) const {
+        // Ticks wrap, so measure backwards from now
+        uint32_t age = toTick(now) - tick;
+        if (age > (1u << 31)) {
+            age = 0;
+        }
+        auto ageNs = (static_cast<int64_t>(age) * 1000000000) >> kTickShift;
+        return now - std::chrono::nanoseconds(ageNs);
+    }
+    
+    Slot* find(uint64_t hash) const {
+        const size_t base = shardOf(hash) * slotsPerShard_;
+        for (size_t probe = 0, pos = homeOf(hash); probe < slotsPerShard_; ++probe, pos = (pos + 1) & (slotsPerShard_ - 1)) {
+            Slot& slot = slots_[base + pos];
+            uint64_t current = slot.keyHash.load(std::memory_order_acquire);
+            if ((current & ~kPolicyMask) == hash) {
+                return &slot;
+            }
+            if (current == kEmpty) {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+    
+    // Whether the slot, whose state was just read, still has the key word read
+    // before it (same entry, same policy) and is not frozen by a shift. Every
+    // state written into a reused slot is released after its key word changed.
+    bool holds(const Slot& slot, uint64_t key, uint64_t state) const {
+        return state != kMoved && slot.keyHash.load(std::memory_order_acquire) == key;
+    }
+    
+    // Runs fn on the key's slot, looking it up again whenever fn returns
+    // Missing because a shift moved or removed the entry under it
+    template <typename Fn>
+    Result withSlot(uint64_t hash, Fn&& fn) {
+        for (;;) {
+            Slot* slot = find(hash);
+            if (!slot) {
+                return Result::Missing;
+            }
+            Result result = fn(*slot);
+            if (result != Result::Missing) {
+                return result;
+            }
+            awaitShift(hash);
+        }
+    }
+    
+    // Waits out the shift that froze the key's entry by taking the shard lock
+    // it holds. An entry still frozen after that was left by a process that
+    // died mid-shift, and restarts with a full bucket.
+    void awaitShift(uint64_t hash) {
+        std::lock_guard<ProcessMutex> lock(shards_[shardOf(hash)].mutex);
+        if (Slot* slot = find(hash)) {
+            const Policy& p = policies_[slot->keyHash.load(std::memory_order_relaxed) & kPolicyMask];
+            uint64_t expected = kMoved;
+            slot->state.compare_exchange_strong(expected, pack(p.capacity, toTick(clock_->now())),
+                                                std::memory_order_acq_rel);
+        }
+    }
+    
+    // Deletes the entry at gap (an offset in the shard, whose lock is held)
+    // by moving each later member of its probe run that may live earlier back
+    // into the gap, so no lookup ever probes past a deleted key. An entry is
+    // frozen before it is copied, so no consume lands on the old copy after
+    // that, and published in the gap before its old slot is reused, so a
+    // concurrent find always meets one copy or the other.
+    void removeAt(size_t shardIndex, size_t gap) {
+        const size_t base = shardIndex * slotsPerShard_;
+        const size_t mask = slotsPerShard_ - 1;
+        Slot* hole = &slots_[base + gap];
+        hole->state.exchange(kMoved, std::memory_order_acq_rel);
+        
+        for (size_t probe = 1, pos = (gap + 1) & mask; probe < slotsPerShard_; ++probe, pos = (pos + 1) & mask) {
+            Slot& slot = slots_[base + pos];
+            uint64_t key = slot.keyHash.load(std::memory_order_relaxed);
+            if (key == kEmpty) {
+                break;
+            }
+            // Stays put unless the gap lies between its home and its slot
+            if (key == kBusy || ((pos - homeOf(key)) & mask) < ((pos - gap) & mask)) {
+                continue;
+            }
+            
+            uint64_t state = slot.state.exchange(kMoved, std::memory_order_acq_rel);
+            hole->keyHash.store(kBusy, std::memory_order_release);
+            hole->state.store(state, std::memory_order_release);
+            hole->keyHash.store(key, std::memory_order_release);
+            hole = &slot;
+            gap = pos;
+        }
+        
+        hole->keyHash.store(kEmpty, std::memory_order_release);
+        --shards_[shardIndex].used;
+    }
+    
+    // Refills and consumes in one CAS on the packed state; Missing if the
+    // slot no longer holds the key. A zero tokensNeeded just brings the stored
+    // refill up to date. On rejection, waitTicks (if given) receives the
+    // ticks until the tokens are available, or -1 if never.
+    Result consumeSlot(Slot& slot, uint64_t hash, size_t tokensNeeded, uint32_t nowTick,
+                       double* waitTicks = nullptr) {
+        const uint64_t key = slot.keyHash.load(std::memory_order_acquire);
+        if ((key & ~kPolicyMask) != hash) {
+            return Result::Missing;
+        }
+        const Policy& p = policies_[key & kPolicyMask];
+        const uint64_t needed = static_cast<uint64_t>(tokensNeeded) * kTokenScale;
+        uint64_t state = slot.state.load(std::memory_order_acquire);
+        
+        for (;;) {
+            if (!holds(slot, key, state)) {
+                return Result::Missing;
+            }
+            uint32_t newTokens;
+            uint32_t newLast;
+            RefillKernels::refillLane(static_cast<uint32_t>(state >> 32), static_cast<uint32_t>(state),
+                                      p.capacity, p.unitsPerTick, nowTick, newTokens, newLast);
+            
+            bool allowed = needed > 0 && newTokens >= needed;
+            if (allowed) {
+                newTokens -= static_cast<uint32_t>(needed);
+            }
+            
+            uint64_t next = pack(newTokens, newLast);
+            if (next == state ||
+                slot.state.compare_exchange_weak(state, next, std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+                if (!allowed && waitTicks) {
+                    if (needed > p.capacity || p.unitsPerTick <= 0.0) {
+                        *waitTicks = -1.0;
+                    } else {
+                        // Ticks since newLast are already earning uncredited units
+                        *waitTicks = std::max(0.0, (needed - newTokens) / p.unitsPerTick -
+                                                   static_cast<double>(nowTick - newLast));
+                    }
+                }
+                return allowed ? Result::Allowed : Result::Rejected;
+            }
+        }
+    }
+};
+
+// Approximate limiter for key spaces too large to track exactly: a count-min
+// sketch of the tokens each key used over a sliding window. A key maps to one
+// counter per row and its usage is the smallest of them, so collisions only
+// inflate it and errors lean towards rejecting. Each counter packs the window
+// it was last written in with its counts for that window and the one before;
+// usage weighs the earlier count by how much of it the sliding window still
+// covers. Windows roll over lazily on the next write, so memory is fixed
+// whatever the number of keys, an update is one CAS per row, and there is no
+// reset pass. Writes are conservative (a counter is only raised to the key's
+// new usage), which keeps heavy keys from inflating light ones further.
+//
+// Approximate in both directions at the edges: consumers of one key racing
+// each other may all pass on the same reading, and a counter left untouched
+// for 65535 or 65536 windows reads as recent again.
+class SketchLimiter {
+public:
+    static constexpr uint32_t kMaxCount = (1u << 24) - 1;  // Per counter and window; saturates
+    static constexpr size_t kMaxDepth = 8;
+    
+private:
+    // Counter as of one window: previous and current counts, and how much of
+    // the previous one still counts
+    struct Counts {
+        uint64_t epoch;
+        uint32_t previous;
+        uint32_t current;
+        double previousWeight;
+        
+        double usage() const {
+            return current + previous * previousWeight;
+        }
+    };
+    
+    std::unique_ptr<std::atomic<uint64_t>[]> counters_;     // epoch:16 | previous:24 | current:24
+    size_t depth_;
+    size_t widthMask_;
+    int64_t windowNs_;
+    
+public:
+    // `width` is rounded up to a power of two; memory is width * depth * 8 bytes
+    SketchLimiter(size_t width, size_t depth, std::chrono::nanoseconds window)
+        : depth_(std::clamp<size_t>(depth, 1, kMaxDepth)),
+          widthMask_(std::bit_ceil(std::max<size_t>(width, 1)) - 1),
+          windowNs_(std::max<int64_t>(window.count(), 1)) {
+        counters_ = std::make_unique<std::atomic<uint64_t>[]>(depth_ * (widthMask_ + 1));
+    }
+    
+    SketchLimiter(const SketchLimiter&) = delete;
+    SketchLimiter& operator=(const SketchLimiter&) = delete;
+    
+    // Adds `tokens` to the key's usage if it stays within `limit` per window
+    bool consume(uint64_t hash, size_t tokens, size_t limit, std::chrono::steady_clock::time_point now) {
+        return tokens <= limit && take(hash, tokens, tokens, limit, now) == tokens;
+    }
+    
+    // Adds as many of `maxTokens` as fit under `limit` and returns how many
+    size_t consumeUpTo(uint64_t hash, size_t maxTokens, size_t limit, std::chrono::steady_clock::time_point now) {
+        return take(hash, 1, maxTokens, limit, now);
+    }
+    
+    // Tokens the key is estimated to have used over the sliding window
+    double usage(uint64_t hash, std::chrono::steady_clock::time_point now) const {
+        const auto [epoch, previousWeight] = windowAt(now);
+        double usage = std::numeric_limits<double>::infinity();
+        for (size_t row = 0; row < depth_; ++row) {
+            uint64_t state = counters_[row * (widthMask_ + 1) + indexOf(hash, row)]
+                                 .load(std::memory_order_relaxed);
+            usage = std::min(usage, countsAt(state, epoch, previousWeight).usage());
+        }
+        return usage;
+    }
+    
+    size_t memoryBytes() const {
+        return depth_ * (widthMask_ + 1) * sizeof(std::atomic<uint64_t>);
+    }
+    
+private:
+    // Adds between minTokens and maxTokens, as many as fit; zero if fewer than
+    // minTokens do
+    size_t take(uint64_t hash, size_t minTokens, size_t maxTokens, size_t limit,
+                std::chrono::steady_clock::time_point now) {
+        const auto [epoch, previousWeight] = windowAt(now);
+        
+        std::atomic<uint64_t>* counters[kMaxDepth];
+        double usage = std::numeric_limits<double>::infinity();
+        for (size_t row = 0; row < depth_; ++row) {
+            counters[row] = &counters_[row * (widthMask_ + 1) + indexOf(hash, row)];
+            usage = std::min(usage, countsAt(counters[row]->load(std::memory_order_relaxed), epoch,
+                                             previousWeight).usage());
+        }
+        
+        const double room = std::floor(static_cast<double>(limit) - usage);
+        const size_t tokens = room > 0.0 ? std::min(maxTokens, static_cast<size_t>(room)) : 0;
+        if (tokens < minTokens || tokens == 0) {
+            return 0;
+        }
+        const double target = usage + static_cast<double>(tokens);
+        
+        for (size_t row = 0; row < depth_; ++row) {
+            uint64_t state = counters[row]->load(std::memory_order_relaxed);
+            for (;;) {
+                Counts counts = countsAt(state, epoch, previousWeight);
+                const double needed = std::ceil(target - counts.previous * counts.previousWeight);
+                const uint32_t current = std::max(counts.current,
+                                                  static_cast<uint32_t>(std::min<double>(needed, kMaxCount)));
+                const uint64_t next = pack(counts.epoch, counts.previous, current);
+                if (next == state ||
+                    counters[row]->compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+        }
+        return tokens;
+    }
+    
+    static uint64_t pack(uint64_t epoch, uint32_t previous, uint32_t current) {
+        return (epoch & 0xffff) << 48 | static_cast<uint64_t>(previous) << 24 | current;
+    }
+    
+    // Window number at `now` and the share of the previous window still inside
+    // the sliding one
+    std::pair<uint64_t, double> windowAt(std::chrono::steady_clock::time_point now) const {
+        const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        const int64_t epoch = ns / windowNs_;
+        return {static_cast<uint64_t>(epoch),
+                1.0 - static_cast<double>(ns - epoch * windowNs_) / static_cast<double>(windowNs_)};
+    }
+    
+    // A counter seen from `epoch`. One written a window ago has its count
+    // shifted to previous, older ones start over; one already rolled to the
+    // next window by a thread with a later clock reading is left as it is,
+    // with its previous count taken in full.
+    static Counts countsAt(uint64_t state, uint64_t epoch, double previousWeight) {
+        const uint64_t stored = state >> 48;
+        const uint32_t previous = static_cast<uint32_t>(state >> 24) & kMaxCount;
+        const uint32_t current = static_cast<uint32_t>(state) & kMaxCount;
+        switch ((epoch - stored) & 0xffff) {
+            case 0:
+                return {epoch, previous, current, previousWeight};
+            case 1:
+                return {epoch, current, 0, previousWeight};
+            case 0xffff:
+                return {stored, previous, current, 1.0};
+            default:
+                return {epoch, 0, 0, previousWeight};
+        }
+    }
+    
+    // Rows use differently seeded mixes of the key hash so their collisions
+    // are independent
+    size_t indexOf(uint64_t hash, size_t row) const {
+        uint64_t h = hash ^ ((row + 1) * 0x9e3779b97f4a7c15ULL);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h) & widthMask_;
+    }
+};
+
+// Hashed timer wheel keyed by 64-bit ids. Each entry sits in the slot for its
+// due tick; advance() visits only the slots passed since the last call (or
+// all of them once after a long gap) and reports the ids that came due. Not
+// thread-safe: the owner serializes access.
+class TimerWheel {
+private:
+    struct Entry {
+        int64_t dueTick;
+        uint64_t key;
+    };
+    
+    std::vector<std::vector<Entry>> slots_;
+    size_t mask_;
+    int64_t resolutionNs_;
+    int64_t currentTick_;
+    size_t pending_ = 0;
+    
+public:
+    TimerWheel(size_t slots, std::chrono::nanoseconds resolution, std::chrono::steady_clock::time_point start)
+        : slots_(std::bit_ceil(std::max<size_t>(slots, 2))), mask_(slots_.size() - 1),
+          resolutionNs_(std::max<int64_t>(resolution.count(), 1)), currentTick_(tickOf(start)) {}
+    
+    // Fires `key` on the first advance() at or after `due`
+    void schedule(std::chrono::steady_clock::time_point due, uint64_t key) {
+        int64_t dueNs = std::chrono::duration_cast<std::chrono::nanoseconds>(due.time_since_epoch()).count();
+        int64_t tick = std::max((dueNs + resolutionNs_ - 1) / resolutionNs_, currentTick_ + 1);
+        slots_[static_cast<size_t>(tick) & mask_].push_back({tick, key});
+        ++pending_;
+    }
+    
+    // Moves the wheel to `now`, appending due keys to `fired`
+    void advance(std::chrono::steady_clock::time_point now, std::vector<uint64_t>& fired) {
+        const int64_t target = tickOf(now);
+        if (target <= currentTick_ || pending_ == 0) {
+            currentTick_ = std::max(currentTick_, target);
+            return;
+        }
+        
+        const int64_t steps = std::min<int64_t>(target - currentTick_, static_cast<int64_t>(slots_.size()));
+        for (int64_t i = 1; i <= steps; ++i) {
+            auto& slot = slots_[static_cast<size_t>(currentTick_ + i) & mask_];
+            auto keep = std::partition(slot.begin(), slot.end(),
+                                       [target](const Entry& entry) { return entry.dueTick > target; });
+            for (auto it = keep; it != slot.end(); ++it) {
+                fired.push_back(it->key);
+            }
+            pending_ -= static_cast<size_t>(slot.end() - keep);
+            slot.erase(keep, slot.end());
+        }
+        currentTick_ = target;
+    }
+    
+    size_t size() const {
+        return pending_;
+    }
+
+private:
+    int64_t tickOf(std::chrono::steady_clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count() / resolutionNs_;
+    }
+};
+
+// Stable dense index for a client pre-registered with RateLimiter::registerClient.
+// The generation detects handles used after unregisterClient().
+struct ClientHandle {
+    static constexpr uint32_t kInvalidIndex = UINT32_MAX;
+    
+    uint32_t index = kInvalidIndex;
+    uint32_t generation = 0;
+    
+    bool valid() const {
+        return index != kInvalidIndex;
+    }
+};
+
+// On-disk snapshot layout (native byte order): a SnapshotHeader, recordCount
+// fixed-size SnapshotRecords, then keyBytes of concatenated client ids that
+// records point into. Everything is 8-byte aligned, so a file can be used
+// straight from an mmap. Refill times are stored as ages relative to the save
+// so they survive a reboot of the steady clock.
+struct SnapshotHeader {
+    static constexpr uint64_t kMagic = 0x31504e534c52ULL;   // "RLSNP1"
+    static constexpr uint32_t kVersion = 2;         // 2: 64-bit bucket sizes
+    
+    uint64_t magic;
+    uint32_t version;
+    uint32_t storageMode;           // StorageMode the snapshot was taken in
+    uint64_t recordCount;
+    uint64_t keyBytes;
+    int64_t savedWallNs;            // system_clock at save, to account for downtime
+    uint64_t reserved[3];
+};
+static_assert(sizeof(SnapshotHeader) == 64, "SnapshotHeader layout is part of the file format");
+
+struct SnapshotRecord {
+    uint64_t keyHash;               // Compact mode's stored hash; 0 in map mode
+    uint64_t keyOffset;             // Into the key area
+    uint32_t keyLength;
+    uint32_t reserved;
+    uint64_t bucketSize;
+    double refillRate;
+    double tokens;
+    int64_t refillAgeNs;            // Time since the last refill at save
+    uint64_t totalRequests;
+    uint64_t acceptedRequests;
+};
+static_assert(sizeof(SnapshotRecord) == 72, "SnapshotRecord layout is part of the file format");
+
+// Immutable per-client limits and parent links. Writers copy the table, edit
+// the copy and publish it whole, so readers never lock; limits are split into
+// parts by hash so one update only copies the part it touches. The version
+// grows with every publish.
+struct PolicyTable {
+    using Limits = std::pair<size_t, double>;   // {bucketSize, refillRate}
+    using LimitMap = std::unordered_map<std::string, Limits, ClientKeyHash, ClientKeyEqual>;
+    using ParentMap = std::unordered_map<std::string, std::string, ClientKeyHash, ClientKeyEqual>;
+    
+    static constexpr size_t kParts = 64;
+    
+    // A whole set of limits, already split the way the table splits them
+    struct LimitParts {
+        std::array<LimitMap, kParts> parts;
+        
+        void set(std::string&& clientId, Limits entry) {
+            parts[partOf(hashClientId(clientId))].insert_or_assign(std::move(clientId), entry);
+        }
+    };
+    
+    uint64_t version = 0;
+    std::array<std::shared_ptr<const LimitMap>, kParts> limits;
+    std::shared_ptr<const ParentMap> parents;
+    
+    PolicyTable() {
+        auto empty = std::make_shared<const LimitMap>();
+        limits.fill(empty);
+        parents = std::make_shared<const ParentMap>();
+    }
+    
+    PolicyTable(const std::unordered_map<std::string, Limits>& clientLimits,
+                const std::unordered_map<std::string, std::string>& clientParents) {
+        std::array<LimitMap, kParts> parts;
+        for (const auto& [clientId, entry] : clientLimits) {
+            parts[partOf(hashClientId(clientId))].emplace(clientId, entry);
+        }
+        for (size_t i = 0; i < kParts; ++i) {
+            limits[i] = std::make_shared<const LimitMap>(std::move(parts[i]));
+        }
+        parents = std::make_shared<const ParentMap>(clientParents.begin(), clientParents.end());
+    }
+    
+    // The client's limits, or `fallback` when it has no override
+    Limits limitsFor(const ClientKey& key, Limits fallback) const {
+        const LimitMap& part = *limits[partOf(key.hash)];
+        auto it = part.find(key);
+        return it != part.end() ? it->second : fallback;
+    }
+    
+    // Null when the client has no parent
+    const std::string* parentOf(const ClientKey& key) const {
+        if (parents->empty()) {
+            return nullptr;
+        }
+        auto it = parents->find(key);
+        return it != parents->end() && !it->second.empty() ? &it->second : nullptr;
+    }
+    
+    // Copy-on-write edits, for a table that has not been published yet. Each
+    // touched part is copied once however many of its clients change.
+    void setLimits(const std::unordered_map<std::string, Limits>& clientLimits) {
+        std::array<std::shared_ptr<LimitMap>, kParts> copies;
+        for (const auto& [clientId, entry] : clientLimits) {
+            size_t index = partOf(hashClientId(clientId));
+            if (!copies[index]) {
+                copies[index] = std::make_shared<LimitMap>(*limits[index]);
+            }
+            (*copies[index])[clientId] = entry;
+        }
+        for (size_t i = 0; i < kParts; ++i) {
+            if (copies[i]) {
+                limits[i] = std::move(copies[i]);
+            }
+        }
+    }
+    
+    // Replaces all limits with `replacement`, keeping every part whose entries
+    // are unchanged. Clients whose limits changed, appeared or disappeared are
+    // appended to `changed`; false if there were none.
+    bool replaceLimits(LimitParts&& replacement, std::vector<std::string>& changed) {
+        const size_t before = changed.size();
+        for (size_t i = 0; i < kParts; ++i) {
+            const LimitMap& current = *limits[i];
+            LimitMap& next = replacement.parts[i];
+            const size_t partBefore = changed.size();
+            size_t kept = 0;
+            for (const auto& [clientId, entry] : next) {
+                auto it = current.find(clientId);
+                if (it == current.end() || it->second != entry) {
+                    changed.push_back(clientId);
+                }
+                kept += it != current.end() ? 1 : 0;
+            }
+            // Only look for removed clients if some current ones were not seen
+            for (auto it = current.begin(); kept < current.size() && it != current.end(); ++it) {
+                if (!next.contains(it->first)) {
+                    changed.push_back(it->first);
+                }
+            }
+            if (changed.size() != partBefore) {
+                limits[i] = std::make_shared<const LimitMap>(std::move(next));
+            }
+        }
+        return changed.size() != before;
+    }
+    
+    void setParent(const std::string& clientId, const std::string& parentId) {
+        auto copy = std::make_shared<ParentMap>(*parents);
+        if (parentId.empty()) {
+            copy->erase(clientId);
+        } else {
+            (*copy)[clientId] = parentId;
+        }
+        parents = std::move(copy);
+    }
+
+private:
+    static size_t partOf(uint64_t hash) {
+        // High bits, which the shard and bucket selection below use least
+        return static_cast<size_t>(hash >> 58) & (kParts - 1);
+    }
+};
+
+// Streaming reader for the JSON config file described in the README. The
+// file is read through a fixed buffer and each clientLimits / clientParents
+// entry is handed to a callback as soon as it is parsed, so a table of
+// millions of clients costs no more than the table the callbacks build.
+// Unknown keys are skipped; malformed input throws std::runtime_error naming
+// the line.
+class ConfigFileReader {
+public:
+    using LimitSink = std::function<void(std::string&& clientId, size_t bucketSize, double refillRate)>;
+    using ParentSink = std::function<void(std::string&& clientId, std::string&& parentId)>;
+    
+private:
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr int kMaxNesting = 64;  // Skipped values nested deeper are rejected
+    
+    std::string path_;
+    std::ifstream in_;
+    std::unique_ptr<char[]> buffer_;
+    size_t position_ = 0;
+    size_t length_ = 0;
+    size_t line_ = 1;
+    
+public:
+    explicit ConfigFileReader(const std::string& path)
+        : path_(path), in_(path, std::ios::binary), buffer_(std::make_unique<char[]>(kBufferSize)) {
+        if (!in_) {
+            throw std::runtime_error("ConfigFileReader: cannot open " + path);
+        }
+    }
+    
+    // Settings and client limits from the file, on top of `config`
+    static RateLimiterConfig load(const std::string& path, RateLimiterConfig config = RateLimiterConfig()) {
+        ConfigFileReader reader(path);
+        reader.read(&config,
+                    [&](std::string&& clientId, size_t bucketSize, double refillRate) {
+                        config.clientLimits[std::move(clientId)] = {bucketSize, refillRate};
+                    },
+                    [&](std::string&& clientId, std::string&& parentId) {
+                        config.clientParents[std::move(clientId)] = std::move(parentId);
+                    });
+        return config;
+    }
+    
+    // Reads the whole file once. Top-level settings go to `settings` (null to
+    // skip them); either sink may be empty to skip its section.
+    void read(RateLimiterConfig* settings, const LimitSink& limits, const ParentSink& parents) {
+        expect('{');
+        if (consumeIf('}')) {
+            expectEnd();
+            return;
+        }
+        do {
+            std::string key = readString();
+            expect(':');
+            if (key == "clientLimits" && limits) {
+                readLimits(limits);
+            } else if (key == "clientParents" && parents) {
+                readObject([&](std::string&& clientId) { parents(std::move(clientId), readString()); });
+            } else if (settings && readSetting(key, *settings)) {
+                continue;
+            } else {
+                skipValue();
+            }
+        } while (consumeIf(','));
+        expect('}');
+        expectEnd();
+    }
+
+private:
+    void readLimits(const LimitSink& limits) {
+        readObject([&](std::string&& clientId) {
+            std::optional<size_t> bucketSize;
+            std::optional<double> refillRate;
+            readObject([&](std::string&& field) {
+                if (field == "bucketSize") {
+                    bucketSize = readCount();
+                } else if (field == "refillRate") {
+                    refillRate = readRate();
+                } else {
+                    skipValue();
+                }
+            });
+            if (!bucketSize || !refillRate) {
+                fail("client " + clientId + " needs bucketSize and refillRate");
+            }
+            limits(std::move(clientId), *bucketSize, *refillRate);
+        });
+    }
+    
+    // False for keys that are not settings
+    bool readSetting(const std::string& key, RateLimiterConfig& config) {
+        if (key == "defaultBucketSize") {
+            config.defaultBucketSize = readCount();
+        } else if (key == "defaultRefillRate") {
+            config.defaultRefillRate = readRate();
+        } else if (key == "cleanupInterval") {
+            config.cleanupInterval = std::chrono::seconds(readCount());
+        } else if (key == "enableMetrics") {
+            config.enableMetrics = readBool();
+        } else if (key == "enableLogging") {
+            config.enableLogging = readBool();
+        } else if (key == "maxClients") {
+            config.maxClients = readCount();
+        } else if (key == "numShards") {
+            config.numShards = readCount();
+        } else {
+            return false;
+        }
+        return true;
+    }
+    
+    // Calls onMember(key) for each member; onMember reads the value
+    template <typename OnMember>
+    void readObject(OnMember onMember) {
+        expect('{');
+        if (consumeIf('}')) {
+            return;
+        }
+        do {
+            std::string key = readString();
+            expect(':');
+            onMember(std::move(key));
+        } while (consumeIf(','));
+        expect('}');
+    }
+    
+    int peek() {
+        if (position_ == length_) {
+            length_ = static_cast<size_t>(in_.rdbuf()->sgetn(buffer_.get(), kBufferSize));
+            position_ = 0;
+            if (length_ == 0) {
+                return EOF;
+            }
+        }
+        return static_cast<unsigned char>(buffer_[position_]);
+    }
+    
+    int get() {
+        int c = peek();
+        if (c != EOF) {
+            position_++;
+            line_ += c == '\n' ? 1 : 0;
+        }
+        return c;
+    }
+    
+    void skipSpace() {
+        for (int c = peek(); c == ' ' || c == '\t' || c == '\n' || c == '\r'; c = peek()) {
+            get();
+        }
+    }
+    
+    bool consumeIf(char expected) {
+        skipSpace();
+        if (peek() != expected) {
+            return false;
+        }
+        get();
+        return true;
+    }
+    
+    void expect(char expected) {
+        if (!consumeIf(expected)) {
+            fail(std::string("expected '") + expected + "'");
+        }
+    }
+    
+    void expectEnd() {
+        skipSpace();
+        if (peek() != EOF) {
+            fail("unexpected data after the top-level object");
+        }
+    }
+    
+    std::string readString() {
+        expect('"');
+        std::string value;
+        for (;;) {
+            int c = get();
+            if (c == EOF || c == '\n') {
+                fail("unterminated string");
+            }
+            if (c == '"') {
+                return value;
+            }
+            if (c != '\\') {
+                value += static_cast<char>(c);
+                continue;
+            }
+            switch (c = get()) {
+                case '"': case '\\': case '/': value += static_cast<char>(c); break;
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'n': value += '\n'; break;
+                case 'r': value += '\r'; break;
+                case 't': value += '\t'; break;
+                case 'u': appendUtf8(value, readCodePoint()); break;
+                default: fail("invalid escape in string");
+            }
+        }
+    }
+    
+    // A \u escape, combining a surrogate pair into one code point
+    uint32_t readCodePoint() {
+        uint32_t unit = readHex4();
+        if (unit >= 0xd800 && unit < 0xdc00) {
+            if (get() != '\\' || get() != 'u') {
+                fail("unpaired surrogate in string");
+            }
+            uint32_t low = readHex4();
+            if (low < 0xdc00 || low >= 0xe000) {
+                fail("unpaired surrogate in string");
+            }
+            return 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+        }
+        if (unit >= 0xdc00 && unit < 0xe000) {
+            fail("unpaired surrogate in string");
+        }
+        return unit;
+    }
+    
+    uint32_t readHex4() {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            int c = get();
+            int digit = c >= '0' && c <= '9' ? c - '0'
+                      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                fail("invalid \\u escape");
+            }
+            value = value * 16 + static_cast<uint32_t>(digit);
+        }
+        return value;
+    }
+    
+    static void appendUtf8(std::string& out, uint32_t point) {
+        if (point < 0x80) {
+            out += static_cast<char>(point);
+        } else if (point < 0x800) {
+            out += static_cast<char>(0xc0 | (point >> 6));
+            out += static_cast<char>(0x80 | (point & 0x3f));
+        } else if (point < 0x10000) {
+            out += static_cast<char>(0xe0 | (point >> 12));
+            out += static_cast<char>(0x80 | ((point >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (point & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | (point >> 18));
+            out += static_cast<char>(0x80 | ((point >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((point >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (point & 0x3f));
+        }
+    }
+    
+    double readNumber() {
+        skipSpace();
+        char text[64];
+        size_t length = 0;
+        for (int c = peek(); (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+             c = peek()) {
+            if (length + 1 == sizeof(text)) {
+                fail("number too long");
+            }
+            text[length++] = static_cast<char>(get());
+        }
+        text[length] = '\0';
+        char* end = nullptr;
+        double value = length > 0 ? std::strtod(text, &end) : 0.0;
+        if (length == 0 || end != text + length || !std::isfinite(value)) {
+            fail("expected a number");
+        }
+        return value;
+    }
+    
+    size_t readCount() {
+        double value = readNumber();
+        if (value < 0 || value != std::floor(value) || value >= 0x1p63) {
+            fail("expected a non-negative integer");
+        }
+        return static_cast<size_t>(value);
+    }
+    
+    double readRate() {
+        double value = readNumber();
+        if (value < 0) {
+            fail("expected a non-negative rate");
+        }
+        return value;
+    }
+    
+    bool readBool() {
+        skipSpace();
+        if (consumeWord("true")) {
+            return true;
+        }
+        if (consumeWord("false")) {
+            return false;
+        }
+        fail("expected true or false");
+    }
+    
+    bool consumeWord(std::string_view word) {
+        if (peek() != word[0]) {
+            return false;
+        }
+        for (char expected : word) {
+            if (get() != expected) {
+                fail("invalid literal");
+            }
+        }
+        return true;
+    }
+    
+    // Skips any value; objects and arrays up to kMaxNesting deep
+    void skipValue(int depth = 0) {
+        if (depth > kMaxNesting) {
+            fail("value nested too deeply");
+        }
+        skipSpace();
+        int c = peek();
+        if (c == '"') {
+            readString();
+        } else if (c == '{') {
+            readObject([&](std::string&&) { skipValue(depth + 1); });
+        } else if (c == '[') {
+            get();
+            if (consumeIf(']')) {
+                return;
+            }
+            do {
+                skipValue(depth + 1);
+            } while (consumeIf(','));
+            expect(']');
+        } else if (c == 't' || c == 'f') {
+            readBool();
+        } else if (!consumeWord("null")) {
+            readNumber();
+        }
+    }
+    
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::runtime_error("ConfigFileReader: " + path_ + ":" + std::to_string(line_) + ": " + message);
+    }
+};
+
+// Limiter policies. Each BasicRateLimiter parameter is one of these; the
+// Configured* ones defer to RateLimiterConfig at run time, the others fix the
+// choice at compile time so the code for the alternatives is dropped.
+
+// Buckets as config.bucketType, config.clientLimits and config.leaseBackend say
+struct ConfiguredBuckets {
+    static constexpr bool kFixedLimits = false;
+};
+
+// Every bucket, parents included, is lock-free with these limits. Per-client
+// limits, bucket types and leases are ignored and updateClientLimits() does
+// nothing.
+template <size_t BucketSize, double RefillRate>
+struct FixedLimitBuckets {
+    static constexpr bool kFixedLimits = true;
+    static constexpr size_t kBucketSize = BucketSize;
+    static constexpr double kRefillRate = RefillRate;
+    using BucketType = BasicAtomicTokenBucket<FixedBucketLimits<BucketSize, RefillRate>>;
+};
+
+// Storage as config.storageMode says
+struct ConfiguredStorage {
+    static bool compact(const RateLimiterConfig& config) {
+        return config.storageMode == StorageMode::Compact;
+    }
+};
+
+// Always the sharded client map, whatever config.storageMode says
+struct MapStorage {
+    static constexpr bool compact(const RateLimiterConfig&) {
+        return false;
+    }
+};
+
+// Always the compact table
+struct CompactStorage {
+    static constexpr bool compact(const RateLimiterConfig&) {
+        return true;
+    }
+};
+
+// Statistics and the request log as config.enableMetrics and
+// config.enableLogging say
+struct ConfiguredMetrics {
+    using Counters = StatisticsCounters;
+    using Histogram = LatencyHistogram;
+    
+    static bool metrics(const RateLimiterConfig& config) {
+        return config.enableMetrics;
+    }
+    
+    static bool logging(const RateLimiterConfig& config) {
+        return config.enableLogging;
+    }
+};
+
+// No statistics, latency histogram or request log, e.g. where metrics are
+// collected upstream. Their storage is not allocated either.
+struct NoMetrics {
+    using Counters = NoStatisticsCounters;
+    using Histogram = NoLatencyHistogram;
+    
+    static constexpr bool metrics(const RateLimiterConfig&) {
+        return false;
+    }
+    
+    static constexpr bool logging(const RateLimiterConfig&) {
+        return false;
+    }
+};
+
+// config.clock, or the precise clock if unset; one virtual call per read
+class ConfiguredClock {
+private:
+    const Clock* clock_;
+    
+public:
+    explicit ConfiguredClock(const RateLimiterConfig& config)
+        : clock_(config.clock ? config.clock.get() : &Clock::precise()) {}
+    
+    std::chrono::steady_clock::time_point now() const {
+        return clock_->now();
+    }
+    
+    // Handed to buckets and tables, which read the clock themselves
+    const Clock* get() const {
+        return clock_;
+    }
+};
+
+// steady_clock read directly so the call inlines; config.clock is ignored
+class DirectSteadyClock {
+public:
+    explicit DirectSteadyClock(const RateLimiterConfig&) {}
+    
+    std::chrono::steady_clock::time_point now() const {
+        return std::chrono::steady_clock::now();
+    }
+    
+    const Clock* get() const {
+        return &Clock::precise();
+    }
+};
+
+// Main Rate Limiter class. RateLimiter (below) is the fully configurable
+// instantiation; other combinations of the policies above trade run-time
+// options for a leaner hot path.
+template <typename BucketPolicy, typename MapPolicy, typename MetricsPolicy, typename ClockPolicy>
+class BasicRateLimiter {
+private:
+    // What a handle resolves to. Immutable once published, so a reader holding
+    // one can use the id while the slot is released or rebuilt.
+    struct HandleEntry {
+        BucketPtr bucket;                   // Null if the client could not be tracked again
+        std::string clientId;
+    };
+    
+    // One slot per registered client, padded so neighbouring hot handles do
+    // not share a cache line
+    struct alignas(64) HandleSlot {
+        std::atomic<std::shared_ptr<const HandleEntry>> entry;
+        std::atomic<uint32_t> generation{0};
+    };
+    
+    // Caller suspended in acquire()/acquireAsync() until its tokens refill
+    struct Waiter {
+        BucketPtr bucket;                   // Null in StorageMode::Compact
+        std::string clientId;
+        uint64_t hash;
+        size_t tokens;
+        std::function<void(bool)> done;
+    };
+    
+    enum class AcquireStart { Acquired, Rejected, Queued };
+    
+    static constexpr int kMaxHierarchyDepth = 8;    // Parent links followed per client
+    
+
+    RateLimiterConfig config_;
+    ClockPolicy clock_;
+    ShardedClientMap clients_;
+    std::unique_ptr<CompactBucketTable> compact_;   // Set in StorageMode::Compact
+    std::unordered_map<std::string, BucketType, ClientKeyHash, ClientKeyEqual> bucketTypes_;
+    std::unique_ptr<SketchLimiter> sketch_;         // Clients past maxClients (sketchWidth only)
+    [[no_unique_address]] typename MetricsPolicy::Counters stats_;
+    std::atomic<size_t> activeClients_{0};
+    
+    // Published per-client limits and parents. policyVersion_ mirrors the
+    // table's version so buckets can check they are current without touching
+    // the table's reference count; writers serialize on policyWriteMutex_.
+    std::atomic<std::shared_ptr<const PolicyTable>> policies_{std::make_shared<const PolicyTable>()};
+    alignas(64) std::atomic<uint64_t> policyVersion_{0};
+    std::mutex policyWriteMutex_;
+    
+    // Registered client handles; the slot array never moves once allocated
+    mutable std::shared_mutex handlesMutex_;
+    std::unique_ptr<HandleSlot[]> handleSlots_;
+    uint32_t handleSlotsUsed_ = 0;
+    std::vector<uint32_t> freeHandles_;
+    std::unordered_map<std::string, uint32_t, ClientKeyHash, ClientKeyEqual> handleIndex_;
+    
+    // Incremental eviction cursors, one per shard plus one for compact slots
+    std::mutex evictionMutex_;
+    std::vector<size_t> evictionCursors_;
+    size_t compactEvictionCursor_ = 0;
+    
+    // Periodic maintenance jobs, cancelled in shutdown()
+    std::shared_ptr<MaintenanceScheduler> scheduler_;
+    std::vector<MaintenanceScheduler::TaskId> maintenanceTasks_;
+    
+    // Latency measurement
+    [[no_unique_address]] typename MetricsPolicy::Histogram latencyHistogram_;
+    
+    // Background snapshot started by the periodic job, waited for in shutdown()
+    std::future<bool> pendingSnapshot_;
+    
+    // Cluster mode lease top-ups (leaseBackend only)
+    std::shared_ptr<TokenLeaseManager> leaseManager_;
+    
+    // Sampled request log, drained by a maintenance job (enableLogging only)
+    std::unique_ptr<RequestLog> requestLog_;
+    
+    // Most-rejected clients (topRejectedClients only) and the scrape endpoint
+    // (metricsPort only), which renders exportMetrics() on its own thread
+    std::unique_ptr<HeavyHitters> topRejected_;
+#if defined(__linux__)
+    std::unique_ptr<MetricsServer> metricsServer_;
+#endif
+    
+    // Async acquire: one FIFO per client hash, all woken by a single timer
+    // wheel whose job runs only while someone waits. A non-empty queue always
+    // has exactly one wheel entry. The job cancels itself once the last queue
+    // drains; its id is kept as retiredTimerTask_ so shutdown() can wait out
+    // that final run.
+    std::mutex waitersMutex_;
+    std::unordered_map<uint64_t, std::deque<Waiter>> waitQueues_;
+    std::atomic<size_t> waitingClients_{0};
+    TimerWheel timerWheel_;
+    MaintenanceScheduler::TaskId timerTask_ = 0;
+    MaintenanceScheduler::TaskId retiredTimerTask_ = 0;
+    
+    // Times getOrCreateBucket() and the histogram directly
+    friend class MicroBenchmark;
+
+public:
+    explicit BasicRateLimiter(const RateLimiterConfig& config = RateLimiterConfig()) 
+        : config_(config), clock_(config),
+          clients_(config.numShards), stats_(config.statisticsStripes),
+          handleSlots_(std::make_unique<HandleSlot[]>(config.maxRegisteredClients)),
+          timerWheel_(config.acquireTimerSlots, config.acquireTimerResolution, clock_.now()) {
+        if constexpr (BucketPolicy::kFixedLimits) {
+            config_.defaultBucketSize = BucketPolicy::kBucketSize;
+            config_.defaultRefillRate = BucketPolicy::kRefillRate;
+            config_.clientLimits.clear();
+            config_.clientBucketTypes.clear();
+            config_.leaseBackend.reset();
+        }
+        policies_.store(std::make_shared<const PolicyTable>(config_.clientLimits, config_.clientParents));
+        bucketTypes_.insert(config_.clientBucketTypes.begin(), config_.clientBucketTypes.end());
+        if (compactMode()) {
+            checkCompactLimit("the default", config_.defaultBucketSize);
+            for (const auto& [clientId, limits] : config_.clientLimits) {
+                checkCompactLimit(clientId, limits.first);
+            }
+            compact_ = std::make_unique<CompactBucketTable>(
+                config_.maxClients, config_.numShards, config_.defaultBucketSize,
+                config_.defaultRefillRate, clock_.get(), config_.sharedMemoryName);
+        }
+        if (config_.sketchWidth > 0) {
+            sketch_ = std::make_unique<SketchLimiter>(config_.sketchWidth, config_.sketchDepth, sketchWindow());
+        }
+        startMaintenance();
+    }
+    
+    BasicRateLimiter(size_t bucketSize, double refillRate) 
+        : BasicRateLimiter(configWithLimits(bucketSize, refillRate)) {}
+    
+    ~BasicRateLimiter() {
+        shutdown();
+    }
+    
+    bool allowRequest(std::string_view clientId) {
+        return allowRequest(ClientKey(clientId));
+    }
+    
+    bool allowRequest(const char* clientId, size_t length) {
+        return allowRequest(ClientKey(std::string_view(clientId, length)));
+    }
+    
+    // Uses the caller's precomputed hash (see hashClientId) for the lookup
+    bool allowRequest(const ClientKey& key) {
+        // One clock read serves both the refill and the latency start
+        auto start = clock_.now();
+        
+        bool allowed = allowRequestInternal(key, start);
+        recordRequest(allowed, start, key.id);
+        
+        return allowed;
+    }
+    
+    // Resolved once via registerClient(); no hashing or map lookup
+    bool allowRequest(ClientHandle handle) {
+        auto start = clock_.now();
+        
+        auto entry = resolveHandle(handle);
+        Bucket* bucket = entry ? entry->bucket.get() : nullptr;
+        bool allowed = bucket ? bucket->consumeChain(1, start) : false;
+        recordRequest(allowed, start, entry ? std::string_view(entry->clientId) : std::string_view());
+        
+        return allowed;
+    }
+    
+    bool allowRequests(std::string_view clientId, size_t count) {
+        return allowRequests(ClientKey(clientId), count);
+    }
+    
+    bool allowRequests(const char* clientId, size_t length, size_t count) {
+        return allowRequests(ClientKey(std::string_view(clientId, length)), count);
+    }
+    
+    // `count` tokens or none, recorded as one request for `count` tokens
+    bool allowRequests(const ClientKey& key, size_t count) {
+        auto start = clock_.now();
+        
+        bool allowed;
+        if (compactMode()) {
+            allowed = consumeCompact(key, count, start);
+        } else if (!withBucket(key, [&](Bucket& bucket) { allowed = bucket.consumeChain(count, start); })) {
+            BucketPtr bucket = getOrCreateBucket(key);
+            allowed = bucket ? bucket->consumeChain(count, start) : consumeUntracked(key, count, start);
+        }
+        recordRequest(allowed, start, key.id, count);
+        
+        return allowed;
+    }
+    
+    bool allowRequests(ClientHandle handle, size_t count) {
+        auto start = clock_.now();
+        
+        auto entry = resolveHandle(handle);
+        Bucket* bucket = entry ? entry->bucket.get() : nullptr;
+        bool allowed = bucket ? bucket->consumeChain(count, start) : false;
+        recordRequest(allowed, start, entry ? std::string_view(entry->clientId) : std::string_view(), count);
+        
+        return allowed;
+    }
+    
+    // Takes as many of `maxCount` tokens as the client has now (e.g. bytes of
+    // a stream being throttled) and returns how many. One request, accepted
+    // if anything was granted.
+    size_t allowRequestsUpTo(std::string_view clientId, size_t maxCount) {
+        return allowRequestsUpTo(ClientKey(clientId), maxCount);
+    }
+    
+    size_t allowRequestsUpTo(const char* clientId, size_t length, size_t maxCount) {
+        return allowRequestsUpTo(ClientKey(std::string_view(clientId, length)), maxCount);
+    }
+    
+    size_t allowRequestsUpTo(const ClientKey& key, size_t maxCount) {
+        auto start = clock_.now();
+        
+        size_t granted;
+        if (compactMode()) {
+            granted = consumeCompactUpTo(key, maxCount, start);
+        } else if (!withBucket(key, [&](Bucket& bucket) { granted = bucket.consumeUpToChain(maxCount, start); })) {
+            BucketPtr bucket = getOrCreateBucket(key);
+            granted = bucket ? bucket->consumeUpToChain(maxCount, start) : consumeUntrackedUpTo(key, maxCount, start);
+        }
+        recordRequest(granted > 0, maxCount, granted, start, key.id);
+        
+        return granted;
+    }
+    
+    size_t allowRequestsUpTo(ClientHandle handle, size_t maxCount) {
+        auto start = clock_.now();
+        
+        auto entry = resolveHandle(handle);
+        Bucket* bucket = entry ? entry->bucket.get() : nullptr;
+        size_t granted = bucket ? bucket->consumeUpToChain(maxCount, start) : 0;
+        recordRequest(granted > 0, maxCount, granted, start,
+                      entry ? std::string_view(entry->clientId) : std::string_view());
+        
+        return granted;
+    }
+    
+    // Takes `count` tokens and returns zero when they are available; otherwise
+    // takes nothing and returns the time until they will be, suitable for a
+    // Retry-After. Bucket::kNever means waiting will not help (count above the
+    // bucket size, or the client could not be tracked).
+    std::chrono::nanoseconds tryAcquireOrDelay(std::string_view clientId, size_t count = 1) {
+        return tryAcquireOrDelay(ClientKey(clientId), count);
+    }
+    
+    std::chrono::nanoseconds tryAcquireOrDelay(const ClientKey& key, size_t count = 1) {
+        auto start = clock_.now();
+        
+        std::chrono::nanoseconds delay = Bucket::kNever;
+        if (compactMode()) {
+            delay = reserveCompact(key, count, start);
+        } else if (!withBucket(key, [&](Bucket& bucket) { delay = bucket.reserveChain(count, start); })) {
+            if (BucketPtr bucket = getOrCreateBucket(key)) {
+                delay = bucket->reserveChain(count, start);
+            }
+        }
+        recordRequest(delay.count() == 0, start, key.id, count);
+        
+        return delay;
+    }
+    
+    std::chrono::nanoseconds tryAcquireOrDelay(ClientHandle handle, size_t count = 1) {
+        auto start = clock_.now();
+        
+        auto entry = resolveHandle(handle);
+        Bucket* bucket = entry ? entry->bucket.get() : nullptr;
+        std::chrono::nanoseconds delay = bucket ? bucket->reserveChain(count, start) : Bucket::kNever;
+        recordRequest(delay.count() == 0, start, entry ? std::string_view(entry->clientId) : std::string_view(), count);
+        
+        return delay;
+    }
+    
+    // Calls done(true) once `count` tokens have been taken for the client, or
+    // done(false) if they never can be (see tryAcquireOrDelay) or the limiter
+    // shuts down first. Waiters for a client are served in FIFO order. done
+    // runs inline when the tokens are available immediately, otherwise on the
+    // maintenance thread, so it should hand heavy work off.
+    void acquireAsync(std::string_view clientId, size_t count, std::function<void(bool)> done) {
+        auto result = beginAcquire(ClientKey(clientId), count, done);
+        if (result != AcquireStart::Queued) {
+            done(result == AcquireStart::Acquired);
+        }
+    }
+    
+    // co_await limiter.acquire(clientId, n) suspends until the tokens are taken
+    // and yields true, or false as for acquireAsync. The coroutine resumes on
+    // the maintenance thread unless it did not need to wait.
+    class AcquireAwaiter {
+    private:
+        BasicRateLimiter& limiter_;
+        std::string clientId_;
+        size_t count_;
+        bool acquired_ = false;
+        
+    public:
+        AcquireAwaiter(BasicRateLimiter& limiter, std::string_view clientId, size_t count)
+            : limiter_(limiter), clientId_(clientId), count_(count) {}
+        
+        bool await_ready() const noexcept {
+            return false;
+        }
+        
+        bool await_suspend(std::coroutine_handle<> handle) {
+            std::function<void(bool)> resume = [this, handle](bool acquired) {
+                acquired_ = acquired;
+                handle.resume();
+            };
+            auto result = limiter_.beginAcquire(ClientKey(clientId_), count_, resume);
+            if (result == AcquireStart::Queued) {
+                return true; // May already be resuming on another thread; touch nothing
+            }
+            acquired_ = result == AcquireStart::Acquired;
+            return false;
+        }
+        
+        bool await_resume() const noexcept {
+            return acquired_;
+        }
+    };
+    
+    AcquireAwaiter acquire(std::string_view clientId, size_t count = 1) {
+        return AcquireAwaiter(*this, clientId, count);
+    }
+    
+    // Admits one token for each key. The clock is read once, keys are grouped
+    // by shard so each shard lock is taken at most once per mode (shared for
+    // hits, exclusive for new clients), and statistics are updated once for the
+    // whole batch. Sets results[i] to 1 if keys[i] was allowed and returns the
+    // number of allowed requests.
+    size_t allowRequestBatch(std::span<const ClientKey> keys, std::span<uint8_t> results) {
+        const size_t count = std::min(keys.size(), results.size());
+        if (count == 0) {
+            return 0;
+        }
+        
+        auto now = clock_.now();
+        
+        if (compactMode()) {
+            // Compact hits are lock-free, so no grouping is needed; existing
+            // slots are refilled together and only new clients take a lock
+            thread_local std::vector<uint64_t> hashes;
+            thread_local std::vector<CompactBucketTable::Result> outcomes;
+            hashes.resize(count);
+            outcomes.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = keys[i].hash;
+            }
+            compact_->consumeBatch(hashes, 1, now, outcomes);
+            
+            size_t accepted = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (outcomes[i] == CompactBucketTable::Result::Missing) {
+                    results[i] = consumeCompact(keys[i], 1, now) ? 1 : 0;
+                } else {
+                    results[i] = outcomes[i] == CompactBucketTable::Result::Allowed ? 1 : 0;
+                }
+                accepted += results[i];
+            }
+            recordBatch(keys.first(count), results, accepted, now);
+            return accepted;
+        }
+        
+        // Counting sort of key indices by shard; scratch space is reused per thread
+        thread_local std::vector<uint32_t> keyShards;
+        thread_local std::vector<uint32_t> shardOffsets;
+        thread_local std::vector<uint32_t> order;
+        const size_t shards = clients_.shardCount();
+        keyShards.resize(count);
+        order.resize(count);
+        shardOffsets.assign(shards + 1, 0);
+        
+        for (size_t i = 0; i < count; ++i) {
+            keyShards[i] = static_cast<uint32_t>(clients_.shardIndex(keys[i].hash));
+            shardOffsets[keyShards[i] + 1]++;
+        }
+        for (size_t s = 0; s < shards; ++s) {
+            shardOffsets[s + 1] += shardOffsets[s];
+        }
+        for (size_t i = 0; i < count; ++i) {
+            order[shardOffsets[keyShards[i]]++] = static_cast<uint32_t>(i);
+        }
+        
+        // shardOffsets[s] now holds the end of shard s; its start is the end of s - 1
+        constexpr uint8_t kPending = 2;
+        size_t accepted = 0;
+        for (size_t s = 0, begin = 0; s < shards; begin = shardOffsets[s++]) {
+            const size_t end = shardOffsets[s];
+            if (begin == end) {
+                continue;
+            }
+            
+            auto& shard = clients_.shard(s);
+            bool hasMisses = false;
+            
+            // Buckets cannot be evicted while the shared lock is held, so they
+            // are consumed in place without taking a reference
+            {
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                for (size_t j = begin; j < end; ++j) {
+                    const uint32_t idx = order[j];
+                    auto it = shard.clients.find(keys[idx]);
+                    if (it != shard.clients.end()) {
+                        adoptPolicies(keys[idx].id, *it->second);
+                        results[idx] = it->second->consumeChain(1, now) ? 1 : 0;
+                        accepted += results[idx];
+                    } else {
+                        results[idx] = kPending;
+                        hasMisses = true;
+                    }
+                }
+            }
+            
+            if (hasMisses) {
+                // Parents may live in any shard, so resolve them before locking
+                thread_local std::vector<BucketPtr> parents;
+                parents.assign(end - begin, nullptr);
+                for (size_t j = begin; j < end; ++j) {
+                    if (results[order[j]] == kPending) {
+                        parents[j - begin] = parentBucketFor(keys[order[j]].id, 0);
+                    }
+                }
+                
+                std::unique_lock<std::shared_mutex> lock(shard.mutex);
+                for (size_t j = begin; j < end; ++j) {
+                    const uint32_t idx = order[j];
+                    if (results[idx] != kPending) {
+                        continue;
+                    }
+                    BucketPtr bucket = findOrInsertBucketLocked(shard, keys[idx], std::move(parents[j - begin]));
+                    if (bucket) {
+                        adoptPolicies(keys[idx].id, *bucket);
+                    }
+                    bool allowed = bucket ? bucket->consumeChain(1, now) : consumeUntracked(keys[idx], 1, now);
+                    results[idx] = allowed ? 1 : 0;
+                    accepted += results[idx];
+                }
+            }
+        }
+        
+        recordBatch(keys.first(count), results, accepted, now);
+        return accepted;
+    }
+    
+    // Pins the client's bucket into a dense slot and returns its handle. Returns
+    // an invalid handle if the slot array or maxClients is exhausted, or in
+    // StorageMode::Compact, which has no per-client Bucket to pin.
+    ClientHandle registerClient(std::string_view clientId) {
+        if (compactMode()) {
+            return {};
+        }
+        
+        std::unique_lock<std::shared_mutex> lock(handlesMutex_);
+        
+        auto existing = handleIndex_.find(clientId);
+        if (existing != handleIndex_.end()) {
+            uint32_t index = existing->second;
+            return {index, handleSlots_[index].generation.load()};
+        }
+        
+        if (freeHandles_.empty() && handleSlotsUsed_ >= config_.maxRegisteredClients) {
+            return {};
+        }
+        
+        BucketPtr bucket = getOrCreateBucket(ClientKey(clientId));
+        if (!bucket) {
+            return {};
+        }
+        
+        uint32_t index;
+        if (!freeHandles_.empty()) {
+            index = freeHandles_.back();
+            freeHandles_.pop_back();
+        } else {
+            index = handleSlotsUsed_++;
+        }
+        
+        HandleSlot& slot = handleSlots_[index];
+        slot.entry.store(std::make_shared<const HandleEntry>(HandleEntry{std::move(bucket), std::string(clientId)}));
+        handleIndex_.emplace(std::string(clientId), index);
+        
+        return {index, slot.generation.load()};
+    }
+    
+    // Releases the slot; the client itself stays tracked until cleanup() or
+    // removeClient() drops it
+    void unregisterClient(ClientHandle handle) {
+        std::unique_lock<std::shared_mutex> lock(handlesMutex_);
+        releaseHandle(handle);
+    }
+    
+    // Existing buckets keep their fill level (tokens scaled to the new size)
+    // and switch on their next request; nothing is locked on the request path
+    void updateClientLimit(const std::string& clientId, size_t bucketSize, double refillRate) {
+        updateClientLimits({{clientId, {bucketSize, refillRate}}});
+    }
+    
+    // Publishes all the changes as one new policy table, so pushing a whole
+    // tier config costs one copy of the touched parts rather than one per
+    // client. In compact mode a bucket size above
+    // CompactBucketTable::kMaxBucketSize throws and changes nothing.
+    void updateClientLimits(const std::unordered_map<std::string, std::pair<size_t, double>>& clientLimits) {
+        if constexpr (BucketPolicy::kFixedLimits) {
+            return;
+        }
+        if (compactMode()) {
+            for (const auto& [clientId, limits] : clientLimits) {
+                checkCompactLimit(clientId, limits.first);
+            }
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(policyWriteMutex_);
+            auto table = std::make_shared<PolicyTable>(*policies_.load());
+            table->setLimits(clientLimits);
+            publishPolicies(std::move(table));
+        }
+        
+        if (compactMode()) {
+            // Compact slots have no version to check, so switch them now
+            for (const auto& [clientId, limits] : clientLimits) {
+                compact_->setPolicy(hashClientId(clientId), compact_->policyFor(limits.first, limits.second));
+            }
+        }
+    }
+    
+    // Replaces every per-client limit with the file's clientLimits; clients
+    // left out go back to the defaults. The file is parsed before anything is
+    // published, so requests keep the old limits meanwhile and a malformed
+    // file (or, in compact mode, a bucket size the slots cannot hold) throws
+    // and changes nothing. Unchanged parts of the table are kept
+    // and buckets whose limits stay the same keep their tokens. Settings and
+    // clientParents in the file are ignored. Returns the clients whose limits
+    // changed.
+    size_t reloadClientLimits(const std::string& path) {
+        if constexpr (BucketPolicy::kFixedLimits) {
+            (void)path;
+            return 0;
+        }
+        
+        PolicyTable::LimitParts replacement;
+        ConfigFileReader(path).read(nullptr,
+                                    [&](std::string&& clientId, size_t bucketSize, double refillRate) {
+                                        if (compactMode()) {
+                                            checkCompactLimit(clientId, bucketSize);
+                                        }
+                                        replacement.set(std::move(clientId), {bucketSize, refillRate});
+                                    },
+                                    nullptr);
+        
+        std::vector<std::string> changed;
+        std::shared_ptr<const PolicyTable> published;
+        {
+            std::lock_guard<std::mutex> lock(policyWriteMutex_);
+            auto table = std::make_shared<PolicyTable>(*policies_.load());
+            if (!table->replaceLimits(std::move(replacement), changed)) {
+                return 0;
+            }
+            published = table;
+            publishPolicies(std::move(table));
+        }
+        
+        if (compactMode()) {
+            const PolicyTable::Limits defaults{config_.defaultBucketSize, config_.defaultRefillRate};
+            for (const auto& clientId : changed) {
+                ClientKey key(clientId);
+                auto [bucketSize, refillRate] = published->limitsFor(key, defaults);
+                compact_->setPolicy(key.hash, compact_->policyFor(bucketSize, refillRate));
+            }
+        }
+        return changed.size();
+    }
+    
+    // Moves the client under `parentId` (empty to detach). The client's
+    // bucket is rebuilt, refilled, to pick up the new chain.
+    void setClientParent(const std::string& clientId, const std::string& parentId) {
+        {
+            std::lock_guard<std::mutex> lock(policyWriteMutex_);
+            auto table = std::make_shared<PolicyTable>(*policies_.load());
+            table->setParent(clientId, parentId);
+            publishPolicies(std::move(table));
+        }
+        
+        if (!compactMode()) {
+            rebuildBucket(ClientKey(clientId));
+        }
+    }
+    
+    void removeClient(const std::string& clientId) {
+        ClientKey key(clientId);
+        if (compactMode()) {
+            if (compact_->erase(key.hash)) {
+                compact_->liveCount()--;
+            }
+            return;
+        }
+        
+        {
+            std::unique_lock<std::shared_mutex> lock(handlesMutex_);
+            auto it = handleIndex_.find(key);
+            if (it != handleIndex_.end()) {
+                uint32_t index = it->second;
+                releaseHandle({index, handleSlots_[index].generation.load()});
+            }
+        }
+        
+        eraseBucket(key);
+        
+        // Children would otherwise keep charging the removed bucket
+        rebuildChildren(key, 0);
+    }
+    
+    Statistics getStatistics() const {
+        Statistics stats = stats_.snapshot();
+        stats.activeClients = compactMode() ? compact_->liveCount().load() : activeClients_.load();
+        return stats;
+    }
+    
+    ClientStatistics getClientStatistics(const std::string& clientId) const {
+        ClientKey key(clientId);
+        if (compactMode()) {
+            ClientStatistics stats;
+            if (compact_->getStatistics(key.hash, stats)) {
+                return stats;
+            }
+        } else if (BucketPtr bucket = findBucket(key)) {
+            return bucket->getStatistics();
+        }
+        
+        // Return default statistics for non-existent client
+        return {0, config_.defaultBucketSize, config_.defaultRefillRate, 0, 0, 
+                clock_.now()};
+    }
+    
+    ClientStatistics getClientStatistics(ClientHandle handle) const {
+        auto entry = resolveHandle(handle);
+        if (entry && entry->bucket) {
+            return entry->bucket->getStatistics();
+        }
+        
+        return {0, config_.defaultBucketSize, config_.defaultRefillRate, 0, 0, 
+                clock_.now()};
+    }
+    
+    // Compact storage keeps only key hashes, so its clients are not listed here
+    std::vector<std::string> getActiveClients() const {
+        std::vector<std::string> clients;
+        clients.reserve(activeClients_.load());
+        
+        for (size_t i = 0; i < clients_.shardCount(); ++i) {
+            const auto& shard = clients_.shard(i);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& pair : shard.clients) {
+                clients.emplace_back(pair.first.view());
+            }
+        }
+        
+        return clients;
+    }
+    
+    // P50, P90, P95, P99 and P99.9 in milliseconds over all recorded requests
+    std::vector<double> getLatencyPercentiles() const {
+        auto percentiles = latencyHistogram_.percentiles({50.0, 90.0, 95.0, 99.0, 99.9});
+        for (double& value : percentiles) {
+            value /= 1e6;
+        }
+        return percentiles;
+    }
+    
+    // The `limit` most-rejected clients, most first (empty unless
+    // topRejectedClients is set). Counts are approximate; see HeavyHitters.
+    std::vector<HeavyHitters::Entry> getTopRejectedClients(size_t limit) const {
+        return topRejected_ ? topRejected_->top(limit) : std::vector<HeavyHitters::Entry>();
+    }
+    
+    // Prometheus text exposition (format 0.0.4) of the limiter-wide counters,
+    // the latency histogram and the top rejected clients. Built from the
+    // striped counters alone: it never walks the client map or takes a lock a
+    // request would wait on.
+    std::string exportMetrics() const {
+        Statistics stats = getStatistics();
+        auto latency = latencyHistogram_.merge();
+        
+        std::ostringstream out;
+        out << "# HELP ratelimiter_requests_total Requests checked, by outcome.\n"
+            << "# TYPE ratelimiter_requests_total counter\n"
+            << "ratelimiter_requests_total{outcome=\"accepted\"} " << stats.acceptedRequests << "\n"
+            << "ratelimiter_requests_total{outcome=\"rejected\"} " << stats.rejectedRequests << "\n"
+            << "# HELP ratelimiter_tokens_requested_total Tokens asked for.\n"
+            << "# TYPE ratelimiter_tokens_requested_total counter\n"
+            << "ratelimiter_tokens_requested_total " << stats.requestedTokens << "\n"
+            << "# HELP ratelimiter_tokens_granted_total Tokens handed out.\n"
+            << "# TYPE ratelimiter_tokens_granted_total counter\n"
+            << "ratelimiter_tokens_granted_total " << stats.grantedTokens << "\n"
+            << "# HELP ratelimiter_active_clients Clients with a bucket.\n"
+            << "# TYPE ratelimiter_active_clients gauge\n"
+            << "ratelimiter_active_clients " << stats.activeClients << "\n";
+        
+        // Power-of-two boundaries from 256ns to ~17s. Each is the lower bound
+        // of a histogram bucket, so the count below 2^e ns covers whole
+        // nanosecond samples up to 2^e - 1, which is what le states (exactly,
+        // in fixed notation) since Prometheus bounds are inclusive
+        out << "# HELP ratelimiter_request_duration_seconds Time spent deciding a request.\n"
+            << "# TYPE ratelimiter_request_duration_seconds histogram\n";
+        uint64_t cumulative = 0;
+        size_t next = 0;
+        for (int exponent = 8; exponent <= 34; exponent += 2) {
+            const size_t bound = LatencyHistogram::bucketIndex(uint64_t(1) << exponent);
+            for (; next < bound; ++next) {
+                cumulative += latency[next];
+            }
+            out << "ratelimiter_request_duration_seconds_bucket{le=\"" << std::fixed << std::setprecision(9)
+                << static_cast<double>((uint64_t(1) << exponent) - 1) / 1e9 << std::defaultfloat << "\"} "
+                << cumulative << "\n";
+        }
+        for (; next < latency.size(); ++next) {
+            cumulative += latency[next];
+        }
+        out << "ratelimiter_request_duration_seconds_bucket{le=\"+Inf\"} " << cumulative << "\n"
+            << "ratelimiter_request_duration_seconds_sum " << std::setprecision(9) << stats.totalLatency / 1e3 << "\n"
+            << "ratelimiter_request_duration_seconds_count " << cumulative << "\n";
+        
+        if (requestLog_) {
+            out << "# HELP ratelimiter_log_dropped_total Request log records dropped on a full ring.\n"
+                << "# TYPE ratelimiter_log_dropped_total counter\n"
+                << "ratelimiter_log_dropped_total " << requestLog_->droppedRecords() << "\n";
+        }
+        
+        if (topRejected_) {
+            out << "# HELP ratelimiter_top_rejected_requests Rejections of the most-rejected clients (approximate).\n"
+                << "# TYPE ratelimiter_top_rejected_requests gauge\n";
+            for (const auto& entry : topRejected_->top(config_.topRejectedClients)) {
+                out << "ratelimiter_top_rejected_requests{client=\"" << escapeLabel(entry.clientId) << "\"} "
+                    << entry.count << "\n";
+            }
+        }
+        return out.str();
+    }
+    
+    void cleanup() {
+        auto now = clock_.now();
+        auto threshold = now - config_.cleanupInterval;
+        
+        std::lock_guard<std::mutex> evictionLock(evictionMutex_);
+        
+        if (compactMode()) {
+            const size_t chunk = config_.evictionBatchSize * 64;
+            for (size_t begin = 0; begin < compact_->slotCount(); begin += chunk) {
+                compact_->liveCount() -= compact_->evictIdle(threshold, begin, begin + chunk);
+            }
+            return;
+        }
+        
+        // Full pass, but still in evictionBatchSize chunks so no shard lock is
+        // held for a whole-shard sweep
+        for (size_t i = 0; i < clients_.shardCount(); ++i) {
+            for (size_t begin = 0; begin < bucketCount(i); begin += config_.evictionBatchSize) {
+                sweepShard(i, begin, begin + config_.evictionBatchSize, threshold);
+            }
+        }
+    }
+    
+    // One incremental eviction step: sweeps the slice of every shard needed to
+    // cover the whole table once per cleanupInterval, resuming where the last
+    // step stopped
+    void evictionStep() {
+        auto now = clock_.now();
+        auto threshold = now - config_.cleanupInterval;
+        const double fraction = std::min(1.0,
+            std::chrono::duration<double>(config_.evictionTickInterval).count() /
+            std::max(1e-9, std::chrono::duration<double>(config_.cleanupInterval).count()));
+        
+        std::lock_guard<std::mutex> evictionLock(evictionMutex_);
+        
+        if (compactMode()) {
+            const size_t slots = compact_->slotCount();
+            size_t quota = std::max<size_t>(config_.evictionBatchSize,
+                                            static_cast<size_t>(std::ceil(slots * fraction)));
+            while (quota > 0) {
+                if (compactEvictionCursor_ >= slots) {
+                    compactEvictionCursor_ = 0;
+                }
+                size_t chunk = std::min({quota, config_.evictionBatchSize * 64, slots - compactEvictionCursor_});
+                compact_->liveCount() -= compact_->evictIdle(threshold, compactEvictionCursor_,
+                                                             compactEvictionCursor_ + chunk);
+                compactEvictionCursor_ += chunk;
+                quota -= chunk;
+            }
+            return;
+        }
+        
+        evictionCursors_.resize(clients_.shardCount(), 0);
+        for (size_t i = 0; i < clients_.shardCount(); ++i) {
+            const size_t buckets = bucketCount(i);
+            size_t quota = std::max<size_t>(config_.evictionBatchSize,
+                                            static_cast<size_t>(std::ceil(buckets * fraction)));
+            quota = std::min(quota, buckets);
+            
+            while (quota > 0) {
+                size_t& cursor = evictionCursors_[i];
+                if (cursor >= bucketCount(i)) {
+                    cursor = 0;
+                }
+                size_t chunk = std::min(quota, config_.evictionBatchSize);
+                sweepShard(i, cursor, cursor + chunk, threshold);
+                cursor += chunk;
+                quota -= chunk;
+            }
+        }
+    }
+    
+    // Writes every client's bucket state to `path` (via a temporary file that
+    // is renamed over it). Each shard is copied under its shared lock in turn,
+    // so requests keep flowing and only inserts into the shard being copied
+    // wait. Returns false on I/O failure.
+    bool saveSnapshot(const std::string& path) const {
+        std::vector<SnapshotRecord> records;
+        std::string keys;
+        records.reserve(activeClients_.load());
+        
+        auto now = clock_.now();
+        auto ageOf = [now](std::chrono::steady_clock::time_point lastRefill) {
+            return std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastRefill).count(), 0);
+        };
+        
+        if (compactMode()) {
+            std::vector<CompactBucketTable::SlotState> slots;
+            compact_->exportSlots(slots);
+            for (const auto& slot : slots) {
+                records.push_back({slot.storedHash, 0, 0, 0, slot.bucketSize, slot.refillRate,
+                                   slot.tokens, ageOf(slot.lastRefill), 0, 0});
+            }
+        } else {
+            for (size_t i = 0; i < clients_.shardCount(); ++i) {
+                const auto& shard = clients_.shard(i);
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                for (const auto& [clientId, bucket] : shard.clients) {
+                    Bucket::State state = bucket->saveState();
+                    ClientStatistics limits = bucket->getStatistics();
+                    records.push_back({0, keys.size(), static_cast<uint32_t>(clientId.size()), 0,
+                                       limits.bucketSize, limits.refillRate, state.tokens, ageOf(state.lastRefill),
+                                       state.totalRequests, state.acceptedRequests});
+                    keys.append(clientId);
+                }
+            }
+        }
+        keys.resize((keys.size() + 7) & ~size_t(7), '\0');
+        
+        SnapshotHeader header{};
+        header.magic = SnapshotHeader::kMagic;
+        header.version = SnapshotHeader::kVersion;
+        header.storageMode = static_cast<uint32_t>(config_.storageMode);
+        header.recordCount = records.size();
+        header.keyBytes = keys.size();
+        header.savedWallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        
+        const std::string tempPath = path + ".tmp";
+        {
+            std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(records.data()),
+                      static_cast<std::streamsize>(records.size() * sizeof(SnapshotRecord)));
+            out.write(keys.data(), static_cast<std::streamsize>(keys.size()));
+            if (!out.flush()) {
+                std::remove(tempPath.c_str());
+                return false;
+            }
+        }
+        return std::rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+    
+    // Runs saveSnapshot() on its own thread; the limiter must outlive it
+    std::future<bool> saveSnapshotAsync(std::string path) const {
+        return std::async(std::launch::async, [this, path = std::move(path)]() { return saveSnapshot(path); });
+    }
+    
+    // Restores bucket state saved by saveSnapshot(), replacing the state of
+    // clients that already exist. Time spent down counts as refill time.
+    // Limits come from the current configuration (compact mode, which has no
+    // client ids, uses the saved ones). Shards are restored in parallel.
+    // Returns false if the file is missing, truncated, of another format
+    // version, or from the other storage mode. The file is read with two bulk
+    // reads rather than mapped; a restore runs once, at startup.
+    bool loadSnapshot(const std::string& path) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) {
+            return false;
+        }
+        const auto fileSize = static_cast<size_t>(in.tellg());
+        in.seekg(0);
+        
+        SnapshotHeader header{};
+        if (fileSize < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic != SnapshotHeader::kMagic || header.version != SnapshotHeader::kVersion ||
+            header.storageMode != static_cast<uint32_t>(config_.storageMode) ||
+            header.recordCount > (fileSize - sizeof(header)) / sizeof(SnapshotRecord) ||
+            header.keyBytes != fileSize - sizeof(header) - header.recordCount * sizeof(SnapshotRecord)) {
+            return false;
+        }
+        
+        std::vector<SnapshotRecord> records(header.recordCount);
+        std::string keys(header.keyBytes, '\0');
+        in.read(reinterpret_cast<char*>(records.data()),
+                static_cast<std::streamsize>(records.size() * sizeof(SnapshotRecord)));
+        in.read(keys.data(), static_cast<std::streamsize>(keys.size()));
+        if (!in) {
+            return false;
+        }
+        
+        auto now = clock_.now();
+        int64_t downtimeNs = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() - header.savedWallNs, 0);
+        auto refillTime = [now, downtimeNs](const SnapshotRecord& record) {
+            return now - std::chrono::nanoseconds(downtimeNs) - std::chrono::nanoseconds(record.refillAgeNs);
+        };
+        
+        if (compactMode()) {
+            auto& liveCount = compact_->liveCount();
+            for (const auto& record : records) {
+                if (liveCount.fetch_add(1) >= config_.maxClients) {
+                    liveCount--;
+                    break;
+                }
+                uint16_t policy = compact_->policyFor(record.bucketSize, record.refillRate);
+                auto result = compact_->restoreSlot({record.keyHash, record.tokens, refillTime(record),
+                                                     record.bucketSize, record.refillRate}, policy);
+                if (result != CompactBucketTable::InsertResult::Inserted) {
+                    liveCount--;
+                }
+            }
+            return true;
+        }
+        
+        for (const auto& record : records) {
+            if (record.keyOffset > keys.size() || record.keyLength > keys.size() - record.keyOffset) {
+                return false;
+            }
+        }
+        
+        // Group record indices by shard (counting sort), then restore shards
+        // on parallel workers so each shard lock is taken once
+        const size_t shards = clients_.shardCount();
+        std::vector<uint64_t> hashes(records.size());
+        std::vector<uint32_t> shardOffsets(shards + 1, 0);
+        for (size_t i = 0; i < records.size(); ++i) {
+            hashes[i] = hashClientId(std::string_view(keys.data() + records[i].keyOffset, records[i].keyLength));
+            shardOffsets[clients_.shardIndex(hashes[i]) + 1]++;
+        }
+        for (size_t s = 0; s < shards; ++s) {
+            shardOffsets[s + 1] += shardOffsets[s];
+        }
+        std::vector<uint32_t> order(records.size());
+        {
+            std::vector<uint32_t> next(shardOffsets.begin(), shardOffsets.end() - 1);
+            for (size_t i = 0; i < records.size(); ++i) {
+                order[next[clients_.shardIndex(hashes[i])]++] = static_cast<uint32_t>(i);
+            }
+        }
+        
+        const bool hasParents = !policies_.load()->parents->empty();
+        
+        auto restoreShard = [&](size_t s) {
+            const uint32_t begin = shardOffsets[s];
+            const uint32_t end = shardOffsets[s + 1];
+            auto keyOf = [&](uint32_t j) {
+                const SnapshotRecord& record = records[order[j]];
+                return ClientKey(std::string_view(keys.data() + record.keyOffset, record.keyLength), hashes[order[j]]);
+            };
+            auto stateOf = [&](uint32_t j) {
+                const SnapshotRecord& record = records[order[j]];
+                return Bucket::State{record.tokens, refillTime(record), record.totalRequests, record.acceptedRequests};
+            };
+            
+            // Parent links may cross shards, so linked clients go one by one
+            if (hasParents) {
+                for (uint32_t j = begin; j < end; ++j) {
+                    if (BucketPtr bucket = getOrCreateBucket(keyOf(j))) {
+                        bucket->restoreState(stateOf(j));
+                    }
+                }
+                return;
+            }
+            
+            // Otherwise fill the shard under one lock hold, sized up front
+            auto& shard = clients_.shard(s);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.clients.reserve(shard.clients.size() + (end - begin));
+            for (uint32_t j = begin; j < end; ++j) {
+                if (BucketPtr bucket = findOrInsertBucketLocked(shard, keyOf(j))) {
+                    bucket->restoreState(stateOf(j));
+                }
+            }
+        };
+        
+        const size_t workers = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, shards);
+        std::vector<std::thread> threads;
+        for (size_t w = 1; w < workers; ++w) {
+            threads.emplace_back([&, w]() {
+                for (size_t s = w; s < shards; s += workers) {
+                    restoreShard(s);
+                }
+            });
+        }
+        for (size_t s = 0; s < shards; s += workers) {
+            restoreShard(s);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return true;
+    }
+    
+    void reset() {
+        if (compactMode()) {
+            compact_->resetAll();
+        }
+        
+        for (size_t i = 0; i < clients_.shardCount(); ++i) {
+            auto& shard = clients_.shard(i);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (auto& pair : shard.clients) {
+                pair.second->reset();
+            }
+        }
+        
+        // Reset statistics
+        stats_.reset();
+        
+        // Clear latency measurements
+        latencyHistogram_.reset();
+        if (topRejected_) {
+            topRejected_->reset();
+        }
+    }
+    
+    void printDetailedStats() const {
+        auto stats = getStatistics();
+        auto percentiles = getLatencyPercentiles();
+        
         std::cout << "\n=== Rate Limiter Statistics ===\n";
         std::cout << "Total Requests:     " << stats.totalRequests << "\n";
         std::cout << "Accepted Requests:  " << stats.acceptedRequests << " (" 
                   << std::fixed << std::setprecision(1) << stats.getAcceptanceRate() << "%)\n";
         std::cout << "Rejected Requests:  " << stats.rejectedRequests << " (" 
                   << std::fixed << std::setprecision(1) << stats.getRejectionRate() << "%)\n";
+        std::cout << "Tokens Granted:     " << stats.grantedTokens << " of " << stats.requestedTokens << " ("
+                  << std::fixed << std::setprecision(1) << stats.getTokenGrantRate() << "%)\n";
         std::cout << "Active Clients:     " << stats.activeClients << "\n";
         std::cout << "Average Latency:    " << std::fixed << std::setprecision(3) 
                   << stats.getAverageLatency() << " ms\n";
         
-        std::cout << "\nLatency Percentiles:\n";
-        std::cout << "  P50:  " << std::fixed << std::setprecision(3) << percentiles[0] << " ms\n";
-        std::cout << "  P90:  " << std::fixed << std::setprecision(3) << percentiles[1] << " ms\n";
-        std::cout << "  P95:  " << std::fixed << std::setprecision(3) << percentiles[2] << " ms\n";
-        std::cout << "  P99:  " << std::fixed << std::setprecision(3) << percentiles[3] << " ms\n";
-        std::cout << "  P99.9:" << std::fixed << std::setprecision(3) << percentiles[4] << " ms\n";
-        std::cout << "================================\n\n";
+        std::cout << "\nLatency Percentiles:\n";
+        std::cout << "  P50:  " << std::fixed << std::setprecision(3) << percentiles[0] << " ms\n";
+        std::cout << "  P90:  " << std::fixed << std::setprecision(3) << percentiles[1] << " ms\n";
+        std::cout << "  P95:  " << std::fixed << std::setprecision(3) << percentiles[2] << " ms\n";
+        std::cout << "  P99:  " << std::fixed << std::setprecision(3) << percentiles[3] << " ms\n";
+        std::cout << "  P99.9:" << std::fixed << std::setprecision(3) << percentiles[4] << " ms\n";
+        std::cout << "================================\n\n";
+    }
+
+private:
+    // Label values escape backslash, double quote and newline
+    static std::string escapeLabel(std::string_view value) {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+    
+    // An all-or-nothing request for `tokens`
+    void recordRequest(bool allowed, std::chrono::steady_clock::time_point start,
+                       std::string_view clientId, size_t tokens = 1) {
+        recordRequest(allowed, tokens, allowed ? tokens : 0, start, clientId);
+    }
+    
+    void recordRequest(bool allowed, size_t requestedTokens, size_t grantedTokens,
+                       std::chrono::steady_clock::time_point start, std::string_view clientId) {
+        // Update statistics
+        if (MetricsPolicy::metrics(config_)) {
+            // Measure latency
+            auto end = clock_.now();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            uint64_t latencyNs = static_cast<uint64_t>(std::max<int64_t>(elapsed, 0));
+            
+            stats_.record(allowed, latencyNs, requestedTokens, grantedTokens);
+            latencyHistogram_.record(latencyNs);
+            if (!allowed && topRejected_) {
+                topRejected_->record(clientId);
+            }
+        }
+        
+        if (MetricsPolicy::logging(config_)) {
+            logRequest(clientId, allowed);
+        }
+    }
+    
+    void recordBatch(std::span<const ClientKey> keys, std::span<const uint8_t> results,
+                     size_t accepted, std::chrono::steady_clock::time_point start) {
+        if (MetricsPolicy::metrics(config_)) {
+            auto finish = clock_.now();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count();
+            uint64_t latencyNs = static_cast<uint64_t>(std::max<int64_t>(elapsed, 0));
+            
+            stats_.recordBatch(keys.size(), accepted, latencyNs);
+            latencyHistogram_.record(latencyNs / keys.size(), keys.size());
+            if (topRejected_ && accepted < keys.size()) {
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    if (results[i] == 0) {
+                        topRejected_->record(keys[i].id);
+                    }
+                }
+            }
+        }
+        
+        if (MetricsPolicy::logging(config_)) {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                logRequest(keys[i].id, results[i] != 0);
+            }
+        }
+    }
+    
+    // Hands the entry to the background writer; no formatting or I/O here
+    void logRequest(std::string_view clientId, bool allowed) {
+        if (requestLog_ && requestLog_->shouldLog(allowed)) {
+            requestLog_->append(clientId, allowed);
+        }
+    }
+    
+    // Null if the handle was released, or its slot reused, meanwhile
+    std::shared_ptr<const HandleEntry> resolveHandle(ClientHandle handle) const {
+        if (handle.index >= config_.maxRegisteredClients) {
+            return nullptr;
+        }
+        
+        const HandleSlot& slot = handleSlots_[handle.index];
+        if (slot.generation.load(std::memory_order_acquire) != handle.generation) {
+            return nullptr;
+        }
+        
+        auto entry = slot.entry.load(std::memory_order_acquire);
+        
+        // Re-check so a slot recycled while we loaded it is not mistaken for ours
+        if (!entry || slot.generation.load(std::memory_order_acquire) != handle.generation) {
+            return nullptr;
+        }
+        
+        if (entry->bucket) {
+            adoptPolicies(entry->clientId, *entry->bucket);
+        }
+        return entry;
+    }
+    
+    // Brings the bucket up to the published limits; one compare unless the
+    // policy table changed since the bucket last looked
+    void adoptPolicies(std::string_view clientId, Bucket& bucket) const {
+        if constexpr (BucketPolicy::kFixedLimits) {
+            return;
+        }
+        if (bucket.limitsVersion() != policyVersion_.load(std::memory_order_acquire)) {
+            refreshLimits(clientId, bucket);
+        }
+    }
+    
+    // Applies the current limits to the bucket and its ancestors. Repeats if
+    // another table was published meanwhile, so a thread holding an older
+    // table never has the last word.
+    void refreshLimits(std::string_view clientId, Bucket& bucket) const {
+        const PolicyTable::Limits defaults{config_.defaultBucketSize, config_.defaultRefillRate};
+        std::shared_ptr<const PolicyTable> policies;
+        do {
+            policies = policies_.load();
+            std::string_view id = clientId;
+            Bucket* level = &bucket;
+            for (int depth = 0; level && depth <= kMaxHierarchyDepth; ++depth) {
+                ClientKey key(id);
+                if (level->limitsVersion() != policies->version) {
+                    auto [bucketSize, refillRate] = policies->limitsFor(key, defaults);
+                    level->setLimits(bucketSize, refillRate);
+                    level->setLimitsVersion(policies->version);
+                }
+                const std::string* parent = policies->parentOf(key);
+                if (!parent) {
+                    break;
+                }
+                id = *parent;
+                level = level->getParent().get();
+            }
+        } while (policyVersion_.load(std::memory_order_acquire) != policies->version);
+    }
+    
+    // Compile-time constant unless the storage policy defers to the config
+    bool compactMode() const {
+        return MapPolicy::compact(config_);
+    }
+    
+    static RateLimiterConfig configWithLimits(size_t bucketSize, double refillRate) {
+        RateLimiterConfig config;
+        config.defaultBucketSize = bucketSize;
+        config.defaultRefillRate = refillRate;
+        return config;
+    }
+    
+    // Caller holds policyWriteMutex_
+    void publishPolicies(std::shared_ptr<PolicyTable> table) {
+        table->version = policyVersion_.load(std::memory_order_relaxed) + 1;
+        const uint64_t version = table->version;
+        policies_.store(std::move(table));
+        policyVersion_.store(version, std::memory_order_release);
+    }
+    
+    // Caller holds handlesMutex_ exclusively
+    void releaseHandle(ClientHandle handle) {
+        if (handle.index >= handleSlotsUsed_) {
+            return;
+        }
+        
+        HandleSlot& slot = handleSlots_[handle.index];
+        if (slot.generation.load() != handle.generation || !slot.entry.load()) {
+            return;
+        }
+        
+        slot.generation.fetch_add(1, std::memory_order_acq_rel);
+        auto entry = slot.entry.exchange(nullptr);
+        handleIndex_.erase(handleIndex_.find(std::string_view(entry->clientId)));
+        freeHandles_.push_back(handle.index);
+    }
+    
+    // Drops the client's bucket so the next request recreates it from the
+    // current limits and parent links. Children linked to the old bucket are
+    // rebuilt as well; registered clients keep their handle.
+    void rebuildBucket(const ClientKey& key, int depth = 0) {
+        eraseBucket(key);
+        
+        {
+            std::shared_lock<std::shared_mutex> lock(handlesMutex_);
+            auto it = handleIndex_.find(key);
+            if (it != handleIndex_.end()) {
+                handleSlots_[it->second].entry.store(
+                    std::make_shared<const HandleEntry>(HandleEntry{getOrCreateBucket(key), std::string(key.id)}));
+            }
+        }
+        
+        rebuildChildren(key, depth);
+    }
+    
+    void rebuildChildren(const ClientKey& key, int depth) {
+        if (depth >= kMaxHierarchyDepth) {
+            return;
+        }
+        
+        std::vector<std::string> children;
+        auto policies = policies_.load();
+        for (const auto& [child, parent] : *policies->parents) {
+            if (parent == key.id) {
+                children.push_back(child);
+            }
+        }
+        for (const auto& child : children) {
+            rebuildBucket(ClientKey(child), depth + 1);
+        }
+    }
+    
+    void eraseBucket(const ClientKey& key) {
+        auto& shard = clients_.shardFor(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.clients.find(key);
+        if (it != shard.clients.end()) {
+            shard.clients.erase(it);
+            activeClients_--;
+        }
+    }
+    
+    // Takes the tokens now, fails permanently, or queues `done` to run when
+    // the client's queue reaches it and the tokens are available. Never calls
+    // done itself. A client with waiters is queued behind them even if tokens
+    // have refilled, so async callers stay FIFO.
+    AcquireStart beginAcquire(const ClientKey& key, size_t count, std::function<void(bool)>& done) {
+        auto start = clock_.now();
+        
+        BucketPtr bucket;
+        if (!compactMode()) {
+            bucket = getOrCreateBucket(key);
+            if (!bucket) {
+                recordRequest(false, start, key.id, count);
+                return AcquireStart::Rejected;
+            }
+        }
+        
+        std::unique_lock<std::mutex> lock(waitersMutex_, std::defer_lock);
+        if (waitingClients_.load(std::memory_order_acquire) > 0) {
+            lock.lock();
+            auto it = waitQueues_.find(key.hash);
+            if (it != waitQueues_.end()) {
+                it->second.push_back({std::move(bucket), std::string(key.id), key.hash, count, std::move(done)});
+                return AcquireStart::Queued;
+            }
+            lock.unlock();
+        }
+        
+        auto delay = bucket ? bucket->reserveChain(count, start) : reserveCompact(key, count, start);
+        if (delay.count() == 0 || delay == Bucket::kNever) {
+            recordRequest(delay.count() == 0, start, key.id, count);
+            return delay.count() == 0 ? AcquireStart::Acquired : AcquireStart::Rejected;
+        }
+        
+        lock.lock();
+        auto [it, created] = waitQueues_.try_emplace(key.hash);
+        it->second.push_back({std::move(bucket), std::string(key.id), key.hash, count, std::move(done)});
+        if (created) {
+            waitingClients_.fetch_add(1, std::memory_order_release);
+            timerWheel_.schedule(start + delay, key.hash);
+            if (timerTask_ == 0 && scheduler_) {
+                timerTask_ = scheduler_->schedule(config_.acquireTimerResolution, [this]() { serviceWaiters(); });
+            }
+        }
+        return AcquireStart::Queued;
+    }
+    
+    // Timer job: retries the head of every queue that came due and re-arms
+    // the ones still short of tokens. Callbacks run after the lock is dropped.
+    void serviceWaiters() {
+        thread_local std::vector<uint64_t> fired;
+        std::vector<std::pair<Waiter, bool>> finished;
+        auto now = clock_.now();
+        
+        {
+            std::lock_guard<std::mutex> lock(waitersMutex_);
+            fired.clear();
+            timerWheel_.advance(now, fired);
+            
+            for (uint64_t hash : fired) {
+                auto it = waitQueues_.find(hash);
+                if (it == waitQueues_.end()) {
+                    continue;
+                }
+                
+                auto& queue = it->second;
+                while (!queue.empty()) {
+                    Waiter& head = queue.front();
+                    if (head.bucket) {
+                        adoptPolicies(head.clientId, *head.bucket);
+                    }
+                    auto delay = head.bucket ? head.bucket->reserveChain(head.tokens, now)
+                                             : reserveCompact(ClientKey(head.clientId, head.hash), head.tokens, now);
+                    if (delay.count() != 0 && delay != Bucket::kNever) {
+                        timerWheel_.schedule(now + delay, hash);
+                        break;
+                    }
+                    finished.emplace_back(std::move(head), delay.count() == 0);
+                    queue.pop_front();
+                }
+                
+                if (queue.empty()) {
+                    waitQueues_.erase(it);
+                    waitingClients_.fetch_sub(1, std::memory_order_release);
+                }
+            }
+            
+            // Nobody left to wake: stop ticking until the next wait starts
+            if (waitQueues_.empty() && timerTask_ != 0) {
+                scheduler_->cancel(timerTask_);
+                retiredTimerTask_ = std::exchange(timerTask_, 0);
+            }
+        }
+        
+        for (auto& [waiter, acquired] : finished) {
+            recordRequest(acquired, now, waiter.clientId, waiter.tokens);
+            waiter.done(acquired);
+        }
+    }
+    
+    // Compact slots cannot hold more than CompactBucketTable::kMaxBucketSize
+    // tokens, so larger limits are refused rather than quietly clamped
+    static void checkCompactLimit(const std::string& clientId, size_t bucketSize) {
+        if (bucketSize > CompactBucketTable::kMaxBucketSize) {
+            throw std::runtime_error("RateLimiter: bucket size " + std::to_string(bucketSize) + " for " + clientId +
+                                     " exceeds the compact mode maximum of " +
+                                     std::to_string(CompactBucketTable::kMaxBucketSize));
+        }
+    }
+    
+    bool allowRequestInternal(const ClientKey& key, std::chrono::steady_clock::time_point now) {
+        if (compactMode()) {
+            return consumeCompact(key, 1, now);
+        }
+        bool allowed = false;
+        if (withBucket(key, [&](Bucket& bucket) { allowed = bucket.consumeChain(1, now); })) {
+            return allowed;
+        }
+        BucketPtr bucket = getOrCreateBucket(key);
+        return bucket ? bucket->consumeChain(1, now) : consumeUntracked(key, 1, now);
+    }
+    
+    // Clients there is no room to track share the sketch, each held to its
+    // bucket size per sketch window (parents do not apply); without a sketch
+    // they are rejected
+    bool consumeUntracked(const ClientKey& key, size_t tokens, std::chrono::steady_clock::time_point now) {
+        if (!sketch_) {
+            return false;
+        }
+        auto limits = policies_.load()->limitsFor(key, {config_.defaultBucketSize, config_.defaultRefillRate});
+        return sketch_->consume(key.hash, tokens, limits.first, now);
+    }
+    
+    size_t consumeUntrackedUpTo(const ClientKey& key, size_t maxTokens, std::chrono::steady_clock::time_point now) {
+        if (!sketch_) {
+            return 0;
+        }
+        auto limits = policies_.load()->limitsFor(key, {config_.defaultBucketSize, config_.defaultRefillRate});
+        return sketch_->consumeUpTo(key.hash, maxTokens, limits.first, now);
+    }
+    
+    // By default a full bucket per window, so a default client keeps its
+    // long-run rate in the sketch
+    std::chrono::nanoseconds sketchWindow() const {
+        if (config_.sketchWindow.count() > 0) {
+            return config_.sketchWindow;
+        }
+        if (config_.defaultRefillRate <= 0.0) {
+            return config_.cleanupInterval;
+        }
+        const double seconds = static_cast<double>(config_.defaultBucketSize) / config_.defaultRefillRate;
+        return std::chrono::nanoseconds(static_cast<int64_t>(std::clamp(seconds, 1e-3, 1e9) * 1e9));
+    }
+    
+    size_t bucketCount(size_t shardIndex) const {
+        const auto& shard = clients_.shard(shardIndex);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.clients.bucket_count();
+    }
+    
+    // Erases idle clients found in hash buckets [begin, end) of one shard. A
+    // rehash between calls only shifts which entries a slice covers; every
+    // entry is still reached within a full cycle of the cursor.
+    void sweepShard(size_t shardIndex, size_t begin, size_t end,
+                    std::chrono::steady_clock::time_point threshold) {
+        thread_local std::vector<std::string_view> idle;
+        idle.clear();
+        
+        // Registered clients are pinned by their handle until unregistered
+        std::shared_lock<std::shared_mutex> handlesLock(handlesMutex_);
+        auto& shard = clients_.shard(shardIndex);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        
+        end = std::min(end, shard.clients.bucket_count());
+        for (size_t b = begin; b < end; ++b) {
+            for (auto it = shard.clients.begin(b); it != shard.clients.end(b); ++it) {
+                // A bucket referenced elsewhere (a child's parent link, an
+                // in-flight caller) is kept so no second copy gets created
+                if (it->second->getLastAccess() < threshold && it->second.use_count() == 1 &&
+                    handleIndex_.find(std::string_view(it->first)) == handleIndex_.end()) {
+                    idle.push_back(it->first);
+                }
+            }
+        }
+        
+        // Each view points into its own node, which stays valid until erased
+        for (std::string_view clientId : idle) {
+            shard.clients.erase(shard.clients.find(clientId));
+            activeClients_--;
+        }
+    }
+    
+    bool consumeCompact(const ClientKey& key, size_t tokens, std::chrono::steady_clock::time_point now) {
+        auto result = compact_->consume(key.hash, tokens, now);
+        if (result == CompactBucketTable::Result::Missing) {
+            if (!insertCompact(key, now)) {
+                return consumeUntracked(key, tokens, now);
+            }
+            result = compact_->consume(key.hash, tokens, now);
+        }
+        return result == CompactBucketTable::Result::Allowed;
+    }
+    
+    size_t consumeCompactUpTo(const ClientKey& key, size_t maxTokens, std::chrono::steady_clock::time_point now) {
+        size_t granted = 0;
+        if (compact_->consumeUpTo(key.hash, maxTokens, now, granted) == CompactBucketTable::Result::Missing) {
+            if (!insertCompact(key, now)) {
+                return consumeUntrackedUpTo(key, maxTokens, now);
+            }
+            compact_->consumeUpTo(key.hash, maxTokens, now, granted);
+        }
+        return granted;
+    }
+    
+    std::chrono::nanoseconds reserveCompact(const ClientKey& key, size_t tokens,
+                                            std::chrono::steady_clock::time_point now) {
+        std::chrono::nanoseconds delay = Bucket::kNever;
+        auto result = compact_->reserve(key.hash, tokens, now, delay);
+        if (result == CompactBucketTable::Result::Missing) {
+            if (!insertCompact(key, now)) {
+                return Bucket::kNever;
+            }
+            result = compact_->reserve(key.hash, tokens, now, delay);
+        }
+        return result == CompactBucketTable::Result::Missing ? Bucket::kNever : delay;
+    }
+    
+    // Adds a compact entry for a missing key; false if the limiter is full
+    bool insertCompact(const ClientKey& key, std::chrono::steady_clock::time_point now) {
+        // Counted in the table so that all processes sharing it agree
+        auto& liveCount = compact_->liveCount();
+        if (liveCount.fetch_add(1) >= config_.maxClients) {
+            liveCount--;
+            return false;
+        }
+        
+        uint16_t policy = compact_->defaultPolicy();
+        const PolicyTable::Limits defaults{config_.defaultBucketSize, config_.defaultRefillRate};
+        auto limits = policies_.load()->limitsFor(key, defaults);
+        if (limits != defaults) {
+            policy = compact_->policyFor(limits.first, limits.second);
+        }
+        
+        auto inserted = compact_->insert(key.hash, policy, now);
+        if (inserted != CompactBucketTable::InsertResult::Inserted) {
+            liveCount--;
+            return inserted == CompactBucketTable::InsertResult::Exists;
+        }
+        return true;
+    }
+    
+    BucketPtr findBucket(const ClientKey& key) const {
+        const auto& shard = clients_.shardFor(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.clients.find(key);
+        return it != shard.clients.end() ? it->second : nullptr;
+    }
+    
+    // Runs fn on an existing client's bucket in place. The shard's shared
+    // lock keeps the bucket from being evicted meanwhile, so a hit costs no
+    // reference count traffic on the bucket's control block; false (and fn
+    // not run) if the client has no bucket yet.
+    template <typename Fn>
+    bool withBucket(const ClientKey& key, Fn&& fn) {
+        const auto& shard = clients_.shardFor(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.clients.find(key);
+        if (it == shard.clients.end()) {
+            return false;
+        }
+        adoptPolicies(key.id, *it->second);
+        fn(*it->second);
+        return true;
+    }
+    
+    BucketPtr getOrCreateBucket(const ClientKey& key, int depth = 0) {
+        auto& shard = clients_.shardFor(key);
+        
+        // Fast path: existing clients only need the shard's shared lock;
+        // probing with the ClientKey reuses its hash and allocates nothing
+        BucketPtr existing;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.clients.find(key);
+            if (it != shard.clients.end()) {
+                existing = it->second;
+            }
+        }
+        if (existing) {
+            adoptPolicies(key.id, *existing);
+            return existing;
+        }
+        
+        // The parent may hash to this shard, so create it before locking
+        BucketPtr parent = parentBucketFor(key.id, depth);
+        
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return findOrInsertBucketLocked(shard, key, std::move(parent));
+    }
+    
+    // Bucket of the client's configured parent, created if needed. Chains are
+    // cut off at kMaxHierarchyDepth so a misconfigured cycle cannot recurse
+    // forever; bucket parents always predate their children, so the linked
+    // buckets themselves can never form a cycle.
+    BucketPtr parentBucketFor(std::string_view clientId, int depth) {
+        if (compactMode() || depth >= kMaxHierarchyDepth) {
+            return nullptr;
+        }
+        
+        // The table keeps the id alive while the parent is looked up
+        auto policies = policies_.load();
+        const std::string* parentId = policies->parentOf(ClientKey(clientId));
+        if (!parentId) {
+            return nullptr;
+        }
+        
+        return getOrCreateBucket(ClientKey(*parentId), depth + 1);
+    }
+    
+    // Caller holds the shard's exclusive lock
+    BucketPtr findOrInsertBucketLocked(ShardedClientMap::Shard& shard, const ClientKey& key,
+                                       BucketPtr parent = nullptr) {
+        // Another thread may have created the bucket while we waited
+        auto it = shard.clients.find(key);
+        if (it != shard.clients.end()) {
+            return it->second;
+        }
+        
+        // Check if we've reached the maximum number of clients
+        if (activeClients_.fetch_add(1) >= config_.maxClients) {
+            activeClients_--;
+            return nullptr;
+        }
+        
+        // Get client-specific limits or use defaults; the hash is reused
+        auto policies = policies_.load();
+        auto [bucketSize, refillRate] = policies->limitsFor(
+            key, {config_.defaultBucketSize, config_.defaultRefillRate});
+        
+        BucketPtr bucket = createBucket(shard.pool, key, bucketSize, refillRate);
+        bucket->setLimitsVersion(policies->version);
+        bucket->setParent(std::move(parent));
+        auto [inserted, added] = shard.clients.try_emplace(InlineKey(key.id), bucket);
+        if (!added) {
+            // Only reachable if key.hash disagreed with the id, so the probe
+            // above looked in the wrong place; keep the mapped bucket
+            activeClients_--;
+            return inserted->second;
+        }
+        
+        return bucket;
+    }
+    
+    // Bucket and control block share one pooled block
+    BucketPtr createBucket(const std::shared_ptr<SlabPool>& pool, const ClientKey& key, size_t bucketSize,
+                           double refillRate) const {
+        PoolAllocator<Bucket> allocator(pool);
+        if constexpr (BucketPolicy::kFixedLimits) {
+            return std::allocate_shared<typename BucketPolicy::BucketType>(allocator, bucketSize, refillRate,
+                                                                           clock_.get());
+        }
+        
+        if (leaseManager_) {
+            return std::allocate_shared<LeasedBucket>(allocator, std::string(key.id), bucketSize, refillRate,
+                                                      clock_.get(), leaseManager_);
+        }
+        
+        auto type = bucketTypes_.empty() ? bucketTypes_.end() : bucketTypes_.find(key);
+        switch (type != bucketTypes_.end() ? type->second : config_.bucketType) {
+            case BucketType::LockFree:
+                return std::allocate_shared<AtomicTokenBucket>(allocator, bucketSize, refillRate, clock_.get());
+            case BucketType::Gcra:
+                return std::allocate_shared<GcraBucket>(allocator, bucketSize, refillRate, clock_.get());
+            case BucketType::SlidingWindow:
+                return std::allocate_shared<SlidingWindowBucket>(allocator, bucketSize, refillRate, clock_.get());
+            case BucketType::Mutex:
+            default:
+                return std::allocate_shared<TokenBucket>(allocator, bucketSize, refillRate, clock_.get());
+        }
+    }
+    
+    void startMaintenance() {
+        scheduler_ = config_.scheduler ? config_.scheduler : std::make_shared<MaintenanceScheduler>();
+        maintenanceTasks_.push_back(
+            scheduler_->schedule(config_.evictionTickInterval, [this]() { evictionStep(); }));
+        
+        if (config_.leaseBackend && !compactMode()) {
+            // Size leases to last a few refresh periods at the observed rate
+            leaseManager_ = std::make_shared<TokenLeaseManager>(
+                config_.leaseBackend, 4 * std::chrono::nanoseconds(config_.leaseRefreshInterval),
+                config_.minLeaseSize);
+            maintenanceTasks_.push_back(scheduler_->schedule(
+                config_.leaseRefreshInterval, [this]() { leaseManager_->refreshPending(clock_.now()); }));
+        }
+        
+        if (!config_.snapshotPath.empty()) {
+            loadSnapshot(config_.snapshotPath);
+            if (config_.snapshotInterval.count() > 0) {
+                // The dump runs on its own thread so other jobs are not delayed
+                maintenanceTasks_.push_back(scheduler_->schedule(config_.snapshotInterval, [this]() {
+                    if (!pendingSnapshot_.valid() ||
+                        pendingSnapshot_.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                        pendingSnapshot_ = saveSnapshotAsync(config_.snapshotPath);
+                    }
+                }));
+            }
+        }
+        
+        if (MetricsPolicy::logging(config_)) {
+            requestLog_ = std::make_unique<RequestLog>(config_.logBufferSize, config_.logFormat,
+                                                       config_.logSampleRate, config_.logRejectedOnly,
+                                                       config_.logPath);
+            maintenanceTasks_.push_back(
+                scheduler_->schedule(config_.logFlushInterval, [this]() { requestLog_->drain(); }));
+        }
+        
+        if (MetricsPolicy::metrics(config_) && config_.topRejectedClients > 0) {
+            topRejected_ = std::make_unique<HeavyHitters>(std::max<size_t>(4 * config_.topRejectedClients, 16));
+        }
+#if defined(__linux__)
+        if (config_.metricsPort != 0) {
+            metricsServer_ = std::make_unique<MetricsServer>(config_.metricsAddress, config_.metricsPort,
+                                                             [this]() { return exportMetrics(); });
+        }
+#endif
+    }
+    
+    // Returns without waiting out an interval; a job already running on the
+    // scheduler finishes first
+    void shutdown() {
+        if (!scheduler_) {
+            return;
+        }
+#if defined(__linux__)
+        if (metricsServer_) {
+            metricsServer_->stop();
+        }
+#endif
+        for (auto id : maintenanceTasks_) {
+            scheduler_->cancel(id);
+        }
+        maintenanceTasks_.clear();
+        
+        if (pendingSnapshot_.valid()) {
+            pendingSnapshot_.wait();
+        }
+        if (!config_.snapshotPath.empty()) {
+            saveSnapshot(config_.snapshotPath);
+        }
+        
+        // Stop the timer job, then fail whoever is still waiting
+        MaintenanceScheduler::TaskId timerTasks[2];
+        {
+            std::lock_guard<std::mutex> lock(waitersMutex_);
+            timerTasks[0] = std::exchange(timerTask_, 0);
+            timerTasks[1] = std::exchange(retiredTimerTask_, 0);
+        }
+        for (auto timerTask : timerTasks) {
+            if (timerTask != 0) {
+                scheduler_->cancel(timerTask);
+            }
+        }
+        
+        std::unordered_map<uint64_t, std::deque<Waiter>> abandoned;
+        {
+            std::lock_guard<std::mutex> lock(waitersMutex_);
+            abandoned.swap(waitQueues_);
+            waitingClients_.store(0, std::memory_order_release);
+        }
+        for (auto& [hash, queue] : abandoned) {
+            for (auto& waiter : queue) {
+                waiter.done(false);
+            }
+        }
+        
+        if (requestLog_) {
+            requestLog_->drain();
+        }
+    }
+};
+
+using RateLimiter = BasicRateLimiter<ConfiguredBuckets, ConfiguredStorage, ConfiguredMetrics, ConfiguredClock>;
+
+// Benchmark and testing utilities
+
+// Hardware counters for the calling thread, read with perf_event_open. The
+// counters are opened as one group so they all cover the same interval, and
+// are scaled up if the kernel multiplexed them. Counters the machine or its
+// perf_event_paranoid setting refuses (common in VMs and containers) are
+// simply reported as unavailable.
+class PerfCounters {
+public:
+    enum Counter {
+        Cycles,
+        Instructions,
+        LlcMisses,
+        CacheLineTransfers,     // Raw event only, e.g. snoop HITM loads; no generic event exists
+        kCounterCount
+    };
+    
+    struct Reading {
+        std::array<double, kCounterCount> values{};
+        std::array<bool, kCounterCount> valid{};
+        
+        Reading& operator+=(const Reading& other) {
+            for (size_t i = 0; i < kCounterCount; ++i) {
+                values[i] += other.values[i];
+                valid[i] = valid[i] || other.valid[i];
+            }
+            return *this;
+        }
+    };
+
+private:
+    int leader_ = -1;
+    std::vector<int> fds_;
+    std::vector<Counter> order_;            // Counter at each position of a group read
+
+public:
+    // `transferEvent` is a PERF_TYPE_RAW config for CacheLineTransfers (0 = skip)
+    explicit PerfCounters(uint64_t transferEvent = 0) {
+#if defined(__linux__)
+        open(Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open(Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        open(LlcMisses, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+             (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        if (transferEvent != 0) {
+            open(CacheLineTransfers, PERF_TYPE_RAW, transferEvent);
+        }
+#else
+        (void)transferEvent;
+#endif
+    }
+    
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (int fd : fds_) {
+            close(fd);
+        }
+#endif
+    }
+    
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    
+    bool available() const {
+        return leader_ >= 0;
+    }
+    
+    void start() {
+#if defined(__linux__)
+        if (leader_ >= 0) {
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+    
+    Reading stop() {
+        Reading reading;
+#if defined(__linux__)
+        if (leader_ < 0) {
+            return reading;
+        }
+        ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        
+        // Group layout: nr, time enabled, time running, then one value per counter
+        std::vector<uint64_t> buffer(3 + order_.size());
+        ssize_t bytes = read(leader_, buffer.data(), buffer.size() * sizeof(uint64_t));
+        if (bytes < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buffer[2] == 0) {
+            return reading;
+        }
+        const double scale = static_cast<double>(buffer[1]) / static_cast<double>(buffer[2]);
+        for (size_t i = 0; i < std::min<size_t>(buffer[0], order_.size()); ++i) {
+            reading.values[order_[i]] = static_cast<double>(buffer[3 + i]) * scale;
+            reading.valid[order_[i]] = true;
+        }
+#endif
+        return reading;
+    }
+
+private:
+#if defined(__linux__)
+    void open(Counter counter, uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = leader_ < 0 ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+        if (fd < 0) {
+            return;
+        }
+        if (leader_ < 0) {
+            leader_ = fd;
+        }
+        fds_.push_back(fd);
+        order_.push_back(counter);
+    }
+#endif
+};
+
+class BenchmarkSuite {
+public:
+    // How requests are spread over the client ids
+    enum class Distribution {
+        Uniform,    // Every client equally likely
+        Zipf,       // Rank-k client weighted 1/k^s
+        HotKey      // All requests to one client
+    };
+    
+    // Limiter variants compared by a run
+    enum class Backend {
+        MutexMap,   // BucketType::Mutex in the sharded map
+        LockFreeMap,// BucketType::LockFree in the sharded map
+        Compact,    // StorageMode::Compact
+        Sketch      // No tracked clients; every one goes to the sketch
+    };
+    
+    struct BenchmarkConfig {
+        size_t numClients = 100;
+        size_t requestsPerClient = 100;
+        std::chrono::milliseconds testDuration{1000};   // Measured time per run
+        std::vector<size_t> threadCounts{1, 2, 4, 8};   // Each clamped to [1, 64]
+        std::vector<Backend> backends{Backend::MutexMap, Backend::LockFreeMap, Backend::Compact, Backend::Sketch};
+        Distribution distribution = Distribution::Uniform;
+        double zipfExponent = 0.99;
+        double hitRatio = 1.0;                  // Share of requests for tracked clients; the rest use new ids
+        double refillRate = 1000.0;             // Tokens per second per client
+        uint64_t seed = 42;
+        bool json = false;                      // Machine-readable output for regression tracking
+    };
+    
+    // One backend at one thread count
+    struct Result {
+        Backend backend;
+        size_t threads = 0;
+        uint64_t operations = 0;
+        uint64_t accepted = 0;
+        double seconds = 0.0;
+        double opsPerSec = 0.0;
+        double scaling = 0.0;                   // opsPerSec relative to the backend's first thread count
+        double p50Ns = 0.0;
+        double p99Ns = 0.0;
+        double p999Ns = 0.0;
+    };
+    
+    static constexpr size_t kMaxThreads = 64;
+
+private:
+    // Per-thread request sequences are replayed in a loop; slot value kMiss
+    // stands for a client the limiter has not seen yet
+    static constexpr size_t kSequenceLength = size_t(1) << 16;
+    static constexpr uint32_t kMiss = UINT32_MAX;
+    
+    // Only every kSampleEvery-th request is timed, so the clock reads do not
+    // dominate the throughput being measured
+    static constexpr uint64_t kSampleEvery = 16;
+    
+    BenchmarkConfig config_;
+    std::vector<std::string> clientIds_;
+
+public:
+    BenchmarkSuite() : BenchmarkSuite(BenchmarkConfig()) {}
+    
+    explicit BenchmarkSuite(const BenchmarkConfig& config) : config_(config) {
+        config_.numClients = std::max<size_t>(config_.numClients, 1);
+        for (size_t& threads : config_.threadCounts) {
+            threads = std::clamp<size_t>(threads, 1, kMaxThreads);
+        }
+        
+        clientIds_.reserve(config_.numClients);
+        for (size_t i = 0; i < config_.numClients; ++i) {
+            clientIds_.push_back("client-" + std::to_string(i));
+        }
+    }
+    
+    // Runs every backend at every thread count and prints the results
+    std::vector<Result> runAll() {
+        std::vector<Result> results;
+        for (Backend backend : config_.backends) {
+            double baseline = 0.0;
+            for (size_t threads : config_.threadCounts) {
+                Result result = run(backend, threads);
+                if (baseline == 0.0) {
+                    baseline = result.opsPerSec;
+                }
+                result.scaling = baseline > 0.0 ? result.opsPerSec / baseline : 0.0;
+                results.push_back(result);
+                
+                if (!config_.json) {
+                    printResult(result);
+                }
+            }
+        }
+        
+        if (config_.json) {
+            printJson(results);
+        }
+        return results;
+    }
+    
+    // One timed run on a fresh limiter
+    Result run(Backend backend, size_t threads) {
+        RateLimiterConfig limiterConfig;
+        limiterConfig.defaultBucketSize = config_.requestsPerClient;
+        limiterConfig.defaultRefillRate = config_.refillRate;
+        limiterConfig.maxClients = config_.hitRatio < 1.0 ? SIZE_MAX / 2 : config_.numClients;
+        limiterConfig.numShards = 64;
+        limiterConfig.bucketType = backend == Backend::LockFreeMap ? BucketType::LockFree : BucketType::Mutex;
+        limiterConfig.storageMode = backend == Backend::Compact ? StorageMode::Compact : StorageMode::Map;
+        if (backend == Backend::Compact && config_.hitRatio < 1.0) {
+            // The compact table is sized up front; leave room for the misses
+            limiterConfig.maxClients = config_.numClients + (size_t(1) << 22);
+        }
+        if (backend == Backend::Sketch) {
+            limiterConfig.maxClients = 0;
+            limiterConfig.sketchWidth = size_t(1) << 16;
+        }
+        RateLimiter limiter(limiterConfig);
+        
+        // Track every client up front so that only kMiss requests create buckets
+        for (const auto& clientId : clientIds_) {
+            limiter.allowRequest(clientId);
+        }
+        limiter.reset();
+        
+        std::vector<std::vector<uint32_t>> sequences;
+        for (size_t t = 0; t < threads; ++t) {
+            sequences.push_back(buildSequence(config_.seed + t));
+        }
+        
+        LatencyHistogram latencies;
+        std::vector<uint64_t> counts(threads, 0);
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+        std::atomic<bool> stop{false};
+        
+        auto worker = [&](size_t t) {
+            const auto& sequence = sequences[t];
+            char missId[32];
+            uint64_t missCounter = 0;
+            uint64_t ops = 0;
+            
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            
+            while (!stop.load(std::memory_order_relaxed)) {
+                // Check the stop flag once per block of requests
+                for (size_t i = 0; i < 256; ++i, ++ops) {
+                    uint32_t client = sequence[ops & (kSequenceLength - 1)];
+                    std::string_view clientId;
+                    if (client == kMiss) {
+                        int length = std::snprintf(missId, sizeof(missId), "miss-%zu-%llu", t,
+                                                   static_cast<unsigned long long>(missCounter++));
+                        clientId = std::string_view(missId, static_cast<size_t>(length));
+                    } else {
+                        clientId = clientIds_[client];
+                    }
+                    
+                    if (ops % kSampleEvery == 0) {
+                        auto start = std::chrono::steady_clock::now();
+                        limiter.allowRequest(clientId);
+                        auto elapsed = std::chrono::steady_clock::now() - start;
+                        latencies.record(static_cast<uint64_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+                    } else {
+                        limiter.allowRequest(clientId);
+                    }
+                }
+            }
+            counts[t] = ops;
+        };
+        
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back(worker, t);
+        }
+        while (ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        std::this_thread::sleep_for(config_.testDuration);
+        stop.store(true, std::memory_order_relaxed);
+        for (auto& thread : workers) {
+            thread.join();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        
+        Result result;
+        result.backend = backend;
+        result.threads = threads;
+        for (uint64_t count : counts) {
+            result.operations += count;
+        }
+        result.accepted = limiter.getStatistics().acceptedRequests;
+        result.seconds = std::chrono::duration<double>(elapsed).count();
+        result.opsPerSec = result.seconds > 0.0 ? static_cast<double>(result.operations) / result.seconds : 0.0;
+        
+        auto percentiles = latencies.percentiles({50.0, 99.0, 99.9});
+        result.p50Ns = percentiles[0];
+        result.p99Ns = percentiles[1];
+        result.p999Ns = percentiles[2];
+        return result;
+    }
+    
+    // Functional checks of the limiter's core guarantees, run by --test.
+    // Returns the number of failed checks.
+    static int runFunctionalTests() {
+        int failures = 0;
+        auto check = [&failures](const char* name, bool passed) {
+            std::cout << (passed ? "[PASS] " : "[FAIL] ") << name << "\n";
+            failures += passed ? 0 : 1;
+        };
+        
+        for (BucketType type : {BucketType::Mutex, BucketType::LockFree, BucketType::Gcra}) {
+            const char* prefix = type == BucketType::Mutex      ? "mutex: "
+                               : type == BucketType::LockFree ? "lock-free: "
+                                                              : "gcra: ";
+            auto clock = std::make_shared<ManualClock>();
+            RateLimiterConfig config;
+            config.defaultBucketSize = 10;
+            config.defaultRefillRate = 5.0;
+            config.bucketType = type;
+            config.clock = clock;
+            config.clientLimits["premium"] = {20, 5.0};
+            RateLimiter limiter(config);
+            
+            size_t allowed = 0;
+            for (int i = 0; i < 15; ++i) {
+                allowed += limiter.allowRequest("burst") ? 1 : 0;
+            }
+            check((std::string(prefix) + "burst capped at bucket size").c_str(), allowed == 10);
+            
+            clock->advance(std::chrono::seconds(1));
+            allowed = 0;
+            for (int i = 0; i < 10; ++i) {
+                allowed += limiter.allowRequest("burst") ? 1 : 0;
+            }
+            check((std::string(prefix) + "refill at configured rate").c_str(), allowed == 5);
+            
+            auto delay = limiter.tryAcquireOrDelay("burst");
+            check((std::string(prefix) + "delay matches refill time").c_str(),
+                  delay > std::chrono::milliseconds(150) && delay <= std::chrono::milliseconds(200));
+            
+            allowed = 0;
+            for (int i = 0; i < 25; ++i) {
+                allowed += limiter.allowRequest("premium") ? 1 : 0;
+            }
+            check((std::string(prefix) + "per-client limit").c_str(), allowed == 20);
+            
+            limiter.updateClientLimit("premium", 40, 5.0);
+            clock->advance(std::chrono::seconds(2));
+            allowed = 0;
+            for (int i = 0; i < 40; ++i) {
+                allowed += limiter.allowRequest("premium") ? 1 : 0;
+            }
+            check((std::string(prefix) + "limit update applies in place").c_str(), allowed == 20);
+            
+            // Same for a client only ever seen through the batch API
+            std::vector<ClientKey> batch(10, ClientKey("batched"));
+            std::vector<uint8_t> results(batch.size());
+            limiter.allowRequestBatch(batch, results);
+            limiter.updateClientLimit("batched", 10, 20.0);
+            limiter.allowRequestBatch(std::span(batch).first(1), results);
+            clock->advance(std::chrono::milliseconds(500));
+            check((std::string(prefix) + "limit update applies to batched clients").c_str(),
+                  limiter.allowRequestBatch(batch, results) == 10);
+        }
+        
+        {
+            // Concurrent callers on one client never exceed its tokens
+            RateLimiterConfig config;
+            config.defaultBucketSize = 1000;
+            config.defaultRefillRate = 0.0;
+            config.bucketType = BucketType::LockFree;
+            RateLimiter limiter(config);
+            std::atomic<size_t> allowed{0};
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 8; ++t) {
+                threads.emplace_back([&]() {
+                    for (int i = 0; i < 500; ++i) {
+                        if (limiter.allowRequest("shared")) {
+                            allowed.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            check("concurrent consumers stay within the bucket", allowed.load() == 1000);
+        }
+        
+        {
+            RateLimiterConfig config;
+            config.defaultBucketSize = 10;
+            config.defaultRefillRate = 0.0;
+            config.clientParents["user"] = "tenant";
+            config.clientLimits["tenant"] = {4, 0.0};
+            RateLimiter limiter(config);
+            size_t allowed = 0;
+            for (int i = 0; i < 10; ++i) {
+                allowed += limiter.allowRequest("user") ? 1 : 0;
+            }
+            check("parent limit caps the child", allowed == 4);
+        }
+        
+        {
+            // Partial grants: the parent's 6 tokens cap the child's 10, and
+            // every request is counted by its tokens
+            bool granted = true;
+            for (BucketType type : {BucketType::Mutex, BucketType::LockFree, BucketType::Gcra,
+                                    BucketType::SlidingWindow}) {
+                RateLimiterConfig config;
+                config.defaultBucketSize = 10;
+                config.defaultRefillRate = 0.0;
+                config.bucketType = type;
+                config.clientParents["stream"] = "tenant";
+                config.clientLimits["tenant"] = {6, 0.0};
+                RateLimiter limiter(config);
+                size_t first = limiter.allowRequestsUpTo("stream", 4);
+                size_t second = limiter.allowRequestsUpTo("stream", 4);
+                size_t third = limiter.allowRequestsUpTo("stream", 4);
+                bool weighted = limiter.allowRequests("other", 3);
+                auto stats = limiter.getStatistics();
+                granted = granted && first == 4 && second == 2 && third == 0 && weighted &&
+                          limiter.getClientStatistics("stream").tokensRemaining == 4 &&
+                          stats.acceptedRequests == 3 && stats.requestedTokens == 15 && stats.grantedTokens == 9;
+            }
+            check("weighted requests grant up to the tokens available", granted);
+        }
+        
+        {
+            // 10 per 1 s window; half-way through the next window half of
+            // the previous count still applies
+            auto clock = std::make_shared<ManualClock>();
+            RateLimiterConfig config;
+            config.defaultBucketSize = 10;
+            config.defaultRefillRate = 10.0;
+            config.clock = clock;
+            config.clientBucketTypes["smooth"] = BucketType::SlidingWindow;
+            RateLimiter limiter(config);
+            size_t allowed = 0;
+            for (int i = 0; i < 15; ++i) {
+                allowed += limiter.allowRequest("smooth") ? 1 : 0;
+            }
+            clock->advance(std::chrono::milliseconds(1500));
+            for (int i = 0; i < 15; ++i) {
+                allowed += limiter.allowRequest("smooth") ? 1 : 0;
+            }
+            auto delay = limiter.tryAcquireOrDelay("smooth");
+            check("sliding window weighs the previous window",
+                  allowed == 15 && delay > std::chrono::milliseconds(0) && delay <= std::chrono::milliseconds(100) &&
+                  limiter.getClientStatistics("smooth").tokensRemaining == 0);
+        }
+        
+        {
+            RateLimiterConfig config;
+            config.defaultBucketSize = 5;
+            config.defaultRefillRate = 0.0;
+            config.storageMode = StorageMode::Compact;
+            RateLimiter limiter(config);
+            size_t allowed = 0;
+            for (int i = 0; i < 8; ++i) {
+                allowed += limiter.allowRequest("compact") ? 1 : 0;
+            }
+            check("compact storage enforces the limit", allowed == 5);
+            
+            // Repeated keys in one batch fall back to the scalar path
+            std::vector<ClientKey> keys;
+            for (int i = 0; i < 40; ++i) {
+                keys.emplace_back(i % 2 ? "batch-a" : "batch-b");
+            }
+            std::vector<uint8_t> results(keys.size());
+            check("compact batch enforces the limit per key", limiter.allowRequestBatch(keys, results) == 10);
+        }
+        
+        {
+            // A slot idle past the 32-bit tick wrap (~36 h) must not look fresh
+            auto clock = std::make_shared<ManualClock>();
+            RateLimiterConfig config;
+            config.defaultBucketSize = 5;
+            config.defaultRefillRate = 1.0;
+            config.storageMode = StorageMode::Compact;
+            config.cleanupInterval = std::chrono::hours(72);
+            config.clock = clock;
+            RateLimiter limiter(config);
+            limiter.allowRequests("sleeper", 5);
+            clock->advance(std::chrono::hours(20));
+            limiter.cleanup();
+            const size_t evicted = limiter.getStatistics().activeClients;
+            clock->advance(std::chrono::hours(20));
+            check("compact slots idle past the tick wrap refill", evicted == 0 && limiter.allowRequests("sleeper", 5));
+        }
+        
+        {
+            // Steady churn at under half load must not grow the probe runs
+            ManualClock clock;
+            CompactBucketTable table(64, 1, 10, 1.0, &clock);
+            const auto now = clock.now();
+            bool found = true;
+            for (uint64_t i = 0; i < 20000; ++i) {
+                table.insert(i, table.defaultPolicy(), now);
+                if (i >= 40) {
+                    table.erase(i - 40);
+                }
+                if (i % 1000 == 999) {
+                    for (uint64_t live = i - 39; live <= i; ++live) {
+                        found = found && table.consume(live, 0, now) != CompactBucketTable::Result::Missing;
+                    }
+                    found = found && table.consume(i - 40, 0, now) == CompactBucketTable::Result::Missing;
+                }
+            }
+            check("compact deletes keep probe runs short", found && table.longestRun() < table.slotCount() / 4);
+        }
+        
+        {
+            RateLimiterConfig config;
+            config.clientLimits["fixed"] = {100, 0.0};
+            BasicRateLimiter<FixedLimitBuckets<3, 0.0>, MapStorage, NoMetrics, DirectSteadyClock> limiter(config);
+            size_t allowed = 0;
+            for (int i = 0; i < 6; ++i) {
+                allowed += limiter.allowRequest("fixed") ? 1 : 0;
+            }
+            check("fixed-limit policy ignores per-client limits",
+                  allowed == 3 && limiter.getStatistics().totalRequests == 0 &&
+                  limiter.getLatencyPercentiles() == std::vector<double>(5, 0.0) &&
+                  limiter.exportMetrics().find("ratelimiter_request_duration_seconds_count 0\n") != std::string::npos);
+        }
+        
+        {
+            // Clients past maxClients are limited by the sketch, not rejected
+            auto clock = std::make_shared<ManualClock>();
+            RateLimiterConfig config;
+            config.defaultBucketSize = 5;
+            config.defaultRefillRate = 5.0;
+            config.maxClients = 1;
+            config.sketchWidth = 1024;
+            config.clock = clock;
+            bool limited = true;
+            for (StorageMode mode : {StorageMode::Map, StorageMode::Compact}) {
+                config.storageMode = mode;
+                RateLimiter limiter(config);
+                limiter.allowRequest("tracked");
+                size_t allowed = 0;
+                for (int i = 0; i < 8; ++i) {
+                    allowed += limiter.allowRequest("untracked") ? 1 : 0;
+                }
+                clock->advance(std::chrono::seconds(2));
+                for (int i = 0; i < 8; ++i) {
+                    allowed += limiter.allowRequest("untracked") ? 1 : 0;
+                }
+                limited = limited && allowed == 10;
+            }
+            check("sketch limits clients past maxClients", limited);
+        }
+        
+        {
+            // Compact slots cannot hold 2^24 tokens, so such limits are refused
+            RateLimiterConfig config;
+            config.storageMode = StorageMode::Compact;
+            config.defaultBucketSize = size_t(1) << 24;
+            bool refused = false;
+            try {
+                RateLimiter limiter(config);
+            } catch (const std::runtime_error&) {
+                refused = true;
+            }
+            
+            config.defaultBucketSize = 10;
+            config.defaultRefillRate = 0.0;
+            RateLimiter limiter(config);
+            bool updateRefused = false;
+            try {
+                limiter.updateClientLimit("big", size_t(1) << 24, 0.0);
+            } catch (const std::runtime_error&) {
+                updateRefused = true;
+            }
+            check("compact mode refuses oversized buckets",
+                  refused && updateRefused && limiter.allowRequests("big", 10) && !limiter.allowRequest("big"));
+        }
+        
+        {
+            // The heaviest rejected client heads the export
+            RateLimiterConfig config;
+            config.defaultBucketSize = 1;
+            config.defaultRefillRate = 0.0;
+            config.topRejectedClients = 2;
+            RateLimiter limiter(config);
+            for (int i = 0; i < 10; ++i) {
+                limiter.allowRequest("noisy");
+                limiter.allowRequest(i % 2 ? "quiet" : "noisy");
+            }
+            auto top = limiter.getTopRejectedClients(1);
+            std::string text = limiter.exportMetrics();
+            check("metrics export ranks rejected clients",
+                  top.size() == 1 && top[0].clientId == "noisy" && top[0].count == 14 &&
+                  text.find("ratelimiter_requests_total{outcome=\"rejected\"} 18\n") != std::string::npos &&
+                  text.find("ratelimiter_request_duration_seconds_count 20\n") != std::string::npos &&
+                  text.find("_bucket{le=\"0.000000255\"}") != std::string::npos &&
+                  text.find("_bucket{le=\"17.179869183\"}") != std::string::npos &&
+                  text.find("ratelimiter_top_rejected_requests{client=\"noisy\"} 14\n") != std::string::npos);
+        }
+        
+        {
+            // Queued acquires resume in FIFO order as tokens refill, whether
+            // callbacks or coroutines, and the timer job stops once none wait
+            struct DetachedTask {
+                struct promise_type {
+                    DetachedTask get_return_object() { return {}; }
+                    std::suspend_never initial_suspend() noexcept { return {}; }
+                    std::suspend_never final_suspend() noexcept { return {}; }
+                    void return_void() {}
+                    void unhandled_exception() { std::terminate(); }
+                };
+            };
+            
+            std::mutex orderMutex;
+            std::vector<int> order;
+            auto finish = [&](int id, bool acquired) {
+                std::lock_guard<std::mutex> lock(orderMutex);
+                order.push_back(acquired ? id : -id);
+            };
+            auto eventually = [](auto condition) {
+                for (int i = 0; i < 2000 && !condition(); ++i) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                return condition();
+            };
+            auto served = [&](size_t count) {
+                return eventually([&]() {
+                    std::lock_guard<std::mutex> lock(orderMutex);
+                    return order.size() >= count;
+                });
+            };
+            
+            auto clock = std::make_shared<ManualClock>();
+            auto scheduler = std::make_shared<MaintenanceScheduler>();
+            RateLimiterConfig config;
+            config.defaultBucketSize = 1;
+            config.defaultRefillRate = 10.0;
+            config.clock = clock;
+            config.scheduler = scheduler;
+            RateLimiter limiter(config);
+            const size_t idleTasks = scheduler->taskCount();
+            
+            limiter.allowRequest("queued");
+            for (int id = 1; id <= 2; ++id) {
+                limiter.acquireAsync("queued", 1, [&finish, id](bool acquired) { finish(id, acquired); });
+            }
+            auto waiter = [](RateLimiter& limiter, decltype(finish)& finish) -> DetachedTask {
+                finish(3, co_await limiter.acquire("queued"));
+            };
+            waiter(limiter, finish);
+            const bool ticking = scheduler->taskCount() == idleTasks + 1;
+            
+            bool inTurn = true;
+            for (size_t i = 1; i <= 3; ++i) {
+                clock->advance(std::chrono::milliseconds(101));   // Just past each refill
+                inTurn = inTurn && served(i);
+            }
+            {
+                std::lock_guard<std::mutex> lock(orderMutex);
+                inTurn = inTurn && order == std::vector<int>{1, 2, 3};
+            }
+            check("queued acquires resume in order", ticking && inTurn);
+            check("acquire timer stops once queues drain",
+                  eventually([&]() { return scheduler->taskCount() == idleTasks; }));
+        }
+        
+        {
+            // Snapshots carry token counts across a restart; damaged files are refused
+            const std::string path = "/tmp/ratelimiter-test-snapshot.bin";
+            RateLimiterConfig config;
+            config.defaultBucketSize = 10;
+            config.defaultRefillRate = 0.0;
+            bool restored = true;
+            for (StorageMode mode : {StorageMode::Map, StorageMode::Compact}) {
+                config.storageMode = mode;
+                {
+                    RateLimiter limiter(config);
+                    limiter.allowRequests("saved", 3);
+                    restored = restored && limiter.saveSnapshot(path);
+                }
+                RateLimiter limiter(config);
+                restored = restored && limiter.loadSnapshot(path) && limiter.allowRequests("saved", 7) &&
+                           !limiter.allowRequest("saved");
+            }
+            
+            config.storageMode = StorageMode::Map;
+            bool refused = true;
+            auto corrupt = [&](size_t offset, uint64_t value) {
+                {
+                    RateLimiter limiter(config);
+                    limiter.allowRequest("saved");
+                    limiter.saveSnapshot(path);
+                }
+                std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+                file.seekp(static_cast<std::streamoff>(offset));
+                file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+                file.close();
+                RateLimiter limiter(config);
+                refused = refused && !limiter.loadSnapshot(path);
+            };
+            corrupt(offsetof(SnapshotHeader, magic), 0);
+            corrupt(offsetof(SnapshotHeader, recordCount), 1000);
+            corrupt(sizeof(SnapshotHeader) + offsetof(SnapshotRecord, keyOffset), UINT64_MAX);
+            std::remove(path.c_str());
+            check("snapshot round trip restores tokens", restored);
+            check("snapshot load refuses damaged files", refused);
+        }
+        
+        {
+            // Reloading keeps the tokens of clients whose limits did not change
+            const std::string path = "/tmp/ratelimiter-test-config.json";
+            auto write = [&](const std::string& text) {
+                std::ofstream(path, std::ios::trunc) << text;
+            };
+            write(R"({"defaultBucketSize": 3, "defaultRefillRate": 0, "ignored": [1, {"a": null}],
+                      "clientLimits": {"steady": {"bucketSize": 4, "refillRate": 0},
+                                       "premium": {"bucketSize": 10, "refillRate": 0}}})");
+            RateLimiterConfig config = ConfigFileReader::load(path);
+            RateLimiter limiter(config);
+            limiter.allowRequests("steady", 2);
+            limiter.allowRequests("premium", 5);
+            
+            write(R"({"clientLimits": {"steady": {"bucketSize": 4, "refillRate": 0},
+                                       "premium": {"bucketSize": 20, "refillRate": 0},
+                                       "new\u00e9": {"bucketSize": 1, "refillRate": 0}}})");
+            size_t changed = limiter.reloadClientLimits(path);
+            bool kept = limiter.allowRequests("steady", 2) && !limiter.allowRequest("steady") &&
+                        limiter.allowRequests("premium", 10) && !limiter.allowRequest("premium") &&
+                        limiter.allowRequest("new\xc3\xa9") && !limiter.allowRequest("new\xc3\xa9");
+            
+            write(R"({"clientLimits": {"steady": {"bucketSize": 4}}})");
+            bool rejected = false;
+            try {
+                limiter.reloadClientLimits(path);
+            } catch (const std::runtime_error&) {
+                rejected = true;
+            }
+            std::remove(path.c_str());
+            check("config reload swaps only changed limits",
+                  config.defaultBucketSize == 3 && config.clientLimits.size() == 2 && changed == 2 && kept &&
+                  rejected && limiter.getClientStatistics("premium").bucketSize == 20);
+        }
+
+        {
+            // Random slots, including full, empty and wrapped ones
+            std::mt19937 rng(7);
+            RefillLanes lanes;
+            for (size_t i = 0; i < RefillLanes::kMaxLanes; ++i) {
+                lanes.capacity[i] = rng() % 4 ? rng() % (1u << 20) : rng();
+                lanes.tokens[i] = rng() % 3 ? lanes.capacity[i] / (1 + rng() % 4) : lanes.capacity[i];
+                lanes.last[i] = rng() % 4 ? 100000 - rng() % 100000 : rng();
+                lanes.needed[i] = rng() % 2 ? 256 : rng() % 4096;
+                lanes.unitsPerTick[i] = std::ldexp(static_cast<double>(rng() % 100000), -static_cast<int>(rng() % 20));
+            }
+            RefillLanes expected = lanes;
+            RefillKernels::scalar(expected, RefillLanes::kMaxLanes, 100000);
+            bool same = true;
+            for (const auto& [name, kernel] : RefillKernels::available()) {
+                RefillLanes actual = lanes;
+                kernel(actual, RefillLanes::kMaxLanes, 100000);
+                same = same && std::equal(actual.newTokens, actual.newTokens + RefillLanes::kMaxLanes, expected.newTokens) &&
+                       std::equal(actual.newLast, actual.newLast + RefillLanes::kMaxLanes, expected.newLast) &&
+                       std::equal(actual.allowed, actual.allowed + RefillLanes::kMaxLanes, expected.allowed);
+            }
+            check("vector refill matches scalar", same);
+        }
+        
+        std::cout << (failures == 0 ? "All tests passed\n" : "Some tests failed\n");
+        return failures;
+    }
+    
+    static const char* backendName(Backend backend) {
+        switch (backend) {
+            case Backend::LockFreeMap:
+                return "lockfree-map";
+            case Backend::Compact:
+                return "compact";
+            case Backend::Sketch:
+                return "sketch";
+            case Backend::MutexMap:
+            default:
+                return "mutex-map";
+        }
+    }
+    
+    static const char* distributionName(Distribution distribution) {
+        switch (distribution) {
+            case Distribution::Zipf:
+                return "zipf";
+            case Distribution::HotKey:
+                return "hot";
+            case Distribution::Uniform:
+            default:
+                return "uniform";
+        }
+    }
+
+private:
+    std::vector<uint32_t> buildSequence(uint64_t seed) const {
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        std::vector<uint32_t> sequence(kSequenceLength);
+        
+        // Zipf ranks are drawn by inverting the cumulative weights
+        std::vector<double> cumulative;
+        if (config_.distribution == Distribution::Zipf) {
+            cumulative.resize(config_.numClients);
+            double sum = 0.0;
+            for (size_t k = 0; k < config_.numClients; ++k) {
+                sum += 1.0 / std::pow(static_cast<double>(k + 1), config_.zipfExponent);
+                cumulative[k] = sum;
+            }
+            for (double& value : cumulative) {
+                value /= sum;
+            }
+        }
+        
+        std::uniform_int_distribution<uint32_t> uniform(0, static_cast<uint32_t>(config_.numClients - 1));
+        for (auto& client : sequence) {
+            if (unit(rng) >= config_.hitRatio) {
+                client = kMiss;
+                continue;
+            }
+            switch (config_.distribution) {
+                case Distribution::Zipf:
+                    client = static_cast<uint32_t>(
+                        std::lower_bound(cumulative.begin(), cumulative.end(), unit(rng)) - cumulative.begin());
+                    client = std::min<uint32_t>(client, static_cast<uint32_t>(config_.numClients - 1));
+                    break;
+                case Distribution::HotKey:
+                    client = 0;
+                    break;
+                case Distribution::Uniform:
+                default:
+                    client = uniform(rng);
+                    break;
+            }
+        }
+        return sequence;
+    }
+    
+    void printResult(const Result& result) const {
+        std::cout << std::left << std::setw(14) << backendName(result.backend)
+                  << std::right << std::setw(4) << result.threads << " threads  "
+                  << std::fixed << std::setprecision(0) << std::setw(12) << result.opsPerSec << " ops/s  "
+                  << std::setprecision(2) << std::setw(6) << result.scaling << "x  "
+                  << "p50 " << std::setprecision(0) << std::setw(6) << result.p50Ns << " ns  "
+                  << "p99 " << std::setw(7) << result.p99Ns << " ns  "
+                  << "p99.9 " << std::setw(8) << result.p999Ns << " ns  "
+                  << "accepted " << std::setprecision(1)
+                  << (result.operations > 0 ? 100.0 * result.accepted / result.operations : 0.0) << "%\n";
+    }
+    
+    // Stable schema: keys always present and in this order
+    void printJson(const std::vector<Result>& results) const {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\n  \"schemaVersion\": 1,\n  \"config\": {"
+            << "\"clients\": " << config_.numClients
+            << ", \"requestsPerClient\": " << config_.requestsPerClient
+            << ", \"refillRate\": " << config_.refillRate
+            << ", \"durationMs\": " << config_.testDuration.count()
+            << ", \"distribution\": \"" << distributionName(config_.distribution) << "\""
+            << ", \"zipfExponent\": " << config_.zipfExponent
+            << ", \"hitRatio\": " << config_.hitRatio
+            << ", \"seed\": " << config_.seed << "},\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            out << (i ? ",\n    " : "\n    ")
+                << "{\"backend\": \"" << backendName(r.backend) << "\""
+                << ", \"threads\": " << r.threads
+                << ", \"operations\": " << r.operations
+                << ", \"accepted\": " << r.accepted
+                << ", \"seconds\": " << r.seconds
+                << ", \"opsPerSec\": " << r.opsPerSec
+                << ", \"opsPerSecPerThread\": " << r.opsPerSec / static_cast<double>(r.threads)
+                << ", \"scaling\": " << r.scaling
+                << ", \"latencyNs\": {\"p50\": " << r.p50Ns
+                << ", \"p99\": " << r.p99Ns
+                << ", \"p999\": " << r.p999Ns << "}}";
+        }
+        out << "\n  ]\n}\n";
+        std::cout << out.str();
     }
+};
+
+// Per-operation cost of the hot path pieces, with hardware counters. Each
+// operation runs on every thread count; at more than one thread all threads
+// hit the same bucket or map, which shows cross-core cache traffic.
+class MicroBenchmark {
+public:
+    struct MicroConfig {
+        size_t iterations = 1000000;            // Per operation and thread
+        std::vector<size_t> threadCounts{1};    // Each clamped to [1, 64]
+        uint64_t transferEvent = 0;             // PERF_TYPE_RAW config for cache-line transfers
+        bool json = false;
+    };
+    
+    struct Result {
+        std::string operation;
+        size_t threads = 0;
+        uint64_t operations = 0;
+        double nsPerOp = 0.0;
+        PerfCounters::Reading counters;         // Summed over threads
+    };
 
 private:
-    bool allowRequestInternal(const std::string& clientId) {
-        TokenBucket* bucket = getOrCreateBucket(clientId);
-        return bucket ? bucket->consume() : false;
+    static constexpr size_t kClients = 1024;
+    static constexpr size_t kMaxMisses = size_t(1) << 20;   // New ids per run, across threads
+    
+    MicroConfig config_;
+
+public:
+    MicroBenchmark() : MicroBenchmark(MicroConfig()) {}
+    
+    explicit MicroBenchmark(const MicroConfig& config) : config_(config) {
+        config_.iterations = std::max<size_t>(config_.iterations, 1);
+        for (size_t& threads : config_.threadCounts) {
+            threads = std::clamp<size_t>(threads, 1, BenchmarkSuite::kMaxThreads);
+        }
     }
     
-    TokenBucket* getOrCreateBucket(const std::string& clientId) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
+    std::vector<Result> runAll() {
+        std::vector<Result> results;
+        for (size_t threads : config_.threadCounts) {
+            results.push_back(benchTokenBucketConsume(threads));
+            results.push_back(benchAtomicBucketConsume(threads));
+            results.push_back(benchFixedBucketConsume(threads));
+            results.push_back(benchGcraBucketConsume(threads));
+            results.push_back(benchSlidingWindowConsume(threads));
+            results.push_back(benchRefillTokens(threads));
+            results.push_back(benchBucketLookup(threads, true));
+            results.push_back(benchBucketLookup(threads, false));
+            results.push_back(benchHotKey(threads));
+            results.push_back(benchLatencyPercentiles(threads));
+        }
         
-        auto it = clients_.find(clientId);
-        if (it != clients_.end()) {
-            return it->second.get();
+        if (config_.json) {
+            printJson(results);
+        } else {
+            printTable(results);
         }
+        return results;
+    }
+
+private:
+    // Runs body(thread, iterations) on each thread between a shared start and
+    // a join, each thread counting only its own work
+    template <typename Body>
+    Result measure(const std::string& operation, size_t threads, size_t iterations, Body body) {
+        std::vector<PerfCounters::Reading> readings(threads);
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
         
-        // Check if we've reached the maximum number of clients
-        if (clients_.size() >= config_.maxClients) {
-            return nullptr;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                PerfCounters counters(config_.transferEvent);
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                counters.start();
+                body(t, iterations);
+                readings[t] = counters.stop();
+            });
+        }
+        while (ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& worker : workers) {
+            worker.join();
         }
+        auto elapsed = std::chrono::steady_clock::now() - start;
         
-        // Get client-specific limits or use defaults
-        size_t bucketSize = config_.defaultBucketSize;
-        double refillRate = config_.defaultRefillRate;
+        Result result;
+        result.operation = operation;
+        result.threads = threads;
+        result.operations = static_cast<uint64_t>(iterations) * threads;
+        // Wall time across all threads, so contention shows up as a higher cost
+        result.nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() * threads /
+                         static_cast<double>(result.operations);
+        for (const auto& reading : readings) {
+            result.counters += reading;
+        }
+        return result;
+    }
+    
+    // Sized so the bucket never runs dry during a run
+    static constexpr size_t kLargeBucket = size_t(1) << 30;
+    
+    Result benchTokenBucketConsume(size_t threads) {
+        TokenBucket bucket(kLargeBucket, 1e9);
+        return measure("TokenBucket::consume", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                bucket.consume(1);
+            }
+        });
+    }
+    
+    Result benchAtomicBucketConsume(size_t threads) {
+        AtomicTokenBucket bucket(kLargeBucket, 1e9);
+        return measure("AtomicTokenBucket::consume", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                bucket.consume(1);
+            }
+        });
+    }
+    
+    // Same bucket with its limits as template constants
+    Result benchFixedBucketConsume(size_t threads) {
+        BasicAtomicTokenBucket<FixedBucketLimits<kLargeBucket, 1e9>> bucket(kLargeBucket, 1e9);
+        return measure("FixedLimitBucket::consume", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                bucket.consume(1);
+            }
+        });
+    }
+    
+    Result benchGcraBucketConsume(size_t threads) {
+        GcraBucket bucket(kLargeBucket, 1e9);
+        return measure("GcraBucket::consume", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                bucket.consume(1);
+            }
+        });
+    }
+    
+    Result benchSlidingWindowConsume(size_t threads) {
+        SlidingWindowBucket bucket(kLargeBucket, 1e9);
+        return measure("SlidingWindowBucket::consume", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                bucket.consume(1);
+            }
+        });
+    }
+    
+    // A new timestamp on every call, so each one credits tokens. Taken under
+    // the bucket's lock as consume() does; with several threads the shared
+    // timestamp counter adds traffic of its own.
+    Result benchRefillTokens(size_t threads) {
+        TokenBucket bucket(kLargeBucket, 1e6);
+        const auto base = std::chrono::steady_clock::now();
+        std::atomic<int64_t> tick{0};
+        return measure("TokenBucket::refillTokens", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                auto now = base + std::chrono::nanoseconds(tick.fetch_add(1000, std::memory_order_relaxed));
+                std::lock_guard<std::mutex> lock(bucket.mutex_);
+                bucket.refillTokens(now);
+            }
+        });
+    }
+    
+    // Hits cycle over tracked clients; misses use ids never seen before
+    Result benchBucketLookup(size_t threads, bool hit) {
+        RateLimiterConfig limiterConfig;
+        limiterConfig.maxClients = SIZE_MAX / 2;
+        limiterConfig.numShards = 64;
+        RateLimiter limiter(limiterConfig);
         
-        auto limitIt = config_.clientLimits.find(clientId);
-        if (limitIt != config_.clientLimits.end()) {
-            bucketSize = limitIt->second.first;
-            refillRate = limitIt->second.second;
+        std::vector<std::string> clientIds;
+        for (size_t i = 0; i < kClients; ++i) {
+            clientIds.push_back("client-" + std::to_string(i));
+            limiter.getOrCreateBucket(ClientKey(clientIds.back()));
         }
         
-        auto bucket = std::make_unique<TokenBucket>(bucketSize, refillRate);
-        TokenBucket* bucketPtr = bucket.get();
+        const size_t iterations = hit ? config_.iterations : std::min(config_.iterations, kMaxMisses / threads);
+        std::vector<std::vector<std::string>> missIds(hit ? 0 : threads);
+        for (size_t t = 0; t < missIds.size(); ++t) {
+            missIds[t].reserve(iterations);
+            for (size_t i = 0; i < iterations; ++i) {
+                missIds[t].push_back("miss-" + std::to_string(t) + "-" + std::to_string(i));
+            }
+        }
         
-        clients_[clientId] = std::move(bucket);
-        stats_.activeClients++;
+        return measure(hit ? "getOrCreateBucket (hit)" : "getOrCreateBucket (miss)", threads, iterations,
+                       [&](size_t t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                const std::string& clientId = hit ? clientIds[(i * 7 + t) % kClients] : missIds[t][i];
+                limiter.getOrCreateBucket(ClientKey(clientId));
+            }
+        });
+    }
+    
+    // Every thread on one client through the public entry point: the shard's
+    // shared lock and the bucket's line are the only shared state
+    Result benchHotKey(size_t threads) {
+        RateLimiterConfig limiterConfig;
+        limiterConfig.defaultBucketSize = kLargeBucket;
+        limiterConfig.defaultRefillRate = 1e9;
+        RateLimiter limiter(limiterConfig);
+        limiter.allowRequest("hot");
         
-        return bucketPtr;
+        return measure("allowRequest (hot key)", threads, config_.iterations, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                limiter.allowRequest("hot");
+            }
+        });
     }
     
-    void startCleanupThread() {
-        cleanupThread_ = std::make_unique<std::thread>([this]() {
-            while (!shutdownFlag_.load()) {
-                std::this_thread::sleep_for(config_.cleanupInterval);
-                if (!shutdownFlag_.load()) {
-                    cleanup();
-                }
+    Result benchLatencyPercentiles(size_t threads) {
+        RateLimiter limiter;
+        for (size_t i = 0; i < 100000; ++i) {
+            limiter.latencyHistogram_.record(100 + (i * 37) % 100000);
+        }
+        
+        // Each call merges every stripe, so far fewer iterations
+        const size_t iterations = std::max<size_t>(config_.iterations / 1000, 100);
+        std::atomic<double> sink{0.0};
+        return measure("getLatencyPercentiles", threads, iterations, [&](size_t, size_t n) {
+            double sum = 0.0;
+            for (size_t i = 0; i < n; ++i) {
+                sum += limiter.getLatencyPercentiles()[0];
             }
+            sink.store(sum, std::memory_order_relaxed);
         });
     }
     
-    void shutdown() {
-        shutdownFlag_ = true;
-        if (cleanupThread_ && cleanupThread_->joinable()) {
-            cleanupThread_->join();
+    static std::string perOp(const Result& result, PerfCounters::Counter counter, int precision) {
+        if (!result.counters.valid[counter]) {
+            return "n/a";
+        }
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(precision)
+            << result.counters.values[counter] / static_cast<double>(result.operations);
+        return out.str();
+    }
+    
+    void printTable(const std::vector<Result>& results) const {
+        std::cout << std::left << std::setw(28) << "operation" << std::right << std::setw(8) << "threads"
+                  << std::setw(10) << "ns/op" << std::setw(10) << "cycles" << std::setw(10) << "instr"
+                  << std::setw(8) << "IPC" << std::setw(10) << "LLC-miss" << std::setw(10) << "xfers" << "\n";
+        for (const auto& r : results) {
+            std::string ipc = "n/a";
+            if (r.counters.valid[PerfCounters::Cycles] && r.counters.valid[PerfCounters::Instructions] &&
+                r.counters.values[PerfCounters::Cycles] > 0) {
+                std::ostringstream out;
+                out << std::fixed << std::setprecision(2)
+                    << r.counters.values[PerfCounters::Instructions] / r.counters.values[PerfCounters::Cycles];
+                ipc = out.str();
+            }
+            std::cout << std::left << std::setw(28) << r.operation << std::right << std::setw(8) << r.threads
+                      << std::fixed << std::setprecision(1) << std::setw(10) << r.nsPerOp
+                      << std::setw(10) << perOp(r, PerfCounters::Cycles, 1)
+                      << std::setw(10) << perOp(r, PerfCounters::Instructions, 1)
+                      << std::setw(8) << ipc
+                      << std::setw(10) << perOp(r, PerfCounters::LlcMisses, 3)
+                      << std::setw(10) << perOp(r, PerfCounters::CacheLineTransfers, 3) << "\n";
         }
     }
     
-    std::string getCurrentTimestamp() const {
-        auto now = std::chrono::system_clock::now();
-        auto time_t = std::chrono::system_clock::to_time_t(now);
-        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            now.time_since_epoch()) % 1000;
+    // Per-op counter values; null where a counter was unavailable
+    void printJson(const std::vector<Result>& results) const {
+        static const char* const kNames[PerfCounters::kCounterCount] = {
+            "cycles", "instructions", "llcMisses", "cacheLineTransfers"
+        };
         
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&time_t), "%H:%M:%S");
-        ss << '.' << std::setfill('0') << std::setw(3) << ms.count();
-        return ss.str();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\n  \"schemaVersion\": 1,\n  \"iterations\": " << config_.iterations << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            out << (i ? ",\n    " : "\n    ")
+                << "{\"operation\": \"" << r.operation << "\""
+                << ", \"threads\": " << r.threads
+                << ", \"operations\": " << r.operations
+                << ", \"nsPerOp\": " << r.nsPerOp;
+            for (size_t c = 0; c < PerfCounters::kCounterCount; ++c) {
+                out << ", \"" << kNames[c] << "PerOp\": ";
+                if (r.counters.valid[c]) {
+                    out << r.counters.values[c] / static_cast<double>(r.operations);
+                } else {
+                    out << "null";
+                }
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+        std::cout << out.str();
     }
 };
 
-// Benchmark and testing utilities
-class BenchmarkSuite {
-public:
-    struct BenchmarkConfig {
-        size_t numClients = 100;
-        size_t requestsPerClient = 100;
-        std::chrono::milliseconds test
+namespace {
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--test | --benchmark | --micro] [options]\n"
+              << "  --threads LIST        Comma-separated thread counts, 1-64 (default 1,2,4,8)\n"
+              << "  --clients N           Distinct client ids (default 100)\n"
+              << "  --requests N          Bucket size per client (default 100)\n"
+              << "  --refill-rate R       Tokens per second per client (default 1000)\n"
+              << "  --duration SECONDS    Measured time per run (default 1)\n"
+              << "  --distribution D      uniform, zipf or hot (default uniform)\n"
+              << "  --zipf-s S            Zipf exponent (default 0.99)\n"
+              << "  --hit-ratio F         Share of requests for tracked clients (default 1.0)\n"
+              << "  --backend B           mutex, lockfree, compact, sketch or all (default all)\n"
+              << "  --seed N              Seed for the request sequences (default 42)\n"
+              << "  --iterations N        Calls per operation and thread for --micro (default 1000000)\n"
+              << "  --perf-transfer-event HEX  Raw perf event counted as cache-line transfers for --micro\n"
+              << "                        (e.g. 0x4d2, MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM on Skylake)\n"
+              << "  --json                Print results as JSON\n";
+}
+
+std::vector<size_t> parseList(const std::string& text) {
+    std::vector<size_t> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            values.push_back(std::stoul(item));
+        }
+    }
+    return values;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    enum class Mode { Benchmark, Test, Micro };
+    BenchmarkSuite::BenchmarkConfig config;
+    MicroBenchmark::MicroConfig microConfig;
+    Mode mode = Mode::Benchmark;
+    bool threadsGiven = false;
+    
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("missing value for " + arg);
+                }
+                return argv[++i];
+            };
+            
+            if (arg == "--test") {
+                mode = Mode::Test;
+            } else if (arg == "--benchmark") {
+                mode = Mode::Benchmark;
+            } else if (arg == "--micro") {
+                mode = Mode::Micro;
+            } else if (arg == "--threads") {
+                config.threadCounts = parseList(value());
+                threadsGiven = true;
+            } else if (arg == "--iterations") {
+                microConfig.iterations = std::stoul(value());
+            } else if (arg == "--perf-transfer-event") {
+                microConfig.transferEvent = std::stoull(value(), nullptr, 16);
+            } else if (arg == "--clients") {
+                config.numClients = std::stoul(value());
+            } else if (arg == "--requests") {
+                config.requestsPerClient = std::stoul(value());
+            } else if (arg == "--refill-rate") {
+                config.refillRate = std::stod(value());
+            } else if (arg == "--duration") {
+                config.testDuration = std::chrono::milliseconds(static_cast<int64_t>(std::stod(value()) * 1000.0));
+            } else if (arg == "--distribution") {
+                std::string name = value();
+                if (name == "uniform") {
+                    config.distribution = BenchmarkSuite::Distribution::Uniform;
+                } else if (name == "zipf") {
+                    config.distribution = BenchmarkSuite::Distribution::Zipf;
+                } else if (name == "hot") {
+                    config.distribution = BenchmarkSuite::Distribution::HotKey;
+                } else {
+                    throw std::invalid_argument("unknown distribution " + name);
+                }
+            } else if (arg == "--zipf-s") {
+                config.zipfExponent = std::stod(value());
+            } else if (arg == "--hit-ratio") {
+                config.hitRatio = std::clamp(std::stod(value()), 0.0, 1.0);
+            } else if (arg == "--backend") {
+                std::string name = value();
+                if (name == "mutex") {
+                    config.backends = {BenchmarkSuite::Backend::MutexMap};
+                } else if (name == "lockfree") {
+                    config.backends = {BenchmarkSuite::Backend::LockFreeMap};
+                } else if (name == "compact") {
+                    config.backends = {BenchmarkSuite::Backend::Compact};
+                } else if (name == "sketch") {
+                    config.backends = {BenchmarkSuite::Backend::Sketch};
+                } else if (name != "all") {
+                    throw std::invalid_argument("unknown backend " + name);
+                }
+            } else if (arg == "--seed") {
+                config.seed = std::stoull(value());
+            } else if (arg == "--json") {
+                config.json = true;
+            } else if (arg == "--help" || arg == "-h") {
+                printUsage(argv[0]);
+                return 0;
+            } else {
+                throw std::invalid_argument("unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        printUsage(argv[0]);
+        return 2;
+    }
+    
+    if (mode == Mode::Test) {
+        return BenchmarkSuite::runFunctionalTests() == 0 ? 0 : 1;
+    }
+    
+    if (mode == Mode::Micro) {
+        // Single-threaded unless thread counts were asked for
+        if (threadsGiven) {
+            microConfig.threadCounts = config.threadCounts;
+        }
+        microConfig.json = config.json;
+        MicroBenchmark(microConfig).runAll();
+        return 0;
+    }
+    
+    if (!config.json) {
+        std::cout << "Rate limiter benchmark: " << config.numClients << " clients, "
+                  << BenchmarkSuite::distributionName(config.distribution) << " distribution, hit ratio "
+                  << config.hitRatio << ", " << config.testDuration.count() << " ms per run\n";
+    }
+    BenchmarkSuite(config).runAll();
+    return 0;
+}